@@ -0,0 +1,204 @@
+/*
+ *      file-stamp.h : stat signatures of files used by the menu cache.
+ *
+ *      This file is a part of libmenu-cache package and is used by both
+ *      menu-cache-gen and menu-cached to write and verify the signatures.
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __MENU_CACHE_FILE_STAMP_H__
+#define __MENU_CACHE_FILE_STAMP_H__
+
+#include <glib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Each file or dir listed in the cache header gets a signature line:
+     "-" if file does not exist
+     "?" if state of file cannot be trusted (it was modified too recently)
+     "dev:ino:size:mtime_sec.mtime_nsec" for a file
+   and the same followed by ":md5" for a dir, where md5 is calculated on
+   names and signatures of files in the dir which may affect the menu. */
+
+typedef struct {
+    guint64 dev;
+    guint64 ino;
+    guint64 size;
+    gint64 mtime_sec;
+    glong mtime_nsec;
+} FileStamp;
+
+#ifdef HAVE_STATX
+/* fills @stamp from statx() result, returns FALSE if some data are missing */
+static inline gboolean file_stamp_from_statx(const struct statx *stx, FileStamp *stamp)
+{
+    if ((stx->stx_mask & (STATX_INO | STATX_SIZE | STATX_MTIME)) !=
+            (STATX_INO | STATX_SIZE | STATX_MTIME))
+        return FALSE;
+    stamp->dev = ((guint64)stx->stx_dev_major << 32) | stx->stx_dev_minor;
+    stamp->ino = stx->stx_ino;
+    stamp->size = stx->stx_size;
+    stamp->mtime_sec = stx->stx_mtime.tv_sec;
+    stamp->mtime_nsec = stx->stx_mtime.tv_nsec;
+    return TRUE;
+}
+#endif
+
+/* returns 1 on success, 0 if file does not exist, -1 if state is unknown */
+static int file_stamp_get(int dir_fd, const char *path, FileStamp *stamp)
+{
+#ifdef HAVE_STATX
+    struct statx stx;
+
+    if (statx(dir_fd, path, AT_STATX_SYNC_AS_STAT,
+              STATX_INO | STATX_SIZE | STATX_MTIME, &stx) != 0)
+        return (errno == ENOENT || errno == ENOTDIR) ? 0 : -1;
+    if (!file_stamp_from_statx(&stx, stamp))
+        return -1;
+#else
+    struct stat st;
+
+    if (fstatat(dir_fd, path, &st, 0) != 0)
+        return (errno == ENOENT || errno == ENOTDIR) ? 0 : -1;
+    stamp->dev = st.st_dev;
+    stamp->ino = st.st_ino;
+    stamp->size = st.st_size;
+    stamp->mtime_sec = st.st_mtim.tv_sec;
+    stamp->mtime_nsec = st.st_mtim.tv_nsec;
+#endif
+    return 1;
+}
+
+/* files modified after @since (in microseconds) cannot be trusted since
+   the change might be not seen by menu-cache-gen */
+static inline gboolean file_stamp_is_racy(const FileStamp *stamp, gint64 since)
+{
+    return stamp->mtime_sec * G_USEC_PER_SEC + stamp->mtime_nsec / 1000 >= since;
+}
+
+static inline void file_stamp_print(GString *str, const FileStamp *stamp)
+{
+    g_string_append_printf(str, "%" G_GINT64_MODIFIER "x:%" G_GINT64_MODIFIER "x:%"
+                           G_GINT64_MODIFIER "x:%" G_GINT64_FORMAT ".%09ld",
+                           stamp->dev, stamp->ino, stamp->size,
+                           stamp->mtime_sec, stamp->mtime_nsec);
+}
+
+static gint _file_stamp_cmp(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+/* returns FALSE if state of some file cannot be trusted */
+static gboolean _file_stamp_dir_contents(GChecksum *sum, const char *path, gint64 since)
+{
+    GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+    struct dirent *de;
+    FileStamp stamp;
+    GString *str;
+    DIR *dir;
+    guint i;
+    gboolean ok = TRUE;
+
+    dir = opendir(path);
+    if (dir == NULL)
+        return FALSE;
+    while ((de = readdir(dir)) != NULL)
+    {
+#ifdef _DIRENT_HAVE_D_TYPE
+        if (de->d_type == DT_DIR)
+            continue;
+#endif
+        /* the same files as menu-cached checks on change */
+        if (g_str_has_suffix(de->d_name, ".desktop") ||
+            g_str_has_suffix(de->d_name, ".directory") ||
+            g_str_has_suffix(de->d_name, ".menu"))
+            g_ptr_array_add(names, g_strdup(de->d_name));
+    }
+    /* the order of readdir() is not guaranteed */
+    g_ptr_array_sort(names, _file_stamp_cmp);
+    str = g_string_sized_new(64);
+    for (i = 0; ok && i < names->len; i++)
+    {
+        const char *name = g_ptr_array_index(names, i);
+
+        g_string_assign(str, name);
+        g_string_append_c(str, '\t');
+        switch (file_stamp_get(dirfd(dir), name, &stamp))
+        {
+        case 1:
+            if (file_stamp_is_racy(&stamp, since))
+                ok = FALSE;
+            else
+                file_stamp_print(str, &stamp);
+            break;
+        case 0:
+            g_string_append_c(str, '-');
+            break;
+        default:
+            ok = FALSE;
+        }
+        g_string_append_c(str, '\n');
+        g_checksum_update(sum, (guchar *)str->str, str->len);
+    }
+    g_string_free(str, TRUE);
+    g_ptr_array_free(names, TRUE);
+    closedir(dir);
+    return ok;
+}
+
+/* appends signature for @path, @type is 'D' or 'F' as in the cache header */
+static void file_stamp_append(GString *str, char type, const char *path, gint64 since)
+{
+    FileStamp stamp;
+    GChecksum *sum;
+
+    switch (file_stamp_get(AT_FDCWD, path, &stamp))
+    {
+    case 0:
+        g_string_append_c(str, '-');
+        return;
+    case 1:
+        if (!file_stamp_is_racy(&stamp, since))
+            break;
+        /* fall through */
+    default:
+        g_string_append_c(str, '?');
+        return;
+    }
+    if (type != 'D')
+    {
+        file_stamp_print(str, &stamp);
+        return;
+    }
+    sum = g_checksum_new(G_CHECKSUM_MD5);
+    if (_file_stamp_dir_contents(sum, path, since))
+    {
+        file_stamp_print(str, &stamp);
+        g_string_append_c(str, ':');
+        g_string_append(str, g_checksum_get_string(sum));
+    }
+    else
+        g_string_append_c(str, '?');
+    g_checksum_free(sum);
+}
+
+#endif /* __MENU_CACHE_FILE_STAMP_H__ */
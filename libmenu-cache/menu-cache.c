@@ -38,6 +38,7 @@
 #include <sys/fcntl.h>
 #include <errno.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 
 #include <gio/gio.h>
 
@@ -130,6 +131,9 @@ struct _MenuCache
     guint version;
     guint reload_id;
     gboolean ready : 1; /* used for sync access */
+    char* sum; /* content hash of loaded cache, to check deltas against */
+    MenuCacheFileDir** file_dirs; /* all used files, for items added by delta */
+    int n_file_dirs;
 };
 
 static int server_fd = -1;
@@ -161,6 +165,8 @@ void menu_cache_init(int flags)
 
 static MenuCacheItem* read_item(GDataInputStream* f, MenuCache* cache,
                                 MenuCacheFileDir** all_used_files, int n_all_used_files);
+static gboolean menu_cache_load_contents(MenuCache *cache, char *contents, gsize len,
+                                         GDestroyNotify destroy);
 
 /* functions read_dir(), read_app(), and read_item() should be called for
    items that aren't accessible yet, therefore no lock is required */
@@ -535,6 +541,17 @@ static gboolean read_all_known_des(GDataInputStream* f, MenuCache* cache)
     return TRUE;
 }
 
+static void menu_cache_free_file_dirs(MenuCache *cache)
+{
+    int i;
+
+    for (i = 0; i < cache->n_file_dirs; i++)
+        menu_cache_file_dir_unref(cache->file_dirs[i]);
+    g_free(cache->file_dirs);
+    cache->file_dirs = NULL;
+    cache->n_file_dirs = 0;
+}
+
 static MenuCache* menu_cache_new( const char* cache_file )
 {
     MenuCache* cache;
@@ -613,6 +630,8 @@ void menu_cache_unref(MenuCache* cache)
         /* g_free( cache->menu_file_path ); */
         g_strfreev(cache->known_des);
         g_slist_free(cache->notifiers);
+        menu_cache_free_file_dirs(cache);
+        g_free(cache->sum);
         g_slice_free( MenuCache, cache );
     }
     else
@@ -775,36 +794,74 @@ static gboolean reload_notify(gpointer data)
  */
 gboolean menu_cache_reload( MenuCache* cache )
 {
-    char* line;
     gsize len;
     GFile* file;
-    GFileInputStream* istr = NULL;
+    char *contents;
+
+    file = g_file_new_for_path(cache->cache_file);
+    if(!file)
+        return FALSE;
+    /* load it at once so we can check deltas against it later */
+    if (!g_file_load_contents(file, cache->cancellable, &contents, &len, NULL, NULL))
+    {
+        g_object_unref(file);
+        return FALSE;
+    }
+    g_object_unref(file);
+    return menu_cache_load_contents(cache, contents, len, g_free);
+}
+
+/* loads cache from memory shared by menu-cached, closes @fd */
+static gboolean menu_cache_reload_from_fd(MenuCache *cache, int fd)
+{
+    struct stat st;
+    void *data;
+    gboolean ret;
+
+    if (fstat(fd, &st) < 0 || st.st_size <= 0)
+    {
+        close(fd);
+        return FALSE;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return FALSE;
+    ret = menu_cache_load_contents(cache, data, st.st_size, NULL);
+    munmap(data, st.st_size);
+    return ret;
+}
+
+static gboolean menu_cache_load_contents(MenuCache *cache, char *contents, gsize len,
+                                         GDestroyNotify destroy)
+{
+    char* line;
+    GInputStream* istr = NULL;
     GDataInputStream* f;
     MenuCacheFileDir** all_used_files;
     int i, n;
     int ver_maj, ver_min;
+    char *sum = NULL;
+    gsize size = len;
 
     MENU_CACHE_LOCK;
     if (cache->reload_id)
         g_source_remove(cache->reload_id);
     cache->reload_id = 0;
     MENU_CACHE_UNLOCK;
-    file = g_file_new_for_path(cache->cache_file);
-    if(!file)
-        return FALSE;
-    istr = g_file_read(file, cache->cancellable, NULL);
-    g_object_unref(file);
-    if(!istr)
-        return FALSE;
-    f = g_data_input_stream_new(G_INPUT_STREAM(istr));
+    istr = g_memory_input_stream_new_from_data(contents, len, destroy);
+    f = g_data_input_stream_new(istr);
     g_object_unref(istr);
     if( ! f )
         return FALSE;
 
-    /* the first line is version number */
+    /* the first line is version number, optionally followed by content hash */
     line = g_data_input_stream_read_line(f, &len, cache->cancellable, NULL);
     if(G_LIKELY(line))
     {
+        char *tab = strchr(line, '\t');
+        if (tab && strlen(&tab[1]) == 32)
+            sum = g_strdup(&tab[1]);
         len = sscanf(line, "%d.%d", &ver_maj, &ver_min);
         g_free(line);
         if(len < 2)
@@ -815,6 +872,9 @@ gboolean menu_cache_reload( MenuCache* cache )
     }
     else
         goto _fail;
+    /* old generator: the contents are the identity */
+    if (sum == NULL)
+        sum = g_compute_checksum_for_data(G_CHECKSUM_MD5, (guchar *)contents, size);
 
     g_debug("menu cache: got file version 1.%d", ver_min);
     /* the second line is menu name */
@@ -851,6 +911,7 @@ gboolean menu_cache_reload( MenuCache* cache )
         g_free(all_used_files);
 _fail:
         g_object_unref(f);
+        g_free(sum);
         return FALSE;
     }
     cache->version = ver_min;
@@ -861,14 +922,110 @@ _fail:
     cache->root_dir = (MenuCacheDir*)read_item( f, cache, all_used_files, n );
     g_object_unref(f);
 
+    /* keep used files for items which may be added later by delta */
+    menu_cache_free_file_dirs(cache);
+    cache->file_dirs = all_used_files;
+    cache->n_file_dirs = n;
+    g_free(cache->sum);
+    cache->sum = cache->root_dir ? sum : NULL;
+    if (cache->root_dir == NULL)
+        g_free(sum);
+
     g_idle_add_full(G_PRIORITY_HIGH_IDLE, reload_notify, menu_cache_ref(cache),
                     (GDestroyNotify)menu_cache_unref);
     MENU_CACHE_UNLOCK;
 
-    for (i = 0; i < n; i++)
-        menu_cache_file_dir_unref(all_used_files[i]);
-    g_free(all_used_files);
+    return TRUE;
+}
+
+static MenuCacheDir *find_dir_by_positions(MenuCacheDir *dir, const char *path)
+{
+    char *end;
+    gulong pos;
+
+    while (*path)
+    {
+        pos = strtoul(path, &end, 10);
+        if (end == path || (*end != '/' && *end != '\0'))
+            return NULL;
+        dir = g_slist_nth_data(dir->children, pos);
+        if (dir == NULL || MENU_CACHE_ITEM(dir)->type != MENU_CACHE_TYPE_DIR)
+            return NULL;
+        path = (*end == '/') ? end + 1 : end;
+    }
+    return dir;
+}
+
+/* applies delta received from menu-cached to the loaded menu tree
+   returns FALSE if menu should be reloaded from the file */
+static gboolean menu_cache_apply_delta(MenuCache *cache, const char *old_sum,
+                                       const char *new_sum, char *data, gsize len)
+{
+    GInputStream *istr;
+    GDataInputStream *f;
+    MenuCacheDir *dir;
+    MenuCacheItem *item;
+    GSList *l;
+    char *line, *sep;
+    gsize line_len;
+    gulong pos;
+    gboolean ok = TRUE;
 
+    /* the delta is computed against the generation we don't have */
+    if (cache->root_dir == NULL || g_strcmp0(cache->sum, old_sum) != 0)
+        return FALSE;
+    if (len == 0) /* nothing to do */
+        return TRUE;
+    istr = g_memory_input_stream_new_from_data(data, len, NULL);
+    f = g_data_input_stream_new(istr);
+    g_object_unref(istr);
+    while (ok && (line = g_data_input_stream_read_line(f, &line_len, NULL, NULL)) != NULL)
+    {
+        ok = FALSE;
+        sep = strchr(line, '\t');
+        if (line_len < 3 || sep == NULL)
+            goto _next;
+        *sep++ = '\0';
+        dir = find_dir_by_positions(cache->root_dir, &line[1]);
+        if (dir == NULL)
+            goto _next;
+        pos = strtoul(sep, NULL, 10);
+        if (line[0] == '-' || line[0] == '=')
+        {
+            l = g_slist_nth(dir->children, pos);
+            if (l == NULL)
+                goto _next;
+            item = l->data;
+            dir->children = g_slist_delete_link(dir->children, l);
+            item->parent = NULL;
+            menu_cache_item_unref(item);
+        }
+        else if (line[0] != '+')
+            goto _next;
+        if (line[0] != '-')
+        {
+            if (pos > g_slist_length(dir->children))
+                goto _next;
+            item = read_item(f, cache, cache->file_dirs, cache->n_file_dirs);
+            if (item == NULL)
+                goto _next;
+            item->parent = dir;
+            dir->children = g_slist_insert(dir->children, item, pos);
+        }
+        ok = TRUE;
+_next:
+        g_free(line);
+    }
+    g_object_unref(f);
+    if (!ok)
+    {
+        g_warning("menu cache: failed to apply delta, reloading");
+        return FALSE;
+    }
+    g_free(cache->sum);
+    cache->sum = g_strdup(new_sum);
+    g_idle_add_full(G_PRIORITY_HIGH_IDLE, reload_notify, menu_cache_ref(cache),
+                    (GDestroyNotify)menu_cache_unref);
     return TRUE;
 }
 
@@ -1585,6 +1742,71 @@ retry_wait:
     return TRUE;
 }
 
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0
+#endif
+
+/* reads data from server socket, collecting file descriptors passed by it;
+   descriptor which was lost is added as -1 so its message doesn't take
+   descriptor of another one */
+static ssize_t read_from_server(int fd, char *buf, size_t len, GSList **fds)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * 4)];
+    } ctl;
+    ssize_t sz;
+    int i, n, rfd;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    do
+        sz = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    while (sz < 0 && errno == EINTR);
+    if (sz <= 0)
+        return sz;
+    if (msg.msg_flags & MSG_CTRUNC)
+    {
+        /* server sends single descriptor with a message, if it didn't fit
+           then don't trust any of them, it will be reloaded by path */
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (i = 0; i < n; i++)
+            {
+                memcpy(&rfd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                close(rfd);
+            }
+        }
+        *fds = g_slist_append(*fds, GINT_TO_POINTER(-1));
+        return sz;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < n; i++)
+        {
+            memcpy(&rfd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (MSG_CMSG_CLOEXEC == 0) /* set atomically otherwise */
+                fcntl(rfd, F_SETFD, FD_CLOEXEC);
+            *fds = g_slist_append(*fds, GINT_TO_POINTER(rfd));
+        }
+    }
+    return sz;
+}
+
 /* this thread is started by connect_server() */
 static gpointer server_io_thread(gpointer data)
 {
@@ -1595,10 +1817,11 @@ static gpointer server_io_thread(gpointer data)
     GHashTableIter it;
     char* menu_name;
     MenuCache* cache;
+    GSList *fds = NULL; /* file descriptors received but not used yet */
 
     while(fd >= 0)
     {
-        sz = read(fd, &buf[ptr], sizeof(buf) - ptr);
+        sz = read_from_server(fd, &buf[ptr], sizeof(buf) - ptr, &fds);
         if(sz <= 0) /* socket error or EOF */
         {
             MENU_CACHE_LOCK;
@@ -1663,7 +1886,15 @@ static gpointer server_io_thread(gpointer data)
             buf[ptr] = '\0';
             if(memcmp(buf, "REL:", 4) == 0) /* reload */
             {
+                int cache_fd = -1;
+
                 DEBUG("server ask us to reload cache: %s", &buf[4]);
+                /* REL:md5\tFD means the cache is passed with the message */
+                if (ptr > 36 && strcmp(&buf[36], "\tFD") == 0 && fds != NULL)
+                {
+                    cache_fd = GPOINTER_TO_INT(fds->data);
+                    fds = g_slist_delete_link(fds, fds);
+                }
                 MENU_CACHE_LOCK;
                 if(hash)
                 {
@@ -1673,15 +1904,80 @@ static gpointer server_io_thread(gpointer data)
                         if(memcmp(cache->md5, &buf[4], 32) == 0)
                         {
                             DEBUG("RELOAD!");
-                            menu_cache_reload(cache);
+                            if (cache_fd < 0 || !menu_cache_reload_from_fd(cache, cache_fd))
+                                menu_cache_reload(cache);
+                            cache_fd = -1;
                             SET_CACHE_READY(cache);
                             break;
                         }
                     }
                 }
                 MENU_CACHE_UNLOCK;
+                if (cache_fd >= 0) /* not used */
+                    close(cache_fd);
                 /* DEBUG("cache reloaded"); */
             }
+            else if(memcmp(buf, "DLT:", 4) == 0) /* delta against known generation */
+            {
+                /* DLT:md5\told_sum\tnew_sum\tsize and then size bytes of delta */
+                char **parts = g_strsplit(&buf[4], "\t", 4);
+                char *delta = NULL;
+                gsize size = 0, got = 0;
+
+                if (g_strv_length(parts) == 4)
+                {
+                    size = strtoul(parts[3], NULL, 10);
+                    delta = g_try_malloc(size + 1);
+                }
+                if (delta == NULL)
+                {
+                    g_strfreev(parts);
+                    g_warning("menu cache: got garbage from server, break connect");
+                    shutdown(fd, SHUT_RDWR); /* drop connection */
+                    break; /* we handle it above */
+                }
+                /* take what is already in buffer */
+                got = MIN((gsize)sz - 1, size);
+                memcpy(delta, &buf[ptr+1], got);
+                ptr += got;
+                sz -= got;
+                /* and read the rest from the socket */
+                while (got < size)
+                {
+                    ssize_t rd = read_from_server(fd, &delta[got], size - got, &fds);
+                    if (rd <= 0)
+                        break;
+                    got += rd;
+                }
+                if (got < size)
+                {
+                    g_free(delta);
+                    g_strfreev(parts);
+                    shutdown(fd, SHUT_RDWR); /* we handle it above */
+                    break;
+                }
+                DEBUG("server sent delta for cache: %s", parts[0]);
+                MENU_CACHE_LOCK;
+                if(hash)
+                {
+                    g_hash_table_iter_init(&it, hash);
+                    while(g_hash_table_iter_next(&it, (gpointer*)&menu_name, (gpointer*)&cache))
+                    {
+                        if(memcmp(cache->md5, parts[0], 32) == 0)
+                        {
+                            /* on generation gap do full reload instead */
+                            if (!menu_cache_apply_delta(cache, parts[1], parts[2],
+                                                        delta, size))
+                                menu_cache_reload(cache);
+                            SET_CACHE_READY(cache);
+                            break;
+                        }
+                    }
+                }
+                MENU_CACHE_UNLOCK;
+                g_free(delta);
+                g_strfreev(parts);
+            }
             else
                 g_warning("menu cache: unrecognized input: %s", buf);
             /* go to next line */
@@ -1696,6 +1992,12 @@ static gpointer server_io_thread(gpointer data)
         server_fd = -1;
     G_UNLOCK(connect);
     close(fd);
+    while (fds)
+    {
+        if (GPOINTER_TO_INT(fds->data) >= 0)
+            close(GPOINTER_TO_INT(fds->data));
+        fds = g_slist_delete_link(fds, fds);
+    }
     /* DEBUG("server io thread terminated"); */
 #if GLIB_CHECK_VERSION(2, 32, 0)
     g_thread_unref(g_thread_self());
@@ -1759,6 +2061,10 @@ retry:
         return FALSE;
     }
     server_fd = fd;
+    /* tell server which extensions of protocol we support, older server
+       versions just ignore this */
+    if (write(fd, "CAP:DLT\tFD\n", 11) < 11)
+        DEBUG("connect_server: sending capabilities failed");
     G_UNLOCK(connect);
 #if GLIB_CHECK_VERSION(2, 32, 0)
     g_thread_new("menu-cache-io", server_io_thread, GINT_TO_POINTER(fd));
@@ -0,0 +1,457 @@
+/*
+ *      file-watch.c : watches for files and dirs used by menu caches.
+ *
+ *      This file is a part of libmenu-cache package and created program
+ *      should be not used without the library.
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "file-watch.h"
+
+#include <gio/gio.h>
+#include <string.h>
+
+#if defined(HAVE_SYS_INOTIFY_H) && defined(HAVE_INOTIFY_INIT1)
+#define USE_INOTIFY 1
+#include <sys/inotify.h>
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+#ifdef G_ENABLE_DEBUG
+#define DEBUG(...)  g_debug(__VA_ARGS__)
+#else
+#define DEBUG(...)
+#endif
+
+#ifdef USE_INOTIFY
+typedef struct _InotifyNode InotifyNode;
+#endif
+
+struct _FileWatch
+{
+    char *path;
+    gboolean is_dir;
+    FileWatchFunc func;
+    gpointer user_data;
+#ifdef USE_INOTIFY
+    InotifyNode *node; /* the dir, or dir containing the file */
+    char *name; /* basename of the file */
+#endif
+    GFileMonitor *mon; /* if inotify cannot be used */
+};
+
+static void _on_monitor_changed(GFileMonitor *mon, GFile *gf, GFile *other,
+                                GFileMonitorEvent evt, FileWatch *watch)
+{
+    char *path = g_file_get_path(gf);
+
+    watch->func(watch, path, FILE_WATCH_CHANGED, watch->user_data);
+    g_free(path);
+    if (other != NULL)
+    {
+        path = g_file_get_path(other);
+        watch->func(watch, path, FILE_WATCH_CHANGED, watch->user_data);
+        g_free(path);
+    }
+}
+
+static void _watch_fallback(FileWatch *watch)
+{
+    GFile *gf = g_file_new_for_path(watch->path);
+
+    if (watch->is_dir)
+        watch->mon = g_file_monitor_directory(gf, 0, NULL, NULL);
+    else
+        watch->mon = g_file_monitor_file(gf, 0, NULL, NULL);
+    if (watch->mon)
+        g_signal_connect(watch->mon, "changed",
+                         G_CALLBACK(_on_monitor_changed), watch);
+    g_object_unref(gf);
+}
+
+#ifdef USE_INOTIFY
+/* Each watched dir has a node, keyed by watch descriptor. Dir watches are
+   recursive: subdirs get own nodes linked to their parent, and if some new
+   subdir appears, it is watched at once and files found in it are reported,
+   so nothing is missed before the menu is generated again. All the nodes
+   share single inotify descriptor which is read in batches. */
+struct _InotifyNode
+{
+    int wd;
+    char *path;
+    const char *name; /* basename in path */
+    InotifyNode *parent; /* if added as subdir of recursive watch */
+    GSList *children;
+    GSList *watches; /* FileWatch on this dir or on files in it */
+    gboolean scanned; /* subdirs are added */
+};
+
+#define INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_ATTRIB | \
+                      IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+static int inotify_fd = -2; /* -1 if it's not available */
+static GHashTable *inotify_nodes = NULL; /* wd -> InotifyNode */
+
+static gboolean _on_inotify_event(GIOChannel *channel, GIOCondition cond,
+                                  gpointer user_data);
+
+static gboolean _inotify_init(void)
+{
+    GIOChannel *channel;
+
+    if (inotify_fd != -2)
+        return (inotify_fd >= 0);
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0)
+    {
+        DEBUG("inotify isn't available, using GIO monitors");
+        return FALSE;
+    }
+    inotify_nodes = g_hash_table_new(g_direct_hash, g_direct_equal);
+    channel = g_io_channel_unix_new(inotify_fd);
+    g_io_add_watch(channel, G_IO_IN, _on_inotify_event, NULL);
+    g_io_channel_unref(channel);
+    return TRUE;
+}
+
+/* a dir is watched with subdirs if there is a dir watch on it or on parents */
+static gboolean _node_is_recursive(InotifyNode *node)
+{
+    GSList *l;
+
+    for (; node; node = node->parent)
+        for (l = node->watches; l; l = l->next)
+            if (((FileWatch *)l->data)->is_dir)
+                return TRUE;
+    return FALSE;
+}
+
+/* sends event about @name in the dir to watches on it and on its parents */
+static void _node_notify(InotifyNode *node, const char *name, FileWatchEvent evt)
+{
+    char *path = name ? g_build_filename(node->path, name, NULL) : g_strdup(node->path);
+    InotifyNode *n;
+    FileWatch *watch;
+    GSList *l;
+
+    for (n = node; n; n = n->parent)
+        for (l = n->watches; l; l = l->next)
+        {
+            watch = l->data;
+            if (watch->is_dir ||
+                (n == node && name != NULL && strcmp(watch->name, name) == 0))
+                watch->func(watch, path, evt, watch->user_data);
+        }
+    g_free(path);
+}
+
+static InotifyNode *_node_get(const char *path, InotifyNode *parent, gboolean recursive,
+                              gboolean report);
+
+/* adds subdirs, files are reported to parents if @report is TRUE */
+static void _node_scan(InotifyNode *node, gboolean report)
+{
+    GDir *dir = g_dir_open(node->path, 0, NULL);
+    const char *name;
+    char *path;
+
+    if (dir == NULL)
+        return;
+    while ((name = g_dir_read_name(dir)) != NULL)
+    {
+        path = g_build_filename(node->path, name, NULL);
+        if (g_file_test(path, G_FILE_TEST_IS_DIR))
+            _node_get(path, node, TRUE, report);
+        else if (report)
+            _node_notify(node, name, FILE_WATCH_CHANGED);
+        g_free(path);
+    }
+    g_dir_close(dir);
+}
+
+/* returns node for the dir, creating it if needed */
+static InotifyNode *_node_get(const char *path, InotifyNode *parent, gboolean recursive,
+                              gboolean report)
+{
+    InotifyNode *node, *n;
+    int wd = inotify_add_watch(inotify_fd, path, INOTIFY_MASK | IN_ONLYDIR);
+
+    if (wd < 0)
+        return NULL;
+    /* the same dir may be already watched, maybe by another path */
+    node = g_hash_table_lookup(inotify_nodes, GINT_TO_POINTER(wd));
+    if (node == NULL)
+    {
+        node = g_slice_new0(InotifyNode);
+        node->wd = wd;
+        node->path = g_strdup(path);
+        node->name = strrchr(node->path, G_DIR_SEPARATOR);
+        node->name = node->name ? node->name + 1 : node->path;
+        g_hash_table_insert(inotify_nodes, GINT_TO_POINTER(wd), node);
+    }
+    if (parent != NULL && node->parent == NULL)
+    {
+        /* symlinks may make a loop */
+        for (n = parent; n; n = n->parent)
+            if (n == node)
+                break;
+        if (n == NULL)
+        {
+            node->parent = parent;
+            parent->children = g_slist_prepend(parent->children, node);
+        }
+    }
+    if (recursive && !node->scanned)
+    {
+        node->scanned = TRUE;
+        _node_scan(node, report);
+    }
+    return node;
+}
+
+static void _node_free(InotifyNode *node)
+{
+    if (node->parent)
+        node->parent->children = g_slist_remove(node->parent->children, node);
+    g_hash_table_remove(inotify_nodes, GINT_TO_POINTER(node->wd));
+    /* it fails if the dir is gone already, that's fine */
+    inotify_rm_watch(inotify_fd, node->wd);
+    g_free(node->path);
+    g_slice_free(InotifyNode, node);
+}
+
+/* drops @node and its subdirs if they aren't needed anymore */
+static void _node_release(InotifyNode *node)
+{
+    GSList *children, *l;
+
+    if (_node_is_recursive(node))
+        return;
+    /* subdirs were added only for recursive watch */
+    children = node->children;
+    node->children = NULL;
+    node->scanned = FALSE;
+    for (l = children; l; l = l->next)
+    {
+        ((InotifyNode *)l->data)->parent = NULL;
+        _node_release(l->data);
+    }
+    g_slist_free(children);
+    if (node->watches == NULL)
+        _node_free(node);
+}
+
+/* the dir was removed or moved away with all its subdirs, watches on them
+   are passed to GIO which can wait for the path to appear again */
+static void _node_lost(InotifyNode *node)
+{
+    GSList *watches = node->watches, *children = node->children, *l;
+    FileWatch *watch;
+
+    node->children = NULL;
+    for (l = children; l; l = l->next)
+    {
+        ((InotifyNode *)l->data)->parent = NULL;
+        _node_lost(l->data);
+    }
+    g_slist_free(children);
+    node->watches = NULL;
+    _node_free(node);
+    for (l = watches; l; l = l->next)
+    {
+        watch = l->data;
+        watch->node = NULL;
+        _watch_fallback(watch);
+        watch->func(watch, watch->path, FILE_WATCH_CHANGED, watch->user_data);
+    }
+    g_slist_free(watches);
+}
+
+static InotifyNode *_node_find_child(InotifyNode *node, const char *name)
+{
+    GSList *l;
+
+    for (l = node->children; l; l = l->next)
+        if (strcmp(((InotifyNode *)l->data)->name, name) == 0)
+            return l->data;
+    return NULL;
+}
+
+static void _handle_overflow(void)
+{
+    GHashTableIter iter;
+    gpointer node;
+    GSList *l;
+    FileWatch *watch;
+
+    /* some events are lost so everything might be changed */
+    DEBUG("inotify queue overflow");
+    g_hash_table_iter_init(&iter, inotify_nodes);
+    while (g_hash_table_iter_next(&iter, NULL, &node))
+        for (l = ((InotifyNode *)node)->watches; l; l = l->next)
+        {
+            watch = l->data;
+            watch->func(watch, watch->path, FILE_WATCH_CHANGED, watch->user_data);
+        }
+}
+
+static void _handle_event(struct inotify_event *ev)
+{
+    InotifyNode *node, *child;
+    const char *name;
+    char *path;
+
+    if (ev->mask & IN_Q_OVERFLOW)
+    {
+        _handle_overflow();
+        return;
+    }
+    node = g_hash_table_lookup(inotify_nodes, GINT_TO_POINTER(ev->wd));
+    if (node == NULL) /* it was removed already */
+        return;
+    if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT))
+    {
+        _node_lost(node);
+        return;
+    }
+    name = ev->len > 0 ? ev->name : NULL;
+    if (name != NULL && (ev->mask & IN_ISDIR))
+    {
+        if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && _node_is_recursive(node))
+        {
+            path = g_build_filename(node->path, name, NULL);
+            _node_get(path, node, TRUE, TRUE);
+            g_free(path);
+            _node_notify(node, name, FILE_WATCH_SUBDIR_ADDED);
+            return;
+        }
+        if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+        {
+            child = _node_find_child(node, name);
+            if (child != NULL)
+            {
+                node->children = g_slist_remove(node->children, child);
+                child->parent = NULL;
+                _node_release(child);
+            }
+            _node_notify(node, name, FILE_WATCH_SUBDIR_REMOVED);
+            return;
+        }
+    }
+    _node_notify(node, name, FILE_WATCH_CHANGED);
+}
+
+static gboolean _on_inotify_event(GIOChannel *channel, GIOCondition cond,
+                                  gpointer user_data)
+{
+    union {
+        struct inotify_event ev; /* for alignment */
+        char buf[16384];
+    } events;
+    struct inotify_event *ev;
+    gssize len, i;
+
+    /* read all what is queued, a package manager may make hundreds of events */
+    for (;;)
+    {
+        len = read(inotify_fd, events.buf, sizeof(events.buf));
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            break;
+        for (i = 0; i < len; i += sizeof(struct inotify_event) + ev->len)
+        {
+            ev = (struct inotify_event *)&events.buf[i];
+            _handle_event(ev);
+        }
+    }
+    return TRUE;
+}
+#endif /* USE_INOTIFY */
+
+FileWatch *file_watch_new(const char *path, gboolean is_dir,
+                          FileWatchFunc func, gpointer user_data)
+{
+    FileWatch *watch = g_slice_new0(FileWatch);
+#ifdef USE_INOTIFY
+    InotifyNode *node;
+    char *dir;
+#endif
+
+    watch->path = g_strdup(path);
+    watch->is_dir = is_dir;
+    watch->func = func;
+    watch->user_data = user_data;
+    DEBUG("monitor: %s", path);
+#ifdef USE_INOTIFY
+    if (_inotify_init())
+    {
+        /* file is watched in its dir so it's not lost if it's replaced */
+        if (is_dir)
+            node = _node_get(path, NULL, TRUE, FALSE);
+        else
+        {
+            dir = g_path_get_dirname(path);
+            node = _node_get(dir, NULL, FALSE, FALSE);
+            g_free(dir);
+            watch->name = g_path_get_basename(path);
+        }
+        if (node != NULL)
+        {
+            watch->node = node;
+            node->watches = g_slist_prepend(node->watches, watch);
+            return watch;
+        }
+    }
+#endif
+    _watch_fallback(watch);
+    return watch;
+}
+
+void file_watch_free(FileWatch *watch)
+{
+    if (watch->mon)
+    {
+        g_signal_handlers_disconnect_by_func(watch->mon, _on_monitor_changed, watch);
+        g_file_monitor_cancel(watch->mon);
+        g_object_unref(watch->mon);
+    }
+#ifdef USE_INOTIFY
+    if (watch->node)
+    {
+        watch->node->watches = g_slist_remove(watch->node->watches, watch);
+        _node_release(watch->node);
+    }
+    g_free(watch->name);
+#endif
+    g_free(watch->path);
+    g_slice_free(FileWatch, watch);
+}
+
+const char *file_watch_get_path(FileWatch *watch)
+{
+    return watch->path;
+}
+
+gboolean file_watch_is_dir(FileWatch *watch)
+{
+    return watch->is_dir;
+}
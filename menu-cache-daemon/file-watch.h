@@ -0,0 +1,53 @@
+/*
+ *      file-watch.h : watches for files and dirs used by menu caches.
+ *
+ *      This file is a part of libmenu-cache package and created program
+ *      should be not used without the library.
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __MENU_CACHED_FILE_WATCH_H__
+#define __MENU_CACHED_FILE_WATCH_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+    FILE_WATCH_CHANGED, /* file was created, changed or removed */
+    FILE_WATCH_SUBDIR_ADDED, /* new subdir is watched, its files are reported */
+    FILE_WATCH_SUBDIR_REMOVED /* subdir is gone with all files in it */
+} FileWatchEvent;
+
+typedef struct _FileWatch FileWatch;
+
+typedef void (*FileWatchFunc)(FileWatch *watch, const char *path,
+                              FileWatchEvent evt, gpointer user_data);
+
+/* watches file @path, or dir @path with all its subdirs if @is_dir is TRUE;
+   the path doesn't have to exist. Subdirs are watched only with inotify,
+   otherwise changes of subdirs are reported as FILE_WATCH_CHANGED. */
+FileWatch *file_watch_new(const char *path, gboolean is_dir,
+                          FileWatchFunc func, gpointer user_data);
+void file_watch_free(FileWatch *watch);
+
+const char *file_watch_get_path(FileWatch *watch);
+gboolean file_watch_is_dir(FileWatch *watch);
+
+G_END_DECLS
+
+#endif /* __MENU_CACHED_FILE_WATCH_H__ */
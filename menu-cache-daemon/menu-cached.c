@@ -30,6 +30,9 @@
 
 #include "menu-cache.h"
 #include "version.h"
+#include "file-stamp.h"
+#include "menu-gen.h"
+#include "file-watch.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -45,8 +48,12 @@
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#include <locale.h>
 #include <utime.h>
 #include <sys/wait.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
 
 #ifdef G_ENABLE_DEBUG
 #define DEBUG(...)  g_debug(__VA_ARGS__)
@@ -57,15 +64,16 @@
 typedef struct _Cache
 {
     char md5[33]; /* cache id */
+    char sum[33]; /* content hash of current generation, may be empty */
     /* environment */
     char* menu_name;
     char* lang_name;
     char** env; /* XDG- env variables */
 
-    /* files involved, and their monitors */
+    /* files involved, and their watches */
     int n_files;
     char** files;
-    GFileMonitor** mons;
+    struct _SharedWatch** watches;
     /* GFileMonitor* cache_mon; */
 
     gboolean need_reload;
@@ -77,44 +85,171 @@ typedef struct _Cache
 
     /* cache file name for reference */
     char *cache_file;
+
+    /* sealed copy of the cache file for clients, or -1 */
+    int memfd;
+
+    /* generation is queued or running in gen_pool */
+    gboolean generating;
+    gboolean free_pending; /* unused, it's freed when generation ends */
+    struct _CacheGroup* group; /* caches generated together with it */
+    char* prev_data; /* previous generation to make delta against */
+    gsize prev_len;
+    GSList* waiting; /* clients registered while there was no cache file */
 }Cache;
 
+/* caches of the same menu in the same environment differ only in language
+   or "+hidden" suffix, they are generated by single run which shares parsed
+   desktop entries and composed menu tree */
+typedef struct _CacheGroup
+{
+    char* key; /* menu name without "+hidden" and environment */
+    char* data_file; /* parsed entries and merged menu are kept by it */
+    GSList* caches;
+    MenuCacheGenStore* store; /* parsed desktop entries for the generator */
+    gboolean generating; /* a job is queued or running in gen_pool */
+    gboolean gen_again; /* run it once more after it finishes */
+    guint start_handler;
+}CacheGroup;
+
+/* generation of caches of a group */
+typedef struct
+{
+    CacheGroup* group;
+    GSList* caches;
+    MenuCacheGenOutput* outputs; /* result for each cache, set by the worker thread */
+}GenJob;
+
 typedef struct ClientIO_ {
     guint source_id;
     GIOChannel *channel;
+    gboolean accepts_delta : 1; /* client announced CAP:DLT */
+    gboolean accepts_fd : 1; /* client announced CAP:FD */
 } ClientIO;
 
+/* don't send delta if it's bigger than this part of the cache file */
+#define MAX_DELTA_PART 4
+
 static GMainLoop* main_loop = NULL;
 
 static GHashTable* hash = NULL;
 
 static char *socket_file = NULL;
 
-static void on_file_changed( GFileMonitor* mon, GFile* gf, GFile* other,
-                             GFileMonitorEvent evt, Cache* cache );
+/* caches are generated in few threads so a slow one doesn't delay others */
+#define MAX_GEN_THREADS 4
+static GThreadPool *gen_pool = NULL;
+
+/* used files are watched once for all caches, each change is sent to
+   every cache which uses the file */
+typedef struct _SharedWatch
+{
+    char *file; /* prefixed as in cache->files */
+    FileWatch *watch;
+    GSList *caches; /* one reference per use */
+} SharedWatch;
+
+static GHashTable *shared_watches = NULL; /* file -> SharedWatch */
+
+static void on_file_changed(FileWatch *watch, const char *path,
+                            FileWatchEvent evt, gpointer user_data);
+
+/* gets watch for used file @file of @cache */
+static SharedWatch *watch_ref(Cache *cache, const char *file)
+{
+    SharedWatch *sw = g_hash_table_lookup(shared_watches, file);
+
+    if (sw == NULL)
+    {
+        sw = g_slice_new(SharedWatch);
+        sw->file = g_strdup(file);
+        sw->caches = NULL;
+        sw->watch = file_watch_new(file + 1, file[0] == 'D', on_file_changed, sw);
+        g_hash_table_insert(shared_watches, sw->file, sw);
+    }
+    sw->caches = g_slist_prepend(sw->caches, cache);
+    return sw;
+}
+
+static void watch_unref(SharedWatch *sw, Cache *cache)
+{
+    sw->caches = g_slist_remove(sw->caches, cache);
+    if (sw->caches != NULL)
+        return;
+    g_hash_table_remove(shared_watches, sw->file);
+    file_watch_free(sw->watch);
+    g_free(sw->file);
+    g_slice_free(SharedWatch, sw);
+}
+
+static GHashTable *groups = NULL; /* key -> CacheGroup */
+
+static void cache_group_join(Cache *cache)
+{
+    char *env = g_strjoinv("\t", cache->env);
+    int len = strlen(cache->menu_name);
+    char *key, *dir, *sum;
+    CacheGroup *group;
+
+    /* "+hidden" variant is generated with the menu itself */
+    if (g_str_has_suffix(cache->menu_name, "+hidden"))
+        len -= 7;
+    key = g_strdup_printf("%.*s\t%s", len, cache->menu_name, env);
+    g_free(env);
+    group = g_hash_table_lookup(groups, key);
+    if (group == NULL)
+    {
+        group = g_slice_new0(CacheGroup);
+        group->key = key;
+        /* the name doesn't depend on which caches are in the group now */
+        dir = g_path_get_dirname(cache->cache_file);
+        sum = g_compute_checksum_for_string(G_CHECKSUM_MD5, key, -1);
+        group->data_file = g_strdup_printf("%s" G_DIR_SEPARATOR_S "group-%s", dir, sum);
+        g_free(dir);
+        g_free(sum);
+        group->store = menu_cache_gen_store_new();
+        g_hash_table_insert(groups, group->key, group);
+    }
+    else
+        g_free(key);
+    group->caches = g_slist_append(group->caches, cache);
+    cache->group = group;
+}
+
+/* it's never called while the cache is generating */
+static void cache_group_leave(Cache *cache)
+{
+    CacheGroup *group = cache->group;
+
+    group->caches = g_slist_remove(group->caches, cache);
+    if (group->caches != NULL)
+        return;
+    if (group->start_handler)
+        g_source_remove(group->start_handler);
+    g_hash_table_remove(groups, group->key);
+    menu_cache_gen_store_free(group->store);
+    g_free(group->key);
+    g_free(group->data_file);
+    g_slice_free(CacheGroup, group);
+}
 
 static void on_client_closed(gpointer user_data);
 
-static gboolean delayed_cache_free(gpointer data)
+static gboolean delayed_reload( Cache* cache );
+
+static void do_cache_free(Cache* cache)
 {
-    Cache* cache = data;
     int i;
 
-    if(g_source_is_destroyed(g_main_current_source()))
-        return FALSE;
-
     g_hash_table_remove( hash, cache->md5 );
     /* DEBUG("menu cache freed"); */
     for(i = 0; i < cache->n_files; ++i)
-    {
-        g_file_monitor_cancel( cache->mons[i] );
-        g_object_unref( cache->mons[i] );
-    }
+        watch_unref(cache->watches[i], cache);
 /*
     g_file_monitor_cancel(cache->cache_mon);
     g_object_unref(cache->cache_mon);
 */
-    g_free( cache->mons );
+    g_free( cache->watches );
     g_free(cache->menu_name);
     g_free(cache->lang_name);
     g_free(cache->cache_file);
@@ -123,11 +258,31 @@ static gboolean delayed_cache_free(gpointer data)
 
     if( cache->delayed_reload_handler )
         g_source_remove( cache->delayed_reload_handler );
+    if (cache->memfd >= 0)
+        close(cache->memfd);
+    g_free(cache->prev_data);
+    g_slist_free(cache->waiting);
+    cache_group_leave(cache);
 
     g_slice_free( Cache, cache );
 
     if(g_hash_table_size(hash) == 0)
         g_main_loop_quit(main_loop);
+}
+
+static gboolean delayed_cache_free(gpointer data)
+{
+    Cache* cache = data;
+
+    if(g_source_is_destroyed(g_main_current_source()))
+        return FALSE;
+
+    cache->delayed_free_handler = 0;
+    /* on_cache_generated() will need it, so it will free the cache */
+    if (cache->generating)
+        cache->free_pending = TRUE;
+    else
+        do_cache_free(cache);
     return FALSE;
 }
 
@@ -141,7 +296,21 @@ static void cache_free(Cache* cache)
     DEBUG("menu %p cache unused, removing in 6s", cache);
 }
 
-static gboolean read_all_used_files( FILE* f, int* n_files, char*** used_files )
+/* reads content hash from the version line into @sum, if there is one */
+static void read_content_sum(const char *line, char *sum)
+{
+    const char *tab = strchr(line, '\t');
+
+    sum[0] = '\0';
+    if (tab && strspn(tab + 1, "0123456789abcdef") == 32)
+    {
+        memcpy(sum, tab + 1, 32);
+        sum[32] = '\0';
+    }
+}
+
+static gboolean read_all_used_files( FILE* f, int* n_files, char*** used_files,
+                                     char* sum )
 {
     char line[ 4096 ];
     int i, n, x;
@@ -156,6 +325,7 @@ static gboolean read_all_used_files( FILE* f, int* n_files, char*** used_files )
     if (ver_maj != VER_MAJOR ||
         ver_min > VER_MINOR || ver_min < VER_MINOR_SUPPORTED)
         return FALSE;
+    read_content_sum(line, sum);
 
     /* skip the second line containing menu name */
     if( ! fgets( line, G_N_ELEMENTS(line), f ) )
@@ -193,162 +363,720 @@ static gboolean read_all_used_files( FILE* f, int* n_files, char*** used_files )
     return TRUE;
 }
 
-static void set_env( char* penv, const char* name )
+/* A parsed item of the cache file, used to compute differences between
+   two generations of the same cache. Pointers are into the file contents. */
+typedef struct _CacheNode CacheNode;
+struct _CacheNode
+{
+    const char *start; /* the first line of the item */
+    const char *head_end; /* end of own data of the item */
+    const char *end; /* end of the item including all its children */
+    GPtrArray *children; /* for menu items only */
+};
+
+static void cache_node_free(CacheNode *node)
+{
+    guint i;
+
+    if (node->children)
+    {
+        for (i = 0; i < node->children->len; i++)
+            cache_node_free(g_ptr_array_index(node->children, i));
+        g_ptr_array_free(node->children, TRUE);
+    }
+    g_slice_free(CacheNode, node);
+}
+
+static const char *next_line(const char *p, const char *end)
 {
-    if( penv && *penv )
-        g_setenv( name, penv, TRUE);
+    p = memchr(p, '\n', end - p);
+    return p ? p + 1 : NULL;
+}
+
+/* returns NULL on error or if end of menu is reached */
+static CacheNode *parse_cache_node(const char **ptr, const char *end, int ver_min)
+{
+    const char *p = *ptr;
+    CacheNode *node, *child;
+    int i, n_lines;
+
+    if (p >= end || *p == '\n')
+        return NULL;
+    if (*p == '+') /* menu: id, title, comment, icon, file, dir, [flags] */
+        n_lines = (ver_min >= 2) ? 7 : 6;
+    else if (*p == '-' && p[1] != '\n') /* application */
+        n_lines = (ver_min >= 2) ? 14 : 10;
+    else if (*p == '-') /* separator */
+        n_lines = 1;
     else
-        g_unsetenv( name );
+        return NULL;
+    node = g_slice_new0(CacheNode);
+    node->start = p;
+    for (i = 0; i < n_lines && p != NULL; i++)
+        p = next_line(p, end);
+    if (p == NULL)
+        goto _fail;
+    node->head_end = p;
+    if (*node->start == '+')
+    {
+        node->children = g_ptr_array_new();
+        while ((child = parse_cache_node(&p, end, ver_min)) != NULL)
+            g_ptr_array_add(node->children, child);
+        /* menu should be terminated by empty line */
+        if (p >= end || *p != '\n')
+            goto _fail;
+        p++;
+    }
+    node->end = p;
+    *ptr = p;
+    return node;
+
+_fail:
+    cache_node_free(node);
+    return NULL;
 }
 
-static void pre_exec( gpointer user_data )
+/* parses cache file contents, returns the root menu and the header length */
+static CacheNode *parse_cache_contents(const char *data, gsize len, gsize *header_len)
 {
-    char** env = (char**)user_data;
-    set_env(*env, "XDG_CACHE_HOME");
-    set_env(*++env, "XDG_CONFIG_DIRS");
-    set_env(*++env, "XDG_MENU_PREFIX");
-    set_env(*++env, "XDG_DATA_DIRS");
-    set_env(*++env, "XDG_CONFIG_HOME");
-    set_env(*++env, "XDG_DATA_HOME");
-    set_env(*++env, "CACHE_GEN_VERSION");
+    const char *p = data, *end = data + len;
+    int ver_maj, ver_min, n;
+
+    if (sscanf(data, "%d.%d", &ver_maj, &ver_min) < 2 ||
+        ver_maj != VER_MAJOR || ver_min > VER_MINOR || ver_min < VER_MINOR_SUPPORTED)
+        return NULL;
+    /* skip version and menu name */
+    p = next_line(p, end);
+    if (p)
+        p = next_line(p, end);
+    if (p == NULL)
+        return NULL;
+    /* skip used files and known DEs */
+    n = atoi(p);
+    if (n <= 0)
+        return NULL;
+    for (n += 2; n > 0 && p != NULL; n--)
+        p = next_line(p, end);
+    if (p == NULL)
+        return NULL;
+    *header_len = p - data;
+    return parse_cache_node(&p, end, ver_min);
 }
 
-static gboolean regenerate_cache( const char* menu_name,
-                                  const char* lang_name,
-                                  const char* cache_file,
-                                  char** env,
-                                  int* n_used_files,
-                                  char*** used_files )
+static inline char *cache_node_id(CacheNode *node)
 {
-    FILE* f;
-    int n_files, status = 0;
-    char** files;
-    const char *user_data_dir = env[5];
-    const char* argv[] = {
-        MENUCACHE_LIBEXECDIR "/menu-cache-gen",
-        "-l", NULL,
-        "-i", NULL,
-        "-o", NULL,
-        NULL};
-    argv[2] = lang_name;
-    argv[4] = menu_name;
-    argv[6] = cache_file;
-
-    /* DEBUG("cmd: %s", g_strjoinv(" ", argv)); */
+    return g_strndup(node->start, next_line(node->start, node->end) - node->start - 1);
+}
 
-    /* create $XDG_DATA_HOME/applications if it does not exist yet */
-    if (!user_data_dir || !user_data_dir[0])
-        user_data_dir = g_get_user_data_dir();
-    if (g_file_test(user_data_dir, G_FILE_TEST_IS_DIR) ||
-        g_mkdir(user_data_dir, 0700) == 0)
+static inline gboolean cache_node_equal(CacheNode *a, CacheNode *b)
+{
+    return (a->end - a->start) == (b->end - b->start) &&
+           memcmp(a->start, b->start, a->end - a->start) == 0;
+}
+
+static inline gboolean cache_node_head_equal(CacheNode *a, CacheNode *b)
+{
+    return (a->head_end - a->start) == (b->head_end - b->start) &&
+           memcmp(a->start, b->start, a->head_end - a->start) == 0;
+}
+
+/* Adds operations which change children of menu @old into children of menu
+ * @new to @delta. Each operation is a line with operation code, path to the
+ * menu as positions of submenus separated by '/', tab, and position of the
+ * child in the menu. Operations:
+ *   - remove child at position
+ *   + insert item, which follows the line, at position
+ *   = replace child at position with item, which follows the line
+ * Operations are written in the order they should be applied. Returns FALSE
+ * if children were reordered so menu should be replaced as whole. */
+static gboolean cache_node_diff(CacheNode *old, CacheNode *new, const char *path,
+                                GString *delta)
+{
+    GHashTable *old_ids;
+    CacheNode *old_child, *new_child;
+    int *match, *next_same;
+    int n_old = old->children->len, n_new = new->children->len;
+    int i, j, last;
+    gboolean ok = TRUE;
+
+    /* match children by their id, same ids (separators) are matched in order */
+    old_ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    next_same = g_new(int, n_old);
+    for (i = n_old - 1; i >= 0; i--)
     {
-        char *local_app_path = g_build_filename(user_data_dir, "applications", NULL);
-        if (!g_file_test(local_app_path, G_FILE_TEST_IS_DIR))
-            g_mkdir(local_app_path, 0700);
-        g_free(local_app_path);
+        char *id = cache_node_id(g_ptr_array_index(old->children, i));
+        next_same[i] = GPOINTER_TO_INT(g_hash_table_lookup(old_ids, id)) - 1;
+        g_hash_table_insert(old_ids, id, GINT_TO_POINTER(i + 1));
     }
+    /* match[] keeps old position for new children, and then for old children
+       it keeps flag if the child is still used */
+    match = g_new0(int, n_new + n_old);
+    for (j = 0, last = -1; j < n_new; j++)
+    {
+        char *id = cache_node_id(g_ptr_array_index(new->children, j));
 
-    /* run menu-cache-gen */
-    /* FIXME: is cast to (char**) valid here? */
-    if( !g_spawn_sync(NULL, (char **)argv, NULL, 0,
-                    pre_exec, env, NULL, NULL, &status, NULL ))
+        i = GPOINTER_TO_INT(g_hash_table_lookup(old_ids, id)) - 1;
+        match[j] = i;
+        if (i >= 0)
+        {
+            g_hash_table_insert(old_ids, id, GINT_TO_POINTER(next_same[i] + 1));
+            match[n_new + i] = 1;
+            if (i < last) /* relative order of children was changed */
+                ok = FALSE;
+            last = i;
+        }
+        else
+            g_free(id);
+    }
+    g_hash_table_destroy(old_ids);
+    g_free(next_same);
+    if (!ok)
+        goto _done;
+
+    /* remove children which are gone, from the end to keep positions valid */
+    for (i = n_old - 1; i >= 0; i--)
+        if (!match[n_new + i])
+            g_string_append_printf(delta, "-%s\t%d\n", path, i);
+    /* now remaining old children are on their places, insert new ones and
+       update changed ones in ascending order */
+    for (j = 0; j < n_new; j++)
     {
-        DEBUG("error executing menu-cache-gen");
+        new_child = g_ptr_array_index(new->children, j);
+        if (match[j] >= 0)
+        {
+            old_child = g_ptr_array_index(old->children, match[j]);
+            if (cache_node_equal(old_child, new_child))
+                continue;
+            if (new_child->children && old_child->children &&
+                cache_node_head_equal(old_child, new_child))
+            {
+                char *subpath = g_strdup_printf("%s%s%d", path, *path ? "/" : "", j);
+                gsize saved_len = delta->len;
+
+                ok = cache_node_diff(old_child, new_child, subpath, delta);
+                g_free(subpath);
+                if (ok)
+                    continue;
+                g_string_truncate(delta, saved_len);
+                ok = TRUE;
+            }
+            g_string_append_printf(delta, "=%s\t%d\n", path, j);
+        }
+        else
+            g_string_append_printf(delta, "+%s\t%d\n", path, j);
+        g_string_append_len(delta, new_child->start, new_child->end - new_child->start);
     }
-    /* DEBUG("exit status of menu-cache-gen: %d", status); */
-    if( status != 0 )
-        return FALSE;
 
-    f = fopen( cache_file, "r" );
-    if( f )
+_done:
+    g_free(match);
+    return ok;
+}
+
+/* returns a delta to update cache from @old_data into @new_data or NULL if
+   clients would better do full reload */
+static GString *make_cache_delta(const char *old_data, gsize old_len,
+                                 const char *new_data, gsize new_len)
+{
+    CacheNode *old_root, *new_root = NULL;
+    gsize old_header, new_header;
+    gsize old_ver, new_ver;
+    GString *delta = NULL;
+
+    old_root = parse_cache_contents(old_data, old_len, &old_header);
+    if (old_root)
+        new_root = parse_cache_contents(new_data, new_len, &new_header);
+    /* version line differs by content hash, so compare versions separately */
+    old_ver = strcspn(old_data, "\t\n");
+    new_ver = strcspn(new_data, "\t\n");
+    if (new_root && old_ver == new_ver && memcmp(old_data, new_data, old_ver) == 0)
+    {
+        old_ver = next_line(old_data, old_data + old_len) - old_data;
+        new_ver = next_line(new_data, new_data + new_len) - new_data;
+    }
+    else
+        new_ver = 0; /* mismatch */
+    /* list of used files, known DEs, and root menu itself should be the same */
+    if (new_ver > 0 && old_header - old_ver == new_header - new_ver &&
+        memcmp(old_data + old_ver, new_data + new_ver, old_header - old_ver) == 0 &&
+        cache_node_head_equal(old_root, new_root))
     {
-        if( !read_all_used_files( f, &n_files, &files ) )
+        delta = g_string_sized_new(1024);
+        if (!cache_node_diff(old_root, new_root, "", delta) ||
+            delta->len > new_len / MAX_DELTA_PART)
         {
-            n_files = 0;
-            files = NULL;
-            /* DEBUG("error: read_all_used_files"); */
+            g_string_free(delta, TRUE);
+            delta = NULL;
         }
-        fclose(f);
     }
-    else
-        return FALSE;
-    *n_used_files = n_files;
-    *used_files = files;
+    if (old_root)
+        cache_node_free(old_root);
+    if (new_root)
+        cache_node_free(new_root);
+    return delta;
+}
+
+static gboolean write_to_client(ClientIO *client_io, const char *data, gsize len)
+{
+    int fd = g_io_channel_unix_get_fd(client_io->channel);
+    ssize_t sz;
+
+    while (len > 0)
+    {
+        sz = write(fd, data, len);
+        if (sz < 0 && errno == EINTR)
+            continue;
+        if (sz <= 0)
+            return FALSE;
+        data += sz;
+        len -= sz;
+    }
     return TRUE;
 }
 
-static void do_reload(Cache* cache)
+/* returns sealed memory file with cache contents, or -1 if not supported */
+static int cache_get_memfd(Cache *cache, const char *data, gsize len)
 {
-    GSList* l;
-    char buf[38];
-    int i;
-    GFile* gf;
+#ifdef HAVE_MEMFD_CREATE
+    char *contents = NULL;
+    int fd;
+    ssize_t sz;
+
+    if (cache->memfd >= 0)
+        return cache->memfd;
+    if (data == NULL)
+    {
+        if (!g_file_get_contents(cache->cache_file, &contents, &len, NULL))
+            return -1;
+        data = contents;
+    }
+    fd = memfd_create("menu-cache", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+    {
+        DEBUG("memfd_create failed: %s", strerror(errno));
+        g_free(contents);
+        return -1;
+    }
+    while (len > 0)
+    {
+        sz = write(fd, data, len);
+        if (sz < 0 && errno == EINTR)
+            continue;
+        if (sz <= 0)
+            break;
+        data += sz;
+        len -= sz;
+    }
+    g_free(contents);
+    /* clients get it read-only and can rely on it not being changed */
+    if (len > 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+                                         F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+    {
+        DEBUG("failed to create sealed copy of cache");
+        close(fd);
+        return -1;
+    }
+    cache->memfd = fd;
+    return fd;
+#else
+    return -1;
+#endif
+}
 
-    int new_n_files;
-    char **new_files = NULL;
+static void cache_drop_memfd(Cache *cache)
+{
+    if (cache->memfd >= 0)
+        close(cache->memfd);
+    cache->memfd = -1;
+}
 
-    /* DEBUG("Re-generation of cache is needed!"); */
-    /* DEBUG("call menu-cache-gen to re-generate the cache"); */
-    memcpy( buf, "REL:", 4 );
-    memcpy( buf + 4, cache->md5, 32 );
-    buf[36] = '\n';
-    buf[37] = '\0';
+/* sends the reload request, with the cache attached if client accepts it */
+static gboolean send_reload_to_client(ClientIO *client_io, Cache *cache,
+                                      const char *data, gsize len)
+{
+    char buf[41];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    int fd = -1;
+    ssize_t sz;
 
-    if( ! regenerate_cache( cache->menu_name, cache->lang_name, cache->cache_file,
-                            cache->env, &new_n_files, &new_files ) )
+    if (client_io->accepts_fd)
+        fd = cache_get_memfd(cache, data, len);
+    if (fd < 0)
     {
-        DEBUG("regeneration of cache failed.");
-        return;
+        g_snprintf(buf, sizeof(buf), "REL:%s\n", cache->md5);
+        return write_to_client(client_io, buf, 37);
+    }
+    g_snprintf(buf, sizeof(buf), "REL:%s\tFD\n", cache->md5);
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = 40;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    do
+        sz = sendmsg(g_io_channel_unix_get_fd(client_io->channel), &msg, 0);
+    while (sz < 0 && errno == EINTR);
+    if (sz <= 0)
+        return FALSE;
+    /* descriptor is passed with the first byte, send the rest */
+    return write_to_client(client_io, buf + sz, 40 - sz);
+}
+
+/* replaces list of used files, recreating watches only for changed ones */
+static void update_monitors(Cache *cache, int new_n_files, char **new_files)
+{
+    GHashTable *old;
+    SharedWatch **watches;
+    int i, j;
+
+    if (new_n_files == cache->n_files)
+    {
+        for (i = 0; i < new_n_files; i++)
+            if (strcmp(new_files[i], cache->files[i]) != 0)
+                break;
+        if (i == new_n_files)
+        {
+            /* DEBUG("list of used files is the same, keeping monitors"); */
+            g_strfreev(new_files);
+            return;
+        }
     }
 
-    /* cancel old file monitors */
-    g_strfreev(cache->files);
-    for( i = 0; i < cache->n_files; ++i )
+    /* keep watches of files which are still used, new ones are created
+       before old ones are released so shared dirs stay watched */
+    old = g_hash_table_new(g_str_hash, g_str_equal);
+    for (i = 0; i < cache->n_files; i++)
+        g_hash_table_insert(old, cache->files[i], GINT_TO_POINTER(i + 1));
+    watches = g_new0(SharedWatch*, new_n_files + 1);
+    for (i = 0; i < new_n_files; i++)
     {
-        g_file_monitor_cancel( cache->mons[i] );
-        g_signal_handlers_disconnect_by_func( cache->mons[i], on_file_changed, cache );
-        g_object_unref( cache->mons[i] );
+        j = GPOINTER_TO_INT(g_hash_table_lookup(old, new_files[i])) - 1;
+        if (j >= 0)
+        {
+            watches[i] = cache->watches[j];
+            cache->watches[j] = NULL;
+            g_hash_table_remove(old, new_files[i]);
+        }
+        else
+            watches[i] = watch_ref(cache, new_files[i]);
     }
+    g_hash_table_destroy(old);
+    for (i = 0; i < cache->n_files; i++)
+        if (cache->watches[i] != NULL)
+            watch_unref(cache->watches[i], cache);
 /*
     g_file_monitor_cancel(cache->cache_mon);
     g_object_unref(cache->cache_mon);
 */
 
+    g_strfreev(cache->files);
+    g_free(cache->watches);
     cache->n_files = new_n_files;
     cache->files = new_files;
-
-    cache->mons = g_realloc( cache->mons, sizeof(GFileMonitor*)*(cache->n_files+1) );
-    /* create required file monitors */
-    for( i = 0; i < cache->n_files; ++i )
-    {
-        gf = g_file_new_for_path( cache->files[i] + 1 );
-        if( cache->files[i][0] == 'D' )
-            cache->mons[i] = g_file_monitor_directory( gf, 0, NULL, NULL );
-        else
-            cache->mons[i] = g_file_monitor_file( gf, 0, NULL, NULL );
-        g_signal_connect(cache->mons[i], "changed",
-                         G_CALLBACK(on_file_changed), cache);
-        g_object_unref(gf);
-    }
+    cache->watches = watches;
 /*
     gf = g_file_new_for_path( cache_file );
     cache->cache_mon = g_file_monitor_file( gf, 0, NULL, NULL );
     g_signal_connect( cache->cache_mon, "changed", on_file_changed, cache);
     g_object_unref(gf);
 */
+}
+
+/* applies results of successful regeneration, returns FALSE if the content
+   is the same so clients weren't notified */
+static gboolean finish_reload(Cache *cache, int new_n_files, char **new_files,
+                              const char *new_sum)
+{
+    GSList* l;
+    char *new_data = NULL;
+    gsize new_len = 0;
+    GString *delta = NULL;
+
+    cache_drop_memfd(cache);
+
+    if (cache->sum[0] && strcmp(cache->sum, new_sum) == 0)
+    {
+        /* clients already have exactly the same menu, don't bother them */
+        DEBUG("cache content is not changed, no reload is needed.");
+        update_monitors(cache, new_n_files, new_files);
+        return FALSE;
+    }
+
+    if (cache->prev_data && new_sum[0] &&
+        g_file_get_contents(cache->cache_file, &new_data, &new_len, NULL))
+    {
+        delta = make_cache_delta(cache->prev_data, cache->prev_len, new_data, new_len);
+        if (delta)
+        {
+            char *cmd = g_strdup_printf("DLT:%s\t%s\t%s\t%lu\n", cache->md5,
+                                        cache->sum, new_sum, (gulong)delta->len);
+
+            DEBUG("sending delta of %lu bytes instead of reload", (gulong)delta->len);
+            g_string_prepend(delta, cmd);
+            g_free(cmd);
+        }
+    }
+    memcpy(cache->sum, new_sum, sizeof(cache->sum));
+
+    update_monitors(cache, new_n_files, new_files);
 
     /* notify the clients that reload is needed. */
+    g_slist_free(cache->waiting);
+    cache->waiting = NULL;
     for( l = cache->clients; l; )
     {
         ClientIO *channel_io = (ClientIO *)l->data;
-        GIOChannel* ch = channel_io->channel;
+        gboolean ok;
         l = l->next; /* do it beforehand, as client may be removed below */
-        if(write(g_io_channel_unix_get_fd(ch), buf, 37) < 37)
+        if (delta && channel_io->accepts_delta)
+            ok = write_to_client(channel_io, delta->str, delta->len);
+        else
+            ok = send_reload_to_client(channel_io, cache, new_data, new_len);
+        if (!ok)
         {
             on_client_closed(channel_io);
         }
     }
-    cache->need_reload = FALSE;
+    if (delta)
+        g_string_free(delta, TRUE);
+    g_free(new_data);
+    return TRUE;
+}
+
+static gboolean on_cache_generated(gpointer user_data);
+
+/* runs in gen_pool thread, only reads the caches environment */
+static void generate_cache(gpointer data, gpointer user_data)
+{
+    GenJob* job = data;
+    Cache* cache = job->caches->data;
+    MenuCacheGenEnv env;
+    MenuCacheGenOutput *outputs;
+    GSList* l;
+    GError *err = NULL;
+    char *menu_name;
+    guint n = 0;
+
+    env.lang = NULL; /* it's set for each output */
+    env.config_dirs = cache->env[1];
+    env.menu_prefix = cache->env[2];
+    env.data_dirs = cache->env[3];
+    env.config_home = cache->env[4];
+    env.data_home = cache->env[5];
+    env.gen_version = cache->env[6]; /* optional */
+    env.data_file = job->group->data_file;
+    outputs = g_new(MenuCacheGenOutput, g_slist_length(job->caches));
+    for (l = job->caches; l; l = l->next, n++)
+    {
+        cache = l->data;
+        outputs[n].file = cache->cache_file;
+        outputs[n].lang = cache->lang_name;
+        outputs[n].with_hidden = g_str_has_suffix(cache->menu_name, "+hidden");
+    }
+    /* "+hidden" variant is written from the same tree */
+    menu_name = g_strndup(cache->menu_name, strlen(cache->menu_name) -
+                          (outputs[n-1].with_hidden ? 7 : 0));
+    menu_cache_gen_run_multi(menu_name, outputs, n, &env, job->group->store,
+                             NULL, &err);
+    g_free(menu_name);
+    job->outputs = outputs;
+    if (err)
+    {
+        DEBUG("regeneration of cache failed: %s", err->message);
+        g_error_free(err);
+    }
+    g_idle_add(on_cache_generated, job);
+}
+
+static void finish_generation(Cache* cache, gboolean gen_ok)
+{
+    FILE* f;
+    int n_files = 0;
+    char** files = NULL;
+    char sum[33];
+    gboolean ok = FALSE;
+
+    cache->generating = FALSE;
+    if( gen_ok &&
+        (f = fopen( cache->cache_file, "r" )) != NULL )
+    {
+        if( !read_all_used_files( f, &n_files, &files, sum ) )
+        {
+            n_files = 0;
+            files = NULL;
+            sum[0] = '\0';
+            /* DEBUG("error: read_all_used_files"); */
+        }
+        fclose(f);
+        ok = finish_reload(cache, n_files, files, sum);
+    }
+    g_free(cache->prev_data);
+    cache->prev_data = NULL;
+
+    /* clients which registered while there was no cache file are still
+       waiting for reload notification, even if regeneration failed */
+    while (!ok && cache->waiting)
+    {
+        ClientIO *channel_io = cache->waiting->data;
+        cache->waiting = g_slist_delete_link(cache->waiting, cache->waiting);
+        if (!send_reload_to_client(channel_io, cache, NULL, 0))
+            on_client_closed(channel_io);
+    }
+}
+
+static void queue_generation(CacheGroup* group);
+
+static gboolean on_cache_generated(gpointer user_data)
+{
+    GenJob* job = user_data;
+    CacheGroup* group = job->group;
+    Cache* cache;
+    GSList* l;
+    guint n = 0;
+
+    group->generating = FALSE;
+    /* some of caches may be written even if others failed */
+    for (l = job->caches; l; l = l->next, n++)
+        finish_generation(l->data, job->outputs[n].written);
+    g_free(job->outputs);
+
+    if (group->gen_again)
+    {
+        /* files were changed while the generator was running */
+        group->gen_again = FALSE;
+        queue_generation(group);
+    }
+    /* caches which became unused while generating aren't needed anymore,
+       the group may be freed with the last of them */
+    for (l = job->caches; l; l = l->next)
+    {
+        cache = l->data;
+        if (cache->free_pending && cache->clients == NULL)
+            do_cache_free(cache);
+    }
+    g_slist_free(job->caches);
+    g_slice_free(GenJob, job);
+    return FALSE;
+}
+
+/* starts generation of all caches of the group in the worker thread */
+static gboolean start_generation(gpointer user_data)
+{
+    CacheGroup* group = user_data;
+    Cache* cache = group->caches->data;
+    GenJob* job;
+    GSList* l;
+    GSList* c;
+    const char *user_data_dir = cache->env[5];
+    GError *err = NULL;
+
+    group->start_handler = 0;
+
+    /* create $XDG_DATA_HOME/applications if it does not exist yet */
+    if (!user_data_dir || !user_data_dir[0])
+        user_data_dir = g_get_user_data_dir();
+    if (g_file_test(user_data_dir, G_FILE_TEST_IS_DIR) ||
+        g_mkdir(user_data_dir, 0700) == 0)
+    {
+        char *local_app_path = g_build_filename(user_data_dir, "applications", NULL);
+        if (!g_file_test(local_app_path, G_FILE_TEST_IS_DIR))
+            g_mkdir(local_app_path, 0700);
+        g_free(local_app_path);
+    }
+
+    for (c = group->caches; c; c = c->next)
+    {
+        cache = c->data;
+        /* keep previous generation if some client can accept delta against it */
+        for (l = cache->clients; l; l = l->next)
+            if (((ClientIO *)l->data)->accepts_delta)
+                break;
+        /* delta is sent against content hash so old file should have it */
+        if (l && cache->sum[0] && cache->prev_data == NULL &&
+            !g_file_get_contents(cache->cache_file, &cache->prev_data, &cache->prev_len, NULL))
+            cache->prev_data = NULL;
+        cache->generating = TRUE;
+    }
+
+    /* generate it in the worker thread */
+    job = g_slice_new(GenJob);
+    job->group = group;
+    job->caches = g_slist_copy(group->caches);
+    job->outputs = NULL;
+    group->generating = TRUE;
+    if (!g_thread_pool_push(gen_pool, job, &err))
+    {
+        DEBUG("error starting generation: %s", err->message);
+        g_error_free(err);
+        group->generating = FALSE;
+        for (c = job->caches; c; c = c->next)
+        {
+            cache = c->data;
+            g_free(cache->prev_data);
+            cache->prev_data = NULL;
+            cache->generating = FALSE;
+            if (cache->free_pending)
+            {
+                do_cache_free(cache);
+                continue;
+            }
+            /* try it again later */
+            cache->need_reload = TRUE;
+            if (!cache->delayed_reload_handler)
+                cache->delayed_reload_handler = g_timeout_add_seconds_full(G_PRIORITY_LOW, 3,
+                                                    (GSourceFunc)delayed_reload, cache, NULL);
+        }
+        g_slist_free(job->caches);
+        g_slice_free(GenJob, job);
+    }
+    return FALSE;
+}
+
+static void queue_generation(CacheGroup* group)
+{
+    /* caches of the group usually get the change at once, so wait until
+       all of them requested it */
+    if (!group->start_handler)
+        group->start_handler = g_idle_add(start_generation, group);
+}
+
+/* queues generation of the cache without waiting for it, on_cache_generated()
+   will be called when it finishes; if it's running already then it will be
+   started once again after that; all caches of the group are generated */
+static gboolean regenerate_cache(Cache* cache)
+{
+    CacheGroup* group = cache->group;
+
+    cache->generating = TRUE;
+    if (group->generating)
+    {
+        /* it might have read changed files already so have to rerun it */
+        group->gen_again = TRUE;
+        return TRUE;
+    }
+    queue_generation(group);
+    return TRUE;
+}
+
+static void do_reload(Cache* cache)
+{
+    /* DEBUG("Re-generation of cache is needed!"); */
+    /* DEBUG("queue re-generation of the cache"); */
+    if (regenerate_cache(cache))
+        cache->need_reload = FALSE;
+    else
+        DEBUG("regeneration of cache failed.");
 }
 
 static gboolean delayed_reload( Cache* cache )
@@ -366,49 +1094,41 @@ static gboolean delayed_reload( Cache* cache )
     return FALSE;
 }
 
-void on_file_changed( GFileMonitor* mon, GFile* gf, GFile* other,
-                      GFileMonitorEvent evt, Cache* cache )
+/* returns FALSE if change of @path can't affect content of menu */
+static gboolean change_affects_menu(FileWatch *watch, const char *path,
+                                    FileWatchEvent evt)
 {
-#ifdef G_ENABLE_DEBUG
-    char *path = g_file_get_path(gf);
-    g_debug("file %s is changed (%d).", path, evt);
-    g_free(path);
-#endif
+    /* new subdir is watched already, files in it are reported separately */
+    if (evt == FILE_WATCH_SUBDIR_ADDED)
+        return FALSE;
     /* if( mon != cache->cache_mon ) */
     {
         /* Optimization: Some files in the dir are changed, but it
          * won't affect the content of the menu. So, just omit them,
          * and update the mtime of the cached file with utime.
          */
-        int idx;
-        /* dirty hack: get index of the monitor in array */
-        for(idx = 0; idx < cache->n_files; ++idx)
-        {
-            if(mon == cache->mons[idx])
-                break;
-        }
         /* if the monitored file is a directory */
-        if( G_LIKELY(idx < cache->n_files) && cache->files[idx][0] == 'D' )
+        if (evt == FILE_WATCH_CHANGED && file_watch_is_dir(watch))
         {
-            char* changed_file = g_file_get_path(gf);
+            const char* changed_file = path;
             /* Regenerate the cache if the changed file is a directory.
              *
-             * The file monitor isn't recursive, so imagine we add a
-             * subdirectory to /usr/share/applications, and subsequently
-             * add a desktop entry to that. If we ignore the new
-             * subdirectory, we won't notice when the desktop entry is
-             * added. By regenerating the cache, the subdirectory will
-             * be mentioned there, picked up by read_all_used_files(),
+             * Without inotify the file monitor isn't recursive, so
+             * imagine we add a subdirectory to /usr/share/applications,
+             * and subsequently add a desktop entry to that. If we ignore
+             * the new subdirectory, we won't notice when the desktop
+             * entry is added. By regenerating the cache, the subdirectory
+             * will be mentioned there, picked up by read_all_used_files(),
              * and monitored for subsequent changes.
              */
             if (!g_file_test(changed_file, G_FILE_TEST_IS_DIR))
             {
-                char* dir_path = cache->files[idx]+1;
+                const char* dir_path = file_watch_get_path(watch);
                 int len = strlen(dir_path);
                 /* if the changed file is a file in the monitored dir */
                 if( strncmp(changed_file, dir_path, len) == 0 && changed_file[len] == '/' )
                 {
-                    char* base_name = changed_file + len + 1;
+                    const char* base_name = changed_file + len + 1;
                     gboolean skip = TRUE;
                     /* only *.desktop and *.directory files can affect the content of the menu. */
                     if( g_str_has_suffix(base_name, ".desktop") )
@@ -421,15 +1141,17 @@ void on_file_changed( GFileMonitor* mon, GFile* gf, GFile* other,
                     if( skip )
                     {
                         DEBUG("files are changed, but no re-generation is needed.");
-                        g_free(changed_file);
-                        return;
+                        return FALSE;
                     }
                 }
             }
-            g_free(changed_file);
         }
     }
+    return TRUE;
+}
 
+static void schedule_reload(Cache *cache)
+{
     if( cache->delayed_reload_handler )
     {
         /* we got some change in last 3 seconds... not reload again */
@@ -447,47 +1169,134 @@ void on_file_changed( GFileMonitor* mon, GFile* gf, GFile* other,
     cache->delayed_reload_handler = g_timeout_add_seconds_full( G_PRIORITY_LOW, 3, (GSourceFunc)delayed_reload, cache, NULL );
 }
 
-static gboolean cache_file_is_updated( const char* cache_file, int* n_used_files, char*** used_files )
+static void on_file_changed(FileWatch *watch, const char *path,
+                            FileWatchEvent evt, gpointer user_data)
+{
+    SharedWatch *sw = user_data;
+    gboolean reload = change_affects_menu(watch, path, evt);
+    GSList *l;
+    Cache *cache;
+
+    DEBUG("file %s is changed (%d).", path, evt);
+    for (l = sw->caches; l; l = l->next)
+    {
+        cache = l->data;
+        /* cache may use the file more than once */
+        if (g_slist_find(sw->caches, cache) != l)
+            continue;
+        /* the generator will parse it again instead of reusing old data */
+        menu_cache_gen_store_invalidate(cache->group->store, path);
+        if (reload)
+            schedule_reload(cache);
+    }
+}
+
+/* signatures are the last @n lines of the cache file, returns the first of
+   them or NULL if there are no signatures */
+static const char *find_stamps(const char *data, gsize len, int n)
+{
+    const char *p = data + len;
+
+    if (len == 0 || p[-1] != '\n')
+        return NULL;
+    for (; n > 0; n--)
+    {
+        if (p == data)
+            return NULL;
+        /* p is after the line end, go to the line start */
+        for (p--; p > data && p[-1] != '\n'; p--);
+        if (*p != 'S')
+            return NULL;
+    }
+    return p;
+}
+
+/* compares current signature of @path with @saved one; if @shallow is set
+   then only stat data of a dir are compared, without its contents */
+static gboolean stamp_matches(GString *str, char type, const char *path,
+                              const char *saved, gsize saved_len, gboolean shallow)
+{
+    const char *sum;
+
+    g_string_truncate(str, 0);
+    if (shallow && type == 'D')
+    {
+        /* the last field of dir signature is hash of its contents */
+        sum = g_strrstr_len(saved, saved_len, ":");
+        if (sum != NULL)
+            saved_len = sum - saved;
+        type = 'F';
+    }
+    file_stamp_append(str, type, path, G_MAXINT64);
+    return str->len == saved_len && memcmp(str->str, saved, saved_len) == 0;
+}
+
+/* checks signatures written by menu-cache-gen after the menu against
+   current state of files listed in the header, returns TRUE if all match */
+static gboolean cache_stamps_match(const char *data, gsize len)
+{
+    const char *end = data + len, *files, *stamps, *p, *p_end, *stamp, *stamp_end;
+    GString *str;
+    char *path;
+    gboolean ok = TRUE;
+    int n, i, pass;
+
+    /* skip version and menu name, header is valid after reading used files */
+    files = next_line(next_line(data, end), end);
+    n = atoi(files);
+    files = next_line(files, end);
+    stamps = find_stamps(data, len, n);
+    if (stamps == NULL)
+        /* no signatures: cache was made by older menu-cache-gen */
+        return FALSE;
+    str = g_string_sized_new(128);
+    /* stat all files and dirs first, dirs are read only if all of them match */
+    for (pass = 0; ok && pass < 2; pass++)
+    {
+        p = files;
+        stamp = stamps;
+        for (i = 0; ok && i < n; i++, p = p_end, stamp = stamp_end)
+        {
+            p_end = next_line(p, end);
+            stamp_end = next_line(stamp, end);
+            if (pass == 1 && *p != 'D')
+                continue;
+            path = g_strndup(p + 1, p_end - p - 2);
+            ok = stamp_matches(str, *p, path, stamp + 1, stamp_end - stamp - 2,
+                               pass == 0);
+            if (!ok)
+                DEBUG("file %s was changed since cache generation", path);
+            g_free(path);
+        }
+    }
+    g_string_free(str, TRUE);
+    return ok;
+}
+
+/* returns TRUE if cache file can be used, and sets @is_valid if no used
+   files were changed since it was generated */
+static gboolean cache_file_is_updated( const char* cache_file, int* n_used_files,
+                                       char*** used_files, char* sum,
+                                       gboolean* is_valid )
 {
     gboolean ret = FALSE;
-    struct stat st;
-#if 0
-    time_t cache_mtime;
-    char** files;
-    int n, i;
-#endif
+    char* data;
+    gsize len;
     FILE* f;
 
-    f = fopen( cache_file, "r" );
+    *is_valid = FALSE;
+    /* the file is read once, both the header and signatures are taken from it */
+    if (!g_file_get_contents(cache_file, &data, &len, NULL))
+        return FALSE;
+    f = fmemopen(data, len, "r");
     if( f )
     {
-        if( fstat( fileno(f), &st) == 0 )
-        {
-#if 0
-            cache_mtime = st.st_mtime;
-            if( read_all_used_files(f, &n, &files) )
-            {
-                for( i =0; i < n; ++i )
-                {
-                    /* files[i][0] is 'D' or 'F' indicating file type. */
-                    if( stat( files[i] + 1, &st ) == -1 )
-                        continue;
-                    if( st.st_mtime > cache_mtime )
-                        break;
-                }
-                if( i >= n )
-                {
-                    ret = TRUE;
-                    *n_used_files = n;
-                    *used_files = files;
-                }
-            }
-#else
-            ret = read_all_used_files(f, n_used_files, used_files);
-#endif
-        }
+        ret = read_all_used_files(f, n_used_files, used_files, sum);
         fclose( f );
     }
+    if (ret)
+        *is_valid = cache_stamps_match(data, len);
+    g_free(data);
     return ret;
 }
 
@@ -617,6 +1426,7 @@ static void on_client_closed(gpointer user_data)
              * will happen.
              */
             cache->clients = g_slist_delete_link( cache->clients, l );
+            cache->waiting = g_slist_remove(cache->waiting, client_io);
             DEBUG("remove channel from cache %p", cache);
             if(cache->clients == NULL)
                 cache_free(cache);
@@ -635,7 +1445,6 @@ static gboolean on_client_data_in(GIOChannel* ch, GIOCondition cond, gpointer us
     GIOStatus st;
     const char* md5;
     Cache* cache;
-    GFile* gf;
     gboolean ret = TRUE;
 
     if(cond & (G_IO_HUP|G_IO_ERR) )
@@ -664,8 +1473,8 @@ retry:
         char *pline = line + 4;
         char *sep, *menu_name, *lang_name, *cache_dir;
         char **files = NULL;
+        gboolean is_valid, need_gen = FALSE;
         char **env;
-        char reload_cmd[38] = "REL:";
 
         len -= 4;
         /* Format of received string, separated by '\t'.
@@ -702,14 +1511,17 @@ retry:
             /* obtain cache dir from client's env */
 
             cache = g_slice_new0( Cache );
+            cache->memfd = -1;
             cache->cache_file = g_build_filename(*cache_dir ? cache_dir : g_get_user_cache_dir(), "menus", md5, NULL );
-            if( ! cache_file_is_updated(cache->cache_file, &n_files, &files) )
+            if( ! cache_file_is_updated(cache->cache_file, &n_files, &files,
+                                        cache->sum, &is_valid) )
             {
-                /* run menu-cache-gen */
-                if(! regenerate_cache( menu_name, lang_name, cache->cache_file, env, &n_files, &files ) )
-                {
-                    DEBUG("regeneration of cache failed!!");
-                }
+                /* generate it when cache is set up */
+                need_gen = TRUE;
+            }
+            else if (is_valid)
+            {
+                DEBUG("no used files were changed, cache is up to date");
             }
             else
             {
@@ -724,21 +1536,12 @@ retry:
             cache->menu_name = g_strdup(menu_name);
             cache->lang_name = g_strdup(lang_name);
             cache->env = env;
-            cache->mons = g_new0(GFileMonitor*, n_files+1);
-            /* create required file monitors */
+            cache_group_join(cache);
+            cache->watches = g_new0(SharedWatch*, n_files+1);
+            /* create required file watches */
             DEBUG("%d files/dirs are monitored.", n_files);
             for( i = 0; i < n_files; ++i )
-            {
-                gf = g_file_new_for_path( files[i] + 1 );
-                if( files[i][0] == 'D' )
-                    cache->mons[i] = g_file_monitor_directory( gf, 0, NULL, NULL );
-                else
-                    cache->mons[i] = g_file_monitor_file( gf, 0, NULL, NULL );
-                DEBUG("monitor: %s", g_file_get_path(gf));
-                g_signal_connect(cache->mons[i], "changed",
-                                 G_CALLBACK(on_file_changed), cache);
-                g_object_unref(gf);
-            }
+                cache->watches[i] = watch_ref(cache, files[i]);
             /*
             gf = g_file_new_for_path( cache_file );
             cache->cache_mon = g_file_monitor_file( gf, 0, NULL, NULL );
@@ -747,12 +1550,16 @@ retry:
             */
             g_hash_table_insert(hash, cache->md5, cache);
             DEBUG("new menu cache %p added to hash", cache);
+            if (need_gen && !regenerate_cache(cache))
+            {
+                DEBUG("regeneration of cache failed!!");
+            }
         }
-        else if (access(cache->cache_file, R_OK) != 0)
+        else if (!cache->generating && access(cache->cache_file, R_OK) != 0)
         {
             /* bug SF#657: if user deleted cache file we have to regenerate it */
-            if (!regenerate_cache(cache->menu_name, cache->lang_name, cache->cache_file,
-                                  cache->env, &cache->n_files, &cache->files))
+            cache_drop_memfd(cache);
+            if (!regenerate_cache(cache))
             {
                 DEBUG("regeneration of cache failed.");
             }
@@ -764,17 +1571,34 @@ retry:
             g_source_remove(cache->delayed_free_handler);
             cache->delayed_free_handler = 0;
         }
+        cache->free_pending = FALSE;
         DEBUG("client %p added to cache %p", ch, cache);
 
-        /* generate a fake reload notification */
-        DEBUG("fake reload!");
-        memcpy(reload_cmd + 4, md5, 32);
-
-        reload_cmd[36] = '\n';
-        reload_cmd[37] = '\0';
-
-        DEBUG("reload command: %s", reload_cmd);
-        ret = write(g_io_channel_unix_get_fd(ch), reload_cmd, 37) > 0;
+        if (cache->generating && access(cache->cache_file, R_OK) != 0)
+        {
+            /* nothing to load yet, client will be notified when
+               the generator finishes */
+            cache->waiting = g_slist_prepend(cache->waiting, user_data);
+        }
+        else
+        {
+            /* generate a fake reload notification */
+            DEBUG("fake reload!");
+            ret = send_reload_to_client(user_data, cache, NULL, 0);
+        }
+    }
+    else if (memcmp(line, "CAP:", 4) == 0)
+    {
+        /* client announces protocol extensions it supports */
+        char **caps = g_strsplit(line + 4, "\t", 0);
+        char **cap;
+
+        for (cap = caps; *cap; cap++)
+            if (strcmp(*cap, "DLT") == 0)
+                ((ClientIO *)user_data)->accepts_delta = TRUE;
+            else if (strcmp(*cap, "FD") == 0)
+                ((ClientIO *)user_data)->accepts_fd = TRUE;
+        g_strfreev(caps);
     }
     else if( memcmp(line, "UNR:", 4) == 0 )
     {
@@ -785,6 +1609,7 @@ retry:
         {
             /* remove the IO channel from the cache */
             cache->clients = g_slist_remove(cache->clients, user_data);
+            cache->waiting = g_slist_remove(cache->waiting, user_data);
             if(cache->clients == NULL)
                 cache_free(cache);
         }
@@ -949,7 +1774,16 @@ int main(int argc, char** argv)
     g_type_init();
 #endif
 
+    /* menu items are sorted by the generator according to locale */
+    setlocale(LC_ALL, "");
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+    g_thread_init(NULL);
+#endif
+    gen_pool = g_thread_pool_new(generate_cache, NULL, MAX_GEN_THREADS, FALSE, NULL);
+
     hash = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, NULL);
+    shared_watches = g_hash_table_new(g_str_hash, g_str_equal);
+    groups = g_hash_table_new(g_str_hash, g_str_equal);
 
     main_loop = g_main_loop_new( NULL, TRUE );
     g_main_loop_run( main_loop );
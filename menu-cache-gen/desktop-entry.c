@@ -0,0 +1,339 @@
+/*
+ *      desktop-entry.c : lightweight parser of desktop entry files.
+ *
+ *      This file is a part of libmenu-cache package and created program
+ *      should be not used without the library.
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "menu-tags.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+/* GKeyFile with G_KEY_FILE_KEEP_TRANSLATIONS keeps every line of the file
+   while we need only few keys in few languages. This parser reads only
+   the [Desktop Entry] group and keeps only requested keys and locales.
+   Values are unescaped the same way as GKeyFile does it, repeated group
+   is merged into the first one, and the file is rejected if some line in
+   any group is invalid. */
+struct _DesktopEntry
+{
+    const char * const *keys;
+    const char * const *locales;
+    guint n_locales;
+    /* raw values: [key * (n_locales + 1) + locale], n_locales if unlocalized */
+    char **values;
+};
+
+static gint _find(const char * const *list, const char *str, gsize len)
+{
+    gint i;
+
+    for (i = 0; list[i] != NULL; i++)
+        if (strncmp(list[i], str, len) == 0 && list[i][len] == '\0')
+            return i;
+    return -1;
+}
+
+/* reads whole file, @size is expected size or 0 if unknown, so the file
+   is usually read by single read() */
+static char *_read_fd(int fd, gsize size, gsize *len)
+{
+    char *contents;
+    gsize alloc = size ? size + 1 : 8192;
+    gssize n;
+
+    contents = g_malloc(alloc);
+    *len = 0;
+    for (;;)
+    {
+        if (*len + 1 >= alloc)
+            contents = g_realloc(contents, (alloc *= 2));
+        n = read(fd, contents + *len, alloc - *len - 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            g_free(contents);
+            contents = NULL;
+            break;
+        }
+        *len += n;
+        /* file of expected size is read completely, it's enough */
+        if (n == 0 || (size > 0 && *len == size))
+            break;
+    }
+    if (contents)
+        contents[*len] = '\0';
+    return contents;
+}
+
+DesktopEntry *desktop_entry_load_fd(int fd, gsize size, const char * const *keys,
+                                    const char * const *locales)
+{
+    DesktopEntry *de;
+    char *contents;
+    gsize len;
+
+    contents = _read_fd(fd, size, &len);
+    if (contents == NULL)
+        return NULL;
+    de = desktop_entry_parse(contents, len, keys, locales);
+    g_free(contents);
+    return de;
+}
+
+DesktopEntry *desktop_entry_load(const char *path, const char * const *keys,
+                                 const char * const *locales)
+{
+    return desktop_entry_load_at(AT_FDCWD, path, 0, keys, locales);
+}
+
+DesktopEntry *desktop_entry_load_at(int dir_fd, const char *path, gsize size,
+                                    const char * const *keys,
+                                    const char * const *locales)
+{
+    DesktopEntry *de;
+    int fd;
+
+    fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    de = desktop_entry_load_fd(fd, size, keys, locales);
+    close(fd);
+    return de;
+}
+
+DesktopEntry *desktop_entry_parse(char *contents, gsize len, const char * const *keys,
+                                  const char * const *locales)
+{
+    DesktopEntry *de;
+    char *line, *end, *eq, *key_end, *loc, *value;
+    gsize n_keys;
+    gboolean in_group = FALSE, seen_group = FALSE;
+    gint k, l;
+
+    de = g_slice_new(DesktopEntry);
+    de->keys = keys;
+    de->locales = locales;
+    de->n_locales = g_strv_length((char **)locales);
+    n_keys = g_strv_length((char **)keys);
+    de->values = g_new0(char *, n_keys * (de->n_locales + 1));
+    for (line = contents; line < contents + len; line = end + 1)
+    {
+        end = memchr(line, '\n', contents + len - line);
+        if (end == NULL)
+            end = contents + len; /* it should be nul-terminated */
+        *end = '\0';
+        if (end > line && end[-1] == '\r')
+            end[-1] = '\0';
+        while (g_ascii_isspace(*line))
+            line++;
+        if (*line == '\0' || *line == '#')
+            continue;
+        if (*line == '[')
+        {
+            /* GKeyFile merges repeated group so keep reading to the end,
+               the rest of file should be also valid for it */
+            key_end = strrchr(line, ']');
+            if (key_end == NULL)
+                goto _invalid;
+            seen_group = TRUE;
+            in_group = (key_end - line - 1 == strlen(G_KEY_FILE_DESKTOP_GROUP) &&
+                        strncmp(line + 1, G_KEY_FILE_DESKTOP_GROUP, key_end - line - 1) == 0);
+            continue;
+        }
+        eq = strchr(line, '=');
+        if (eq == NULL || !seen_group)
+            goto _invalid; /* GKeyFile fails on such line */
+        if (!in_group)
+            continue;
+        key_end = eq;
+        while (key_end > line && g_ascii_isspace(key_end[-1]))
+            key_end--;
+        loc = NULL;
+        if (key_end > line && key_end[-1] == ']')
+            loc = memchr(line, '[', key_end - line);
+        k = _find(keys, line, (loc ? loc : key_end) - line);
+        if (k < 0)
+            continue;
+        if (loc == NULL)
+            l = de->n_locales;
+        else if ((l = _find(locales, loc + 1, key_end - loc - 2)) < 0)
+            continue; /* translation we don't need */
+        value = eq + 1;
+        while (g_ascii_isspace(*value))
+            value++;
+        k = k * (de->n_locales + 1) + l;
+        /* the last one wins */
+        g_free(de->values[k]);
+        de->values[k] = g_strdup(value);
+    }
+    return de;
+
+_invalid:
+    desktop_entry_free(de);
+    return NULL;
+}
+
+void desktop_entry_free(DesktopEntry *de)
+{
+    gsize i, n = g_strv_length((char **)de->keys) * (de->n_locales + 1);
+
+    for (i = 0; i < n; i++)
+        g_free(de->values[i]);
+    g_free(de->values);
+    g_slice_free(DesktopEntry, de);
+}
+
+/* returns raw value of @key, first found for @locales if they aren't NULL */
+static const char *_get_value(DesktopEntry *de, const char *key,
+                              const char * const *locales)
+{
+    gint k = _find(de->keys, key, strlen(key));
+    gint l;
+
+    if (k < 0)
+        return NULL;
+    k *= de->n_locales + 1;
+    if (locales != NULL)
+        for (; locales[0] != NULL; locales++)
+        {
+            l = _find(de->locales, locales[0], strlen(locales[0]));
+            if (l >= 0 && de->values[k + l] != NULL &&
+                g_utf8_validate(de->values[k + l], -1, NULL))
+                return de->values[k + l];
+        }
+    if (de->values[k + de->n_locales] == NULL ||
+        !g_utf8_validate(de->values[k + de->n_locales], -1, NULL))
+        return NULL;
+    return de->values[k + de->n_locales];
+}
+
+/* unescapes @value, splits it by unescaped ';' into @list if it's not NULL */
+static char *_unescape(const char *value, GPtrArray *list)
+{
+    GString *str = g_string_sized_new(strlen(value));
+
+    for (; *value; value++)
+    {
+        if (*value == '\\' && value[1] != '\0')
+        {
+            switch (*++value)
+            {
+            case 's':
+                g_string_append_c(str, ' ');
+                break;
+            case 'n':
+                g_string_append_c(str, '\n');
+                break;
+            case 't':
+                g_string_append_c(str, '\t');
+                break;
+            case 'r':
+                g_string_append_c(str, '\r');
+                break;
+            case '\\':
+                g_string_append_c(str, '\\');
+                break;
+            case ';':
+                if (list)
+                {
+                    g_string_append_c(str, ';');
+                    break;
+                }
+                /* fall through */
+            default:
+                /* invalid escape is kept as is */
+                g_string_append_c(str, '\\');
+                g_string_append_c(str, *value);
+            }
+        }
+        else if (list && *value == ';')
+        {
+            g_ptr_array_add(list, g_strndup(str->str, str->len));
+            g_string_truncate(str, 0);
+        }
+        else
+            g_string_append_c(str, *value);
+    }
+    if (list == NULL)
+        return g_string_free(str, FALSE);
+    /* trailing separator doesn't add empty element */
+    if (str->len > 0)
+        g_ptr_array_add(list, g_strndup(str->str, str->len));
+    g_string_free(str, TRUE);
+    return NULL;
+}
+
+char *desktop_entry_get_locale_string(DesktopEntry *de, const char *key,
+                                      const char * const *locales)
+{
+    const char *value = _get_value(de, key, locales);
+
+    return value ? _unescape(value, NULL) : NULL;
+}
+
+char *desktop_entry_get_string(DesktopEntry *de, const char *key, gboolean localized)
+{
+    return desktop_entry_get_locale_string(de, key, localized ? de->locales : NULL);
+}
+
+char **desktop_entry_get_string_list(DesktopEntry *de, const char *key,
+                                     gboolean localized, gsize *len)
+{
+    return desktop_entry_get_locale_string_list(de, key, localized ? de->locales : NULL,
+                                                len);
+}
+
+char **desktop_entry_get_locale_string_list(DesktopEntry *de, const char *key,
+                                            const char * const *locales, gsize *len)
+{
+    const char *value = _get_value(de, key, locales);
+    GPtrArray *list;
+
+    if (value == NULL)
+        return NULL;
+    list = g_ptr_array_new();
+    _unescape(value, list);
+    *len = list->len;
+    g_ptr_array_add(list, NULL);
+    return (char **)g_ptr_array_free(list, FALSE);
+}
+
+gboolean desktop_entry_get_boolean(DesktopEntry *de, const char *key)
+{
+    const char *value = _get_value(de, key, NULL);
+    gsize len;
+
+    if (value == NULL)
+        return FALSE;
+    /* trailing spaces are ignored */
+    for (len = strlen(value); len > 0 && g_ascii_isspace(value[len-1]); len--);
+    return ((len == 4 && strncmp(value, "true", 4) == 0) ||
+            (len == 1 && value[0] == '1'));
+}
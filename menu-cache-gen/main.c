@@ -25,15 +25,11 @@
 #include <config.h>
 #endif
 
-#include "menu-tags.h"
+#include "menu-gen.h"
 
-#include <string.h>
 #include <locale.h>
-
-char **languages = NULL;
-GSList *MenuFiles = NULL;
-
-gint verbose = 0;
+#include <stdio.h>
+#include <string.h>
 
 static gboolean option_verbose (const gchar *option_name, const gchar *value,
                                 gpointer data, GError **error)
@@ -42,13 +38,26 @@ static gboolean option_verbose (const gchar *option_name, const gchar *value,
     return TRUE;
 }
 
+static gboolean stats = FALSE;
+static char *stats_file = NULL;
+
+static gboolean option_stats (const gchar *option_name, const gchar *value,
+                              gpointer data, GError **error)
+{
+    stats = TRUE;
+    g_free(stats_file);
+    stats_file = g_strdup(value);
+    return TRUE;
+}
+
 /* GLib options parser data is taken from previous menu-cache-gen code
  *
  *      Copyright 2008 PCMan <pcman.tw@google.com>
  */
 static char* ifile = NULL;
-static char* ofile = NULL;
-static char* lang = NULL;
+static char** ofiles = NULL;
+static char** hfiles = NULL;
+static char** langs = NULL;
 
 GOptionEntry opt_entries[] =
 {
@@ -57,20 +66,62 @@ GOptionEntry opt_entries[] =
 e.", NULL },
 */
     {"input", 'i', 0, G_OPTION_ARG_FILENAME, &ifile, "Source *.menu file to read", "FILENAME" },
-    {"output", 'o', 0, G_OPTION_ARG_FILENAME, &ofile, "Output file to write cache to", "FILENAME" },
-    {"lang", 'l', 0, G_OPTION_ARG_STRING, &lang, "Language", "LANG_LIST" },
+    {"output", 'o', 0, G_OPTION_ARG_FILENAME_ARRAY, &ofiles, "Output file to write cache to, may be repeated", "FILENAME" },
+    {"hidden-output", 'H', 0, G_OPTION_ARG_FILENAME_ARRAY, &hfiles, "Output file to write cache with hidden entries to, for each output file", "FILENAME" },
+    {"lang", 'l', 0, G_OPTION_ARG_STRING_ARRAY, &langs, "Language for each output file", "LANG_LIST" },
     {"verbose", 'v', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK, &option_verbose, "Send debug messages to terminal", NULL },
+    {"stats", 0, G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_CALLBACK, &option_stats, "Write times and counters of generation as JSON to FILE or to stdout", "FILE" },
     { NULL }
 };
 
+static void append_time(GString *str, const char *name, const MenuCacheGenTime *t)
+{
+    g_string_append_printf(str, "  \"%s\": { \"wall_us\": %" G_GINT64_FORMAT
+                           ", \"cpu_us\": %" G_GINT64_FORMAT " },\n",
+                           name, t->wall, t->cpu);
+}
+
+static gboolean write_stats(const MenuCacheGenStats *st, gboolean ok)
+{
+    GString *str = g_string_new("{\n");
+    GError *err = NULL;
+    gboolean res = TRUE;
+
+    append_time(str, "load", &st->load);
+    append_time(str, "merge", &st->merge);
+    append_time(str, "stage1", &st->stage1);
+    append_time(str, "localize", &st->localize);
+    append_time(str, "stage2", &st->stage2);
+    append_time(str, "write", &st->write);
+    g_string_append_printf(str, "  \"dirs_scanned\": %u,\n", st->dirs_scanned);
+    g_string_append_printf(str, "  \"files_stated\": %u,\n", st->files_stated);
+    g_string_append_printf(str, "  \"files_parsed\": %u,\n", st->files_parsed);
+    g_string_append_printf(str, "  \"rules_evaluated\": %u,\n", st->rules_evaluated);
+    g_string_append_printf(str, "  \"apps_allocated\": %u,\n", st->apps_allocated);
+    g_string_append_printf(str, "  \"bytes_written\": %" G_GUINT64_FORMAT ",\n",
+                           st->bytes_written);
+    g_string_append_printf(str, "  \"ok\": %s\n}\n", ok ? "true" : "false");
+    if (stats_file == NULL)
+        fputs(str->str, stdout);
+    else if (!g_file_set_contents(stats_file, str->str, str->len, &err))
+    {
+        g_printerr("menu-cache-gen: %s\n", err->message);
+        g_error_free(err);
+        res = FALSE;
+    }
+    g_string_free(str, TRUE);
+    return res;
+}
+
 int main(int argc, char **argv)
 {
-    FmXmlFile *xmlfile = NULL;
     GOptionContext *opt_ctx;
     GError *err = NULL;
-    MenuMenu *menu;
-    int rc = 1;
-    gboolean with_hidden = FALSE;
+    MenuCacheGenEnv env;
+    MenuCacheGenOutput *outputs;
+    MenuCacheGenStats st;
+    guint i, n;
+    gboolean ok;
 
     /* wish we could use some POSIX parser but there isn't one for long options */
     opt_ctx = g_option_context_new("Generate cache for freedesktop.org compliant menus.");
@@ -81,73 +132,64 @@ int main(int argc, char **argv)
         g_error_free(err);
         return 1;
     }
-
-    /* do with -l: if language is NULL then query it from environment */
-    if (lang == NULL || lang[0] == '\0')
-        languages = (char **)g_get_language_names();
-    else
-        languages = g_strsplit(lang, ":", 0);
     setlocale(LC_ALL, "");
 
     /* do with files: both ifile and ofile should be set correctly */
-    if (ifile == NULL || ofile == NULL)
+    if (ifile == NULL || ofiles == NULL)
     {
         g_printerr("menu-cache-gen: failed: both input and output files must be defined.\n");
         return 1;
     }
-    with_hidden = g_str_has_suffix(ifile, "+hidden");
-    if (with_hidden)
-        ifile[strlen(ifile)-7] = '\0';
-    if (G_LIKELY(!g_path_is_absolute(ifile)))
+    /* each output needs own language unless there is only one */
+    n = g_strv_length(ofiles);
+    if (langs == NULL ? n > 1 : g_strv_length(langs) != n)
     {
-        /* resolv the path */
-        char *path;
-        gboolean found;
-        const gchar * const *dirs = g_get_system_config_dirs();
-
-        const char *menu_prefix = g_getenv("XDG_MENU_PREFIX");
-        if (menu_prefix != NULL && menu_prefix[0] != '\0')
-        {
-            char *path = g_strconcat(menu_prefix, ifile, NULL);
-            g_free(ifile);
-            ifile = path;
-        }
-        path = g_build_filename(g_get_user_config_dir(), "menus", ifile, NULL);
-        found = g_file_test(path, G_FILE_TEST_IS_REGULAR);
-        while (!found && dirs[0] != NULL)
-        {
-            MenuFiles = g_slist_append(MenuFiles, (gpointer)g_intern_string(path));
-            g_free(path);
-            path = g_build_filename(dirs[0], "menus", ifile, NULL);
-            found = g_file_test(path, G_FILE_TEST_IS_REGULAR);
-            dirs++;
-        }
-        if (!found)
-        {
-            g_printerr("menu-cache-gen: failed: cannot find file '%s'\n", ifile);
-            return 1;
-        }
-        g_free(ifile);
-        ifile = path;
+        g_printerr("menu-cache-gen: failed: language should be defined for each output file.\n");
+        return 1;
+    }
+    if (hfiles != NULL && g_strv_length(hfiles) != n)
+    {
+        g_printerr("menu-cache-gen: failed: hidden output should be defined for each output file.\n");
+        return 1;
+    }
+    outputs = g_new(MenuCacheGenOutput, hfiles ? 2 * n : n);
+    for (i = 0; i < n; i++)
+    {
+        outputs[i].file = ofiles[i];
+        outputs[i].lang = langs ? langs[i] : NULL;
+        outputs[i].with_hidden = FALSE;
+        if (hfiles == NULL)
+            continue;
+        outputs[n + i].file = hfiles[i];
+        outputs[n + i].lang = outputs[i].lang;
+        outputs[n + i].with_hidden = TRUE;
     }
-    MenuFiles = g_slist_append(MenuFiles, (gpointer)g_intern_string(ifile));
 
 #if !GLIB_CHECK_VERSION(2, 36, 0)
     g_type_init();
 #endif
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+    g_thread_init(NULL); /* files are parsed in threads */
+#endif
 
-    /* load, merge menu file, and create menu */
-    menu = get_merged_menu(ifile, &xmlfile, &err);
-    if (menu == NULL)
+    /* the generator takes environment only from here */
+    env.lang = NULL; /* languages are set for each output */
+    env.menu_prefix = g_getenv("XDG_MENU_PREFIX");
+    env.config_home = g_getenv("XDG_CONFIG_HOME");
+    env.config_dirs = g_getenv("XDG_CONFIG_DIRS");
+    env.data_home = g_getenv("XDG_DATA_HOME");
+    env.data_dirs = g_getenv("XDG_DATA_DIRS");
+    env.gen_version = g_getenv("CACHE_GEN_VERSION");
+    env.data_file = NULL; /* next to the first output */
+    memset(&st, 0, sizeof(st));
+    ok = menu_cache_gen_run_multi(ifile, outputs, hfiles ? 2 * n : n, &env, NULL,
+                                  stats ? &st : NULL, &err);
+    if (!ok && err)
     {
         g_printerr("menu-cache-gen: %s\n", err->message);
         g_error_free(err);
-        return 1;
     }
-
-    /* save the layout */
-    rc = !save_menu_cache(menu, ifile, ofile, with_hidden);
-    if (xmlfile != NULL)
-        g_object_unref(xmlfile);
-    return rc;
+    if (stats && !write_stats(&st, ok))
+        ok = FALSE;
+    return ok ? 0 : 1;
 }
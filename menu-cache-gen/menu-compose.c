@@ -26,17 +26,40 @@
 #endif
 
 #include "menu-tags.h"
-#include "version.h"
+#include "file-stamp.h"
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <glib/gstdio.h>
 
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
 #define NONULL(a) (a == NULL) ? "" : a
 
-static GSList *DEs = NULL;
+/* marks of items merged by <Merge> in _stage1() */
+static MenuSep _merged_begin = { MENU_CACHE_TYPE_NONE };
+static MenuSep _merged_end = { MENU_CACHE_TYPE_NONE };
+
+static void _free_l10n(MenuL10n *l10n, guint n)
+{
+    guint i;
 
-static guint req_version = 1; /* old compatibility default */
+    for (i = 0; i < n; i++)
+    {
+        g_free(l10n[i].title);
+        g_free(l10n[i].comment);
+        g_free(l10n[i].generic_name);
+        g_free(l10n[i].keywords);
+    }
+    g_free(l10n);
+}
 
 static void menu_app_reset(MenuApp *app)
 {
@@ -54,16 +77,20 @@ static void menu_app_reset(MenuApp *app)
     g_free(app->keywords);
     g_free(app->show_in);
     g_free(app->hide_in);
+    g_free(app->cat_bits);
+    app->cat_bits = NULL;
+    _free_l10n(app->l10n, app->n_l10n);
+    app->l10n = NULL;
+    app->n_l10n = 0;
 }
 
-static void menu_app_free(gpointer data)
+void menu_app_free(gpointer data)
 {
     MenuApp *app = data;
 
     menu_app_reset(app);
     g_free(app->id);
     g_list_free(app->dirs);
-    g_list_free(app->menus);
     g_slice_free(MenuApp, app);
 }
 
@@ -89,133 +116,337 @@ static char *_escape_lf(char *str)
     return str;
 }
 
-static char *_get_string(GKeyFile *kf, const char *key)
+static char *_get_string(DesktopEntry *de, const char *key)
 {
-    return _escape_lf(g_key_file_get_string(kf, G_KEY_FILE_DESKTOP_GROUP, key, NULL));
+    return _escape_lf(desktop_entry_get_string(de, key, FALSE));
 }
 
-/* g_key_file_get_locale_string is too much limited so implement replacement */
-static char *_get_language_string(GKeyFile *kf, const char *key)
+static char *_get_language_string(DesktopEntry *de, const char *key)
 {
-    char **lang;
-    char *try_key, *str;
+    return _escape_lf(desktop_entry_get_string(de, key, TRUE));
+}
 
-    for (lang = languages; lang[0] != NULL; lang++)
-    {
-        try_key = g_strdup_printf("%s[%s]", key, lang[0]);
-        str = _get_string(kf, try_key);
-        g_free(try_key);
-        if (str != NULL)
-            return str;
-    }
-    return _escape_lf(g_key_file_get_locale_string(kf, G_KEY_FILE_DESKTOP_GROUP,
-                                                   key, languages[0], NULL));
+static char *_get_locale_string(DesktopEntry *de, const char *key, char **locales)
+{
+    return _escape_lf(desktop_entry_get_locale_string(de, key,
+                                                      (const char * const *)locales));
 }
 
-static char **_get_string_list(GKeyFile *kf, const char *key, gsize *lp)
+/* keys which are used from .directory files */
+static const char * const dir_keys[] = {
+    G_KEY_FILE_DESKTOP_KEY_NAME,
+    G_KEY_FILE_DESKTOP_KEY_COMMENT,
+    G_KEY_FILE_DESKTOP_KEY_ICON,
+    G_KEY_FILE_DESKTOP_KEY_NO_DISPLAY,
+    NULL
+};
+
+/* returns S_IFDIR, S_IFREG or 0 for anything else, following symlinks */
+static int _dirent_type(DIR *dir, struct dirent *de)
 {
-    char **str, **p;
+    struct stat st;
 
-    str = g_key_file_get_string_list(kf, G_KEY_FILE_DESKTOP_GROUP, key, lp, NULL);
-    if (str != NULL)
-        for (p = str; p[0] != NULL; p++)
-            p[0] = _escape_lf(p[0]);
-    return str;
+#ifdef _DIRENT_HAVE_D_TYPE
+    if (de->d_type == DT_DIR)
+        return S_IFDIR;
+    if (de->d_type == DT_REG)
+        return S_IFREG;
+    if (de->d_type != DT_LNK && de->d_type != DT_UNKNOWN)
+        return 0;
+#endif
+    if (fstatat(dirfd(dir), de->d_name, &st, 0) != 0)
+        return 0;
+    if (S_ISDIR(st.st_mode))
+        return S_IFDIR;
+    if (S_ISREG(st.st_mode))
+        return S_IFREG;
+    return 0;
+}
+
+/* parsed .directory file, each one is read once per generation */
+typedef struct {
+    char *title;
+    char *comment;
+    char *icon;
+    gboolean nodisplay : 1;
+    gboolean loaded : 1;
+    MenuL10n *l10n; /* for each language if there are few */
+    guint n_l10n;
+} DirFile;
+
+static void _dir_file_free(gpointer data)
+{
+    DirFile *df = data;
+
+    _free_l10n(df->l10n, df->n_l10n);
+    g_free(df->title);
+    g_free(df->comment);
+    g_free(df->icon);
+    g_slice_free(DirFile, df);
 }
 
-static char **_get_language_string_list(GKeyFile *kf, const char *key, gsize *lp)
+static DirFile *_load_dir_file(MenuCacheGen *gen, const char *path)
 {
-    char **lang;
-    char *try_key, **str;
+    DirFile *df = g_slice_new0(DirFile);
+    DesktopEntry *de;
+    guint i;
 
-    for (lang = languages; lang[0] != NULL; lang++)
+    STATS_INC(gen, files_parsed);
+    de = desktop_entry_load(path, dir_keys, (const char * const *)gen->locales);
+    if (de == NULL)
+        return df;
+    df->title = _get_language_string(de, G_KEY_FILE_DESKTOP_KEY_NAME);
+    df->comment = _get_language_string(de, G_KEY_FILE_DESKTOP_KEY_COMMENT);
+    df->icon = _get_string(de, G_KEY_FILE_DESKTOP_KEY_ICON);
+    df->nodisplay = desktop_entry_get_boolean(de, G_KEY_FILE_DESKTOP_KEY_NO_DISPLAY);
+    df->loaded = TRUE;
+    if (gen->lang_locales != NULL)
     {
-        try_key = g_strdup_printf("%s[%s]", key, lang[0]);
-        str = _get_string_list(kf, try_key, lp);
-        g_free(try_key);
-        if (str != NULL)
-            return str;
+        df->n_l10n = gen->n_langs;
+        df->l10n = g_new0(MenuL10n, df->n_l10n);
+        for (i = 0; i < df->n_l10n; i++)
+        {
+            df->l10n[i].title = _get_locale_string(de, G_KEY_FILE_DESKTOP_KEY_NAME,
+                                                   gen->lang_locales[i]);
+            df->l10n[i].comment = _get_locale_string(de, G_KEY_FILE_DESKTOP_KEY_COMMENT,
+                                                     gen->lang_locales[i]);
+        }
     }
-    str = g_key_file_get_locale_string_list(kf, G_KEY_FILE_DESKTOP_GROUP, key,
-                                            languages[0], lp, NULL);
-    if (str != NULL)
-        for (lang = str; lang[0] != NULL; lang++)
-            lang[0] = _escape_lf(lang[0]);
-    return str;
+    desktop_entry_free(de);
+    return df;
 }
 
-static void _fill_menu_from_file(MenuMenu *menu, const char *path)
+static void _fill_menu_from_file(MenuCacheGen *gen, MenuMenu *menu, const char *path)
 {
-    GKeyFile *kf;
+    DirFile *df;
 
     if (!g_str_has_suffix(path, ".directory")) /* ignore random names */
         return;
-    kf = g_key_file_new();
-    if (!g_key_file_load_from_file(kf, path, G_KEY_FILE_KEEP_TRANSLATIONS, NULL))
-        goto exit;
-    menu->title = _get_language_string(kf, G_KEY_FILE_DESKTOP_KEY_NAME);
-    menu->comment = _get_language_string(kf, G_KEY_FILE_DESKTOP_KEY_COMMENT);
-    menu->icon = _get_string(kf, G_KEY_FILE_DESKTOP_KEY_ICON);
-    menu->layout.nodisplay = g_key_file_get_boolean(kf, G_KEY_FILE_DESKTOP_GROUP,
-                                                    G_KEY_FILE_DESKTOP_KEY_NO_DISPLAY, NULL);
+    df = g_hash_table_lookup(gen->dir_files, path);
+    if (df == NULL)
+    {
+        df = _load_dir_file(gen, path);
+        g_hash_table_insert(gen->dir_files, g_strdup(path), df);
+    }
+    if (!df->loaded)
+        return;
+    menu->title = g_strdup(df->title);
+    menu->comment = g_strdup(df->comment);
+    menu->icon = g_strdup(df->icon);
+    menu->l10n = df->l10n;
+    menu->layout.nodisplay = df->nodisplay;
     menu->layout.is_set = TRUE;
-exit:
-    g_key_file_free(kf);
 }
 
-static const char **menu_app_intern_key_file_list(GKeyFile *kf, const char *key,
-                                                  gboolean localized,
-                                                  gboolean add_to_des)
+/* reads names of .directory files in @dir */
+static GHashTable *_list_dir_files(MenuCacheGen *gen, const char *dir)
+{
+    GHashTable *names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    DIR *dp = opendir(dir);
+    struct dirent *de;
+
+    if (dp == NULL)
+        return names;
+    STATS_INC(gen, dirs_scanned);
+    while ((de = readdir(dp)) != NULL)
+        if (g_str_has_suffix(de->d_name, ".directory") &&
+            _dirent_type(dp, de) == S_IFREG)
+            g_hash_table_insert(names, g_strdup(de->d_name), NULL);
+    closedir(dp);
+    return names;
+}
+
+/* returns link of the first of @dirs which has file @id in it */
+static GList *_find_dir_file(MenuCacheGen *gen, GList *dirs, const char *id)
+{
+    GHashTable *names;
+    char *path;
+    gboolean found;
+
+    /* only plain .directory names are listed */
+    if (strchr(id, G_DIR_SEPARATOR) != NULL || !g_str_has_suffix(id, ".directory"))
+    {
+        for (; dirs; dirs = dirs->next)
+        {
+            path = g_build_filename(dirs->data, id, NULL);
+            found = g_file_test(path, G_FILE_TEST_IS_REGULAR);
+            g_free(path);
+            if (found)
+                break;
+        }
+        return dirs;
+    }
+    for (; dirs; dirs = dirs->next)
+    {
+        names = g_hash_table_lookup(gen->dir_listings, dirs->data);
+        if (names == NULL)
+        {
+            names = _list_dir_files(gen, dirs->data);
+            g_hash_table_insert(gen->dir_listings, dirs->data, names);
+        }
+        if (g_hash_table_lookup_extended(names, id, NULL, NULL))
+            break;
+    }
+    return dirs;
+}
+
+static const char **menu_app_intern_key_file_list(DesktopEntry *de, const char *key,
+                                                  char **locales)
 {
     gsize len, i;
     char **val;
     const char **res;
 
-    if (localized)
-        val = _get_language_string_list(kf, key, &len);
-    else
-        val = _get_string_list(kf, key, &len);
+    val = desktop_entry_get_locale_string_list(de, key, (const char * const *)locales,
+                                               &len);
     if (val == NULL)
         return NULL;
     res = (const char **)g_new(char *, len + 1);
     for (i = 0; i < len; i++)
     {
+        val[i] = _escape_lf(val[i]);
         res[i] = g_intern_string(val[i]);
-        if (add_to_des && g_slist_find(DEs, res[i]) == NULL)
-            DEs = g_slist_append(DEs, (gpointer)res[i]);
     }
     res[i] = NULL;
     g_strfreev(val);
     return res;
 }
 
-static void _fill_app_from_key_file(MenuApp *app, GKeyFile *kf)
+/* keys which are used from .desktop files */
+static const char * const app_keys[] = {
+    G_KEY_FILE_DESKTOP_KEY_TYPE,
+    G_KEY_FILE_DESKTOP_KEY_HIDDEN,
+    G_KEY_FILE_DESKTOP_KEY_NAME,
+    G_KEY_FILE_DESKTOP_KEY_COMMENT,
+    G_KEY_FILE_DESKTOP_KEY_ICON,
+    G_KEY_FILE_DESKTOP_KEY_GENERIC_NAME,
+    G_KEY_FILE_DESKTOP_KEY_EXEC,
+    G_KEY_FILE_DESKTOP_KEY_TRY_EXEC,
+    G_KEY_FILE_DESKTOP_KEY_PATH,
+    G_KEY_FILE_DESKTOP_KEY_CATEGORIES,
+    "Keywords",
+    G_KEY_FILE_DESKTOP_KEY_ONLY_SHOW_IN,
+    G_KEY_FILE_DESKTOP_KEY_NOT_SHOW_IN,
+    G_KEY_FILE_DESKTOP_KEY_TERMINAL,
+    G_KEY_FILE_DESKTOP_KEY_STARTUP_NOTIFY,
+    G_KEY_FILE_DESKTOP_KEY_NO_DISPLAY,
+    NULL
+};
+
+static void _fill_app_from_key_file(MenuCacheGen *gen, MenuApp *app, DesktopEntry *de)
 {
-    app->title = _get_language_string(kf, G_KEY_FILE_DESKTOP_KEY_NAME);
-    app->comment = _get_language_string(kf, G_KEY_FILE_DESKTOP_KEY_COMMENT);
-    app->icon = _get_string(kf, G_KEY_FILE_DESKTOP_KEY_ICON);
-    app->generic_name = _get_language_string(kf, G_KEY_FILE_DESKTOP_KEY_GENERIC_NAME);
-    app->exec = _get_string(kf, G_KEY_FILE_DESKTOP_KEY_EXEC);
-    app->try_exec = _get_string(kf, G_KEY_FILE_DESKTOP_KEY_TRY_EXEC);
-    app->wd = _get_string(kf, G_KEY_FILE_DESKTOP_KEY_PATH);
-    app->categories = menu_app_intern_key_file_list(kf, G_KEY_FILE_DESKTOP_KEY_CATEGORIES,
-                                                    FALSE, FALSE);
-    app->keywords = menu_app_intern_key_file_list(kf, "Keywords", TRUE, FALSE);
-    app->show_in = menu_app_intern_key_file_list(kf, G_KEY_FILE_DESKTOP_KEY_ONLY_SHOW_IN,
-                                                 FALSE, TRUE);
-    app->hide_in = menu_app_intern_key_file_list(kf, G_KEY_FILE_DESKTOP_KEY_NOT_SHOW_IN,
-                                                 FALSE, TRUE);
-    app->use_terminal = g_key_file_get_boolean(kf, G_KEY_FILE_DESKTOP_GROUP,
-                                               G_KEY_FILE_DESKTOP_KEY_TERMINAL, NULL);
-    app->use_notification = g_key_file_get_boolean(kf, G_KEY_FILE_DESKTOP_GROUP,
-                                                   G_KEY_FILE_DESKTOP_KEY_STARTUP_NOTIFY, NULL);
-    app->hidden = g_key_file_get_boolean(kf, G_KEY_FILE_DESKTOP_GROUP,
-                                         G_KEY_FILE_DESKTOP_KEY_NO_DISPLAY, NULL);
+    guint i;
+
+    app->title = _get_language_string(de, G_KEY_FILE_DESKTOP_KEY_NAME);
+    app->comment = _get_language_string(de, G_KEY_FILE_DESKTOP_KEY_COMMENT);
+    app->icon = _get_string(de, G_KEY_FILE_DESKTOP_KEY_ICON);
+    app->generic_name = _get_language_string(de, G_KEY_FILE_DESKTOP_KEY_GENERIC_NAME);
+    app->exec = _get_string(de, G_KEY_FILE_DESKTOP_KEY_EXEC);
+    app->try_exec = _get_string(de, G_KEY_FILE_DESKTOP_KEY_TRY_EXEC);
+    app->wd = _get_string(de, G_KEY_FILE_DESKTOP_KEY_PATH);
+    app->categories = menu_app_intern_key_file_list(de, G_KEY_FILE_DESKTOP_KEY_CATEGORIES,
+                                                    NULL);
+    app->keywords = menu_app_intern_key_file_list(de, "Keywords", gen->locales);
+    app->show_in = menu_app_intern_key_file_list(de, G_KEY_FILE_DESKTOP_KEY_ONLY_SHOW_IN,
+                                                 NULL);
+    app->hide_in = menu_app_intern_key_file_list(de, G_KEY_FILE_DESKTOP_KEY_NOT_SHOW_IN,
+                                                 NULL);
+    app->use_terminal = desktop_entry_get_boolean(de, G_KEY_FILE_DESKTOP_KEY_TERMINAL);
+    app->use_notification = desktop_entry_get_boolean(de, G_KEY_FILE_DESKTOP_KEY_STARTUP_NOTIFY);
+    app->hidden = desktop_entry_get_boolean(de, G_KEY_FILE_DESKTOP_KEY_NO_DISPLAY);
+    if (gen->lang_locales == NULL)
+        return;
+    /* translations are taken at once for all outputs */
+    app->n_l10n = gen->n_langs;
+    app->l10n = g_new0(MenuL10n, app->n_l10n);
+    for (i = 0; i < app->n_l10n; i++)
+    {
+        app->l10n[i].title = _get_locale_string(de, G_KEY_FILE_DESKTOP_KEY_NAME,
+                                                gen->lang_locales[i]);
+        app->l10n[i].comment = _get_locale_string(de, G_KEY_FILE_DESKTOP_KEY_COMMENT,
+                                                  gen->lang_locales[i]);
+        app->l10n[i].generic_name = _get_locale_string(de, G_KEY_FILE_DESKTOP_KEY_GENERIC_NAME,
+                                                       gen->lang_locales[i]);
+        app->l10n[i].keywords = menu_app_intern_key_file_list(de, "Keywords",
+                                                              gen->lang_locales[i]);
+    }
+}
+
+/* makes new entry from @de which is used as template for apps, it is
+   MENU_CACHE_TYPE_NONE if file is not loadable or not an application */
+static MenuApp *_make_app_entry(MenuCacheGen *gen, DesktopEntry *de)
+{
+    MenuApp *entry = g_slice_new0(MenuApp);
+    char *type;
+
+    entry->type = MENU_CACHE_TYPE_NONE;
+    if (de == NULL)
+        return entry; /* ignore not key files */
+    type = desktop_entry_get_string(de, G_KEY_FILE_DESKTOP_KEY_TYPE, FALSE);
+    if (g_strcmp0(type, G_KEY_FILE_DESKTOP_TYPE_APPLICATION) == 0)
+    {
+        entry->type = MENU_CACHE_TYPE_APP;
+        /* deleted file should be ignored */
+        entry->deleted = desktop_entry_get_boolean(de, G_KEY_FILE_DESKTOP_KEY_HIDDEN);
+        if (!entry->deleted)
+            _fill_app_from_key_file(gen, entry, de);
+    }
+    g_free(type);
+    desktop_entry_free(de);
+    return entry;
+}
+
+static const char **_copy_list(MenuCacheGen *gen, const char **list, gboolean add_to_des)
+{
+    const char **res;
+    guint i, len;
+
+    if (list == NULL)
+        return NULL;
+    len = g_strv_length((char **)list);
+    res = (const char **)g_new(char *, len + 1);
+    for (i = 0; i < len; i++)
+    {
+        res[i] = list[i]; /* it's interned */
+        if (add_to_des && g_slist_find(gen->DEs, res[i]) == NULL)
+            gen->DEs = g_slist_append(gen->DEs, (gpointer)res[i]);
+    }
+    res[i] = NULL;
+    return res;
 }
 
-static GHashTable *all_apps = NULL;
+/* fills @app with data from parsed @entry */
+static void _fill_app_from_entry(MenuCacheGen *gen, MenuApp *app, const MenuApp *entry)
+{
+    guint i;
 
-static GSList *loaded_dirs = NULL;
+    app->title = g_strdup(entry->title);
+    app->comment = g_strdup(entry->comment);
+    app->icon = g_strdup(entry->icon);
+    app->generic_name = g_strdup(entry->generic_name);
+    app->exec = g_strdup(entry->exec);
+    app->try_exec = g_strdup(entry->try_exec);
+    app->wd = g_strdup(entry->wd);
+    app->categories = _copy_list(gen, entry->categories, FALSE);
+    app->keywords = _copy_list(gen, entry->keywords, FALSE);
+    /* DEs are registered in order apps are added, as the parser did it */
+    app->show_in = _copy_list(gen, entry->show_in, TRUE);
+    app->hide_in = _copy_list(gen, entry->hide_in, TRUE);
+    app->use_terminal = entry->use_terminal;
+    app->use_notification = entry->use_notification;
+    app->hidden = entry->hidden;
+    if (entry->l10n == NULL)
+        return;
+    app->n_l10n = entry->n_l10n;
+    app->l10n = g_new(MenuL10n, app->n_l10n);
+    for (i = 0; i < app->n_l10n; i++)
+    {
+        app->l10n[i].title = g_strdup(entry->l10n[i].title);
+        app->l10n[i].comment = g_strdup(entry->l10n[i].comment);
+        app->l10n[i].generic_name = g_strdup(entry->l10n[i].generic_name);
+        app->l10n[i].keywords = _copy_list(gen, entry->l10n[i].keywords, FALSE);
+    }
+}
 
 static GList *_make_def_layout(void)
 {
@@ -232,35 +463,136 @@ static GList *_make_def_layout(void)
     return g_list_prepend(layout, mm);
 }
 
-static void _fill_apps_from_dir(MenuMenu *menu, GList *lptr, GString *prefix,
-                                gboolean is_legacy)
+static void _free_apps_index(MenuCacheGen *gen)
+{
+    guint i;
+
+    if (gen->category_apps == NULL)
+        return;
+    for (i = 0; i < gen->n_categories; i++)
+        g_ptr_array_free(gen->category_apps[i], TRUE);
+    g_free(gen->category_apps);
+    gen->category_apps = NULL;
+}
+
+/* a .desktop file found in app dirs, parsed in parallel then applied in
+   the order it was found so result doesn't depend on parse order */
+typedef struct {
+    char *filename;
+    char *name; /* file name */
+    const char *dir; /* interned */
+    int dir_fd; /* open while files are parsed */
+    int fd; /* opened for readahead, or -1 */
+    char *id; /* prefix + name, NULL if there is no prefix */
+    guint64 ino; /* files are read in order of inodes */
+    gboolean stamped; /* stamp and size below are valid */
+    char *stamp; /* NULL if entry should not be stored */
+    gsize size;
+    char *contents; /* prefetched file data, if any */
+    gsize len;
+    MenuApp *entry;
+    gboolean owned;
+} AppFile;
+
+/* remembers stamp of @file and looks it up in the store, @fs is NULL if
+   stamp is unknown */
+static void _stamp_app_file(MenuCacheGen *gen, AppFile *file, const FileStamp *fs)
+{
+    GString *stamp;
+
+    STATS_INC(gen, files_stated);
+    file->stamped = TRUE;
+    if (fs == NULL)
+        return;
+    file->size = fs->size;
+    /* file modified within last second may be changed again unnoticed */
+    if (file_stamp_is_racy(fs, gen->started - G_USEC_PER_SEC))
+        return;
+    stamp = g_string_sized_new(64);
+    file_stamp_print(stamp, fs);
+    file->stamp = g_string_free(stamp, FALSE);
+    file->entry = menu_cache_gen_store_lookup(gen->store, file->filename, file->stamp);
+}
+
+/* sets entry for @file, reusing one from the store if the file was not
+   changed since; uses data prefetched by _prefetch_app_files() if any */
+static void _get_app_entry(MenuCacheGen *gen, AppFile *file)
+{
+    FileStamp fs;
+    DesktopEntry *de;
+
+    if (file->entry != NULL)
+        return; /* already found in the store */
+    if (gen->store != NULL && !file->stamped)
+        _stamp_app_file(gen, file, file_stamp_get(file->dir_fd, file->name,
+                                                  &fs) == 1 ? &fs : NULL);
+    file->owned = FALSE;
+    if (file->entry == NULL)
+    {
+        VVDBG("parsing %s", file->filename);
+        STATS_INC(gen, files_parsed);
+        if (file->contents != NULL)
+            de = desktop_entry_parse(file->contents, file->len, app_keys,
+                                     (const char * const *)gen->locales);
+        else if (file->fd >= 0)
+            de = desktop_entry_load_fd(file->fd, file->size, app_keys,
+                                       (const char * const *)gen->locales);
+        else
+            de = desktop_entry_load_at(file->dir_fd, file->name, file->size, app_keys,
+                                       (const char * const *)gen->locales);
+        file->entry = _make_app_entry(gen, de);
+        file->owned = (file->stamp == NULL ||
+                       !menu_cache_gen_store_add(gen->store, file->filename,
+                                                 file->stamp, file->entry));
+    }
+    g_free(file->stamp);
+    file->stamp = NULL;
+    g_free(file->contents);
+    file->contents = NULL;
+    if (file->fd >= 0)
+        close(file->fd);
+    file->fd = -1;
+}
+
+/* don't bother with threads for few files */
+#define MIN_FILES_TO_PARSE_IN_PARALLEL 8
+
+/* scans @lptr dir and its subdirs into @files, dirs are left open in @dirs */
+static void _scan_apps_dir(MenuCacheGen *gen, MenuMenu *menu, GList *lptr,
+                           GString *prefix, gboolean is_legacy, GPtrArray *files,
+                           GPtrArray *dirs)
 {
     const char *dir = lptr->data;
-    GDir *gd;
+    DIR *dp;
+    struct dirent *de;
     const char *name;
-    char *filename, *id;
+    char *filename;
     gsize prefix_len = prefix->len;
-    MenuApp *app;
-    GKeyFile *kf;
+    AppFile *file;
+    int type;
 
-    if (g_slist_find(loaded_dirs, dir) == NULL)
-        loaded_dirs = g_slist_prepend(loaded_dirs, (gpointer)dir);
+    if (g_slist_find(gen->loaded_dirs, dir) == NULL)
+        gen->loaded_dirs = g_slist_prepend(gen->loaded_dirs, (gpointer)dir);
     /* the directory might be scanned with different prefix already */
     else if (prefix->str[0] == '\0')
         return;
-    gd = g_dir_open(dir, 0, NULL);
-    if (gd == NULL)
+    dp = opendir(dir);
+    if (dp == NULL)
         return;
-    kf = g_key_file_new();
+    g_ptr_array_add(dirs, dp);
+    STATS_INC(gen, dirs_scanned);
     DBG("fill apps from dir [%s]%s", prefix->str, dir);
     /* Scan the directory with subdirs,
-       ignore not .desktop files,
-       ignore already present files that are allocated */
-    while ((name = g_dir_read_name(gd)) != NULL)
+       ignore not .desktop files */
+    while ((de = readdir(dp)) != NULL)
     {
-        filename = g_build_filename(dir, name, NULL);
-        if (g_file_test(filename, G_FILE_TEST_IS_DIR))
+        name = de->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+        type = _dirent_type(dp, de);
+        if (type == S_IFDIR)
         {
+            filename = g_build_filename(dir, name, NULL);
             /* recursion */
             if (is_legacy)
             {
@@ -276,186 +608,417 @@ static void _fill_apps_from_dir(MenuMenu *menu, GList *lptr, GString *prefix,
             {
                 g_string_append(prefix, name);
                 g_string_append_c(prefix, '-');
-                name = g_intern_string(filename);
                 /* a little trick here - we insert new node after this one */
-                lptr = g_list_insert_before(lptr, lptr->next, (gpointer)name);
-                _fill_apps_from_dir(menu, lptr->next, prefix, FALSE);
+                lptr = g_list_insert_before(lptr, lptr->next,
+                                            (gpointer)g_intern_string(filename));
+                _scan_apps_dir(gen, menu, lptr->next, prefix, FALSE, files, dirs);
                 g_string_truncate(prefix, prefix_len);
             }
+            g_free(filename);
         }
-        else if (!g_str_has_suffix(name, ".desktop") ||
-                 !g_file_test(filename, G_FILE_TEST_IS_REGULAR) ||
-                 !g_key_file_load_from_file(kf, filename,
-                                            G_KEY_FILE_KEEP_TRANSLATIONS, NULL))
-            ; /* ignore not key files */
-        else if ((id = g_key_file_get_string(kf, G_KEY_FILE_DESKTOP_GROUP,
-                                             G_KEY_FILE_DESKTOP_KEY_TYPE, NULL)) == NULL ||
-                 strcmp(id, G_KEY_FILE_DESKTOP_TYPE_APPLICATION) != 0)
-            /* ignore non-applications */
-            g_free(id);
-        else
+        /* ignore not key files, they are not allowed to be special ones */
+        else if (type == S_IFREG && g_str_has_suffix(name, ".desktop"))
         {
-            g_free(id);
+            file = g_slice_new0(AppFile);
+            file->filename = g_build_filename(dir, name, NULL);
+            file->name = g_strdup(name);
+            file->dir = dir;
+            file->dir_fd = dirfd(dp);
+            file->fd = -1;
+            file->ino = de->d_ino;
             if (prefix_len > 0)
-            {
-                g_string_append(prefix, name);
-                app = g_hash_table_lookup(all_apps, prefix->str);
-            }
-            else
-                app = g_hash_table_lookup(all_apps, name);
-            if (app == NULL)
-            {
-                if (!g_key_file_get_boolean(kf, G_KEY_FILE_DESKTOP_GROUP,
-                                            G_KEY_FILE_DESKTOP_KEY_HIDDEN, NULL))
-                {
-                    /* deleted file should be ignored */
-                    app = g_slice_new0(MenuApp);
-                    app->type = MENU_CACHE_TYPE_APP;
-                    app->filename = (prefix_len > 0) ? g_strdup(name) : NULL;
-                    app->id = g_strdup((prefix_len > 0) ? prefix->str : name);
-                    VDBG("found app id=%s", app->id);
-                    g_hash_table_insert(all_apps, app->id, app);
-                    app->dirs = g_list_prepend(NULL, (gpointer)dir);
-                    _fill_app_from_key_file(app, kf);
-                }
-            }
-            else if (app->allocated)
-                g_warning("id '%s' already allocated for %s and requested to"
-                          " change to %s, ignoring request", name,
-                          (const char *)app->dirs->data, dir);
-            else if (g_key_file_get_boolean(kf, G_KEY_FILE_DESKTOP_GROUP,
-                                            G_KEY_FILE_DESKTOP_KEY_HIDDEN, NULL))
-            {
-                VDBG("removing app id=%s", app->id),
-                g_hash_table_remove(all_apps, name);
-            }
-            else
-            {
-                /* reset the data */
-                menu_app_reset(app);
-                app->filename = (prefix_len > 0) ? g_strdup(name) : NULL;
-                /* reorder dirs list */
-                app->dirs = g_list_remove(app->dirs, dir);
-                app->dirs = g_list_prepend(app->dirs, (gpointer)dir);
-                _fill_app_from_key_file(app, kf);
-                /* FIXME: conform to spec about Legacy in Categories field */
-            }
-            if (prefix_len > 0)
-                g_string_truncate(prefix, prefix_len);
+                file->id = g_strconcat(prefix->str, name, NULL);
+            g_ptr_array_add(files, file);
         }
-        g_free(filename);
     }
-    g_dir_close(gd);
-    g_key_file_free(kf);
 }
 
-static int _compare_items(gconstpointer a, gconstpointer b)
+/* runs in thread pool, uses only data which aren't changed while parsing */
+static void _parse_app_file(gpointer data, gpointer user_data)
 {
-    /* return negative value to reverse sort list */
-    return -strcmp(((MenuApp*)a)->type == MENU_CACHE_TYPE_APP ? ((MenuApp*)a)->key
-                                                              : ((MenuMenu*)a)->key,
-                   ((MenuApp*)b)->type == MENU_CACHE_TYPE_APP ? ((MenuApp*)b)->key
-                                                              : ((MenuMenu*)b)->key);
+    _get_app_entry(user_data, data);
 }
 
-static gboolean menu_app_match_tag(MenuApp *app, FmXmlFileItem *it)
+#ifdef HAVE_LIBURING
+/* on cold cache waiting for each file in turn is what takes most of the
+   time, so stat all files and read changed ones in batches via io_uring
+   before parsing; anything which failed is left for _get_app_entry() */
+static void _prefetch_app_files(MenuCacheGen *gen, GPtrArray *files)
 {
-    FmXmlFileTag tag = fm_xml_file_item_get_tag(it);
-    GList *children, *child;
-    gboolean ok = FALSE;
+    UringFile *ufiles = g_new0(UringFile, files->len);
+    GPtrArray *to_read = g_ptr_array_new();
+    AppFile *file;
+    FileStamp fs;
+    guint i;
 
-    VVDBG("menu_app_match_tag: entering <%s>", fm_xml_file_item_get_tag_name(it));
-    children = fm_xml_file_item_get_children(it);
-    if (tag == menuTag_Or)
+    for (i = 0; i < files->len; i++)
     {
-        for (child = children; child; child = child->next)
-            if (menu_app_match_tag(app, child->data))
-                break;
-        ok = (child != NULL);
+        file = files->pdata[i];
+        ufiles[i].dir_fd = file->dir_fd;
+        ufiles[i].name = file->name;
     }
-    else if (tag == menuTag_And)
+    uring_stat_files(ufiles, files->len);
+    for (i = 0; i < files->len; i++)
     {
-        for (child = children; child; child = child->next)
-            if (!menu_app_match_tag(app, child->data))
-                break;
-        ok = (child == NULL);
+        file = files->pdata[i];
+        if (ufiles[i].result != 0 || !file_stamp_from_statx(&ufiles[i].stx, &fs))
+            continue; /* let _get_app_entry() try it again */
+        _stamp_app_file(gen, file, &fs);
+        /* it will be parsed so read it */
+        if (file->entry == NULL && file->size > 0)
+            g_ptr_array_add(to_read, file);
     }
-    else if (tag == menuTag_Not)
+    /* stat results aren't needed anymore so reuse the array */
+    memset(ufiles, 0, to_read->len * sizeof(UringFile));
+    for (i = 0; i < to_read->len; i++)
     {
-        for (child = children; child; child = child->next)
-            if (menu_app_match_tag(app, child->data))
-                break;
-        ok = (child == NULL);
+        file = to_read->pdata[i];
+        ufiles[i].dir_fd = file->dir_fd;
+        ufiles[i].name = file->name;
+        ufiles[i].size = file->size;
     }
-    else if (tag == menuTag_All)
-        ok = TRUE;
-    else if (tag == menuTag_Filename)
+    if (to_read->len > 0)
+        uring_read_files(ufiles, to_read->len);
+    for (i = 0; i < to_read->len; i++)
     {
-        register const char *id = fm_xml_file_item_get_data(children->data, NULL);
-        ok = (g_strcmp0(id, app->id) == 0);
+        file = to_read->pdata[i];
+        file->contents = ufiles[i].contents;
+        file->len = ufiles[i].len;
     }
-    else if (tag == menuTag_Category)
+    g_ptr_array_free(to_read, TRUE);
+    g_free(ufiles);
+}
+#endif
+
+#ifdef HAVE_POSIX_FADVISE
+/* files opened for readahead are kept open for the parser, but not too
+   many of them to stay well within limit of descriptors */
+#define MAX_READAHEAD_FDS 256
+
+/* stats files and hints the kernel to read those which will be parsed, so
+   the parser doesn't wait for the disk for each file in turn */
+static void _readahead_app_files(MenuCacheGen *gen, GPtrArray *files)
+{
+    AppFile *file;
+    FileStamp fs;
+    guint i, n_fds = 0;
+    int fd;
+
+    for (i = 0; i < files->len; i++)
     {
-        if (app->categories != NULL)
+        file = files->pdata[i];
+        if (gen->store != NULL && !file->stamped)
+            _stamp_app_file(gen, file, file_stamp_get(file->dir_fd, file->name,
+                                                      &fs) == 1 ? &fs : NULL);
+        if (file->entry != NULL || file->contents != NULL)
+            continue; /* no need to read it */
+        fd = openat(file->dir_fd, file->name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        if (n_fds < MAX_READAHEAD_FDS)
         {
-            const char *cat = g_intern_string(fm_xml_file_item_get_data(children->data, NULL));
-            const char **cats = app->categories;
-            while (*cats)
-                if (*cats == cat)
-                    break;
-                else
-                    cats++;
-            ok = (*cats != NULL);
+            file->fd = fd;
+            n_fds++;
+        }
+        else /* pages are kept in cache after close */
+            close(fd);
+    }
+}
+#endif
+
+static gint _compare_app_files_ino(gconstpointer a, gconstpointer b)
+{
+    const AppFile *fa = *(AppFile * const *)a, *fb = *(AppFile * const *)b;
+
+    return (fa->ino < fb->ino) ? -1 : (fa->ino > fb->ino);
+}
+
+static void _parse_app_files(MenuCacheGen *gen, GPtrArray *files)
+{
+    GThreadPool *pool = NULL;
+    GPtrArray *order;
+    guint i;
+
+    /* directory order is random in regard to disk layout, inodes order is
+       much closer to it; files are applied in directory order anyway */
+    order = g_ptr_array_sized_new(files->len);
+    for (i = 0; i < files->len; i++)
+        g_ptr_array_add(order, files->pdata[i]);
+    g_ptr_array_sort(order, _compare_app_files_ino);
+#ifdef HAVE_LIBURING
+    if (order->len >= MIN_FILES_TO_PARSE_IN_PARALLEL && gen->store != NULL)
+        _prefetch_app_files(gen, order);
+#endif
+#ifdef HAVE_POSIX_FADVISE
+    /* for few files hints only add syscalls, most probably they are in
+       cache already */
+    if (order->len >= MIN_FILES_TO_PARSE_IN_PARALLEL)
+        _readahead_app_files(gen, order);
+#endif
+    if (order->len >= MIN_FILES_TO_PARSE_IN_PARALLEL)
+#if GLIB_CHECK_VERSION(2, 36, 0)
+        pool = g_thread_pool_new(_parse_app_file, gen, g_get_num_processors(),
+                                 FALSE, NULL);
+#else
+        pool = g_thread_pool_new(_parse_app_file, gen, 4, FALSE, NULL);
+#endif
+    if (pool == NULL)
+        for (i = 0; i < order->len; i++)
+            _parse_app_file(order->pdata[i], gen);
+    else
+    {
+        for (i = 0; i < order->len; i++)
+            g_thread_pool_push(pool, order->pdata[i], NULL);
+        /* wait for all files to be parsed */
+        g_thread_pool_free(pool, FALSE, TRUE);
+    }
+    g_ptr_array_free(order, TRUE);
+}
+
+/* ignores already present files that are allocated */
+static void _apply_app_file(MenuCacheGen *gen, AppFile *file)
+{
+    MenuApp *app, *entry = file->entry;
+    const char *name = file->name;
+    const char *dir = file->dir;
+
+    if (entry->type != MENU_CACHE_TYPE_APP)
+        ; /* ignore non-applications */
+    else if ((app = g_hash_table_lookup(gen->all_apps, file->id ? file->id : name)) == NULL)
+    {
+        if (!entry->deleted)
+        {
+            /* deleted file should be ignored */
+            app = g_slice_new0(MenuApp);
+            app->type = MENU_CACHE_TYPE_APP;
+            app->filename = file->id ? g_strdup(name) : NULL;
+            app->id = g_strdup(file->id ? file->id : name);
+            VDBG("found app id=%s", app->id);
+            g_hash_table_insert(gen->all_apps, app->id, app);
+            app->dirs = g_list_prepend(NULL, (gpointer)dir);
+            _fill_app_from_entry(gen, app, entry);
+        }
+    }
+    else if (app->allocated)
+        g_warning("id '%s' already allocated for %s and requested to"
+                  " change to %s, ignoring request", name,
+                  (const char *)app->dirs->data, dir);
+    else if (entry->deleted)
+    {
+        VDBG("removing app id=%s", app->id),
+        g_hash_table_remove(gen->all_apps, name);
+    }
+    else
+    {
+        /* reset the data */
+        menu_app_reset(app);
+        app->filename = file->id ? g_strdup(name) : NULL;
+        /* reorder dirs list */
+        app->dirs = g_list_remove(app->dirs, dir);
+        app->dirs = g_list_prepend(app->dirs, (gpointer)dir);
+        _fill_app_from_entry(gen, app, entry);
+        /* FIXME: conform to spec about Legacy in Categories field */
+    }
+    if (file->owned)
+        menu_app_free(entry);
+    if (file->fd >= 0)
+        close(file->fd);
+    g_free(file->filename);
+    g_free(file->name);
+    g_free(file->id);
+    g_slice_free(AppFile, file);
+}
+
+static void _fill_apps_from_dir(MenuCacheGen *gen, MenuMenu *menu, GList *lptr,
+                                GString *prefix, gboolean is_legacy)
+{
+    GPtrArray *files = g_ptr_array_new();
+    GPtrArray *dirs = g_ptr_array_new();
+    guint i;
+
+    _scan_apps_dir(gen, menu, lptr, prefix, is_legacy, files, dirs);
+    _parse_app_files(gen, files);
+    for (i = 0; i < dirs->len; i++)
+        closedir(dirs->pdata[i]);
+    g_ptr_array_free(dirs, TRUE);
+    for (i = 0; i < files->len; i++)
+        _apply_app_file(gen, files->pdata[i]);
+    /* apps might be changed so the index is invalid now */
+    if (files->len > 0)
+        _free_apps_index(gen);
+    g_ptr_array_free(files, TRUE);
+}
+
+static int _compare_items(gconstpointer a, gconstpointer b)
+{
+    int res;
+
+    /* return negative value to reverse sort list */
+    res = -strcmp(((MenuApp*)a)->type == MENU_CACHE_TYPE_APP ? ((MenuApp*)a)->key
+                                                             : ((MenuMenu*)a)->key,
+                  ((MenuApp*)b)->type == MENU_CACHE_TYPE_APP ? ((MenuApp*)b)->key
+                                                             : ((MenuMenu*)b)->key);
+    /* order of apps with the same name should not depend on matching order */
+    if (res == 0 && ((MenuApp*)a)->type == MENU_CACHE_TYPE_APP &&
+        ((MenuApp*)b)->type == MENU_CACHE_TYPE_APP)
+        res = -strcmp(((MenuApp*)a)->id, ((MenuApp*)b)->id);
+    return res;
+}
+
+static guint _category_id(MenuCacheGen *gen, const char *cat)
+{
+    guint id = GPOINTER_TO_UINT(g_hash_table_lookup(gen->category_ids, cat));
+
+    if (id == 0)
+    {
+        id = ++gen->n_categories;
+        g_hash_table_insert(gen->category_ids, (gpointer)cat, GUINT_TO_POINTER(id));
+    }
+    return id - 1;
+}
+
+/* compiles @it and its children into @ops, anything unknown never matches */
+static void _compile_rule(MenuCacheGen *gen, GArray *ops, FmXmlFileItem *it)
+{
+    FmXmlFileTag tag = fm_xml_file_item_get_tag(it);
+    GList *children, *child;
+    MenuRuleOp op = { RULE_OP_OR, 0, 1, NULL };
+    const char *data;
+    guint pos = ops->len;
+
+    children = fm_xml_file_item_get_children(it);
+    g_array_append_val(ops, op);
+    if (tag == menuTag_Or || tag == menuTag_And || tag == menuTag_Not ||
+        tag == menuTag_Include || tag == menuTag_Exclude)
+    {
+        if (tag == menuTag_And)
+            op.op = RULE_OP_AND;
+        else if (tag == menuTag_Not)
+            op.op = RULE_OP_NOT;
+        for (child = children; child; child = child->next, op.arg++)
+            _compile_rule(gen, ops, child->data);
+    }
+    else if (tag == menuTag_All)
+        op.op = RULE_OP_ALL;
+    else if ((tag == menuTag_Filename || tag == menuTag_Category) && children &&
+             (data = fm_xml_file_item_get_data(children->data, NULL)) != NULL)
+    {
+        if (tag == menuTag_Filename)
+        {
+            op.op = RULE_OP_FILENAME;
+            op.id = g_intern_string(data);
+        }
+        else
+        {
+            op.op = RULE_OP_CATEGORY;
+            op.arg = _category_id(gen, g_intern_string(data));
         }
     }
     g_list_free(children);
-    VVDBG("menu_app_match_tag %s: leaving <%s>: %d", app->id, fm_xml_file_item_get_tag_name(it), ok);
-    return ok;
+    op.size = ops->len - pos;
+    g_array_index(ops, MenuRuleOp, pos) = op;
+}
+
+/* compiles all <Include> and <Exclude> rules in @menu and its submenus */
+static void _compile_rules(MenuCacheGen *gen, MenuMenu *menu)
+{
+    GList *l;
+    MenuRule *rule;
+    FmXmlFileTag tag;
+    GArray *ops;
+
+    for (l = menu->children; l; l = l->next)
+    {
+        rule = l->data;
+        if (rule->type == MENU_CACHE_TYPE_DIR)
+            _compile_rules(gen, l->data);
+        if (rule->type != MENU_CACHE_TYPE_NONE)
+            continue;
+        tag = fm_xml_file_item_get_tag(rule->rule);
+        if (tag != menuTag_Include && tag != menuTag_Exclude)
+            continue;
+        ops = g_array_new(FALSE, FALSE, sizeof(MenuRuleOp));
+        _compile_rule(gen, ops, rule->rule);
+        rule->ops = (MenuRuleOp *)g_array_free(ops, FALSE);
+    }
 }
 
-static gboolean menu_app_match_excludes(MenuApp *app, GList *rules);
+/* sets bits for categories which are used in rules */
+static void _make_cat_bits(MenuCacheGen *gen, MenuApp *app)
+{
+    const char **cats;
+    guint id;
+
+    app->cat_bits = g_new0(guint32, gen->n_categories / 32 + 1);
+    if (app->categories != NULL)
+        for (cats = app->categories; *cats; cats++)
+            if ((id = GPOINTER_TO_UINT(g_hash_table_lookup(gen->category_ids, *cats))) > 0)
+                app->cat_bits[(id - 1) / 32] |= 1U << ((id - 1) % 32);
+}
 
-static gboolean menu_app_match(MenuApp *app, GList *rules, gboolean do_all)
+static gboolean menu_app_match_op(const MenuApp *app, const MenuRuleOp *op)
+{
+    const MenuRuleOp *child;
+    guint i;
+
+    switch (op->op)
+    {
+    case RULE_OP_OR:
+    case RULE_OP_NOT:
+        for (i = 0, child = op + 1; i < op->arg; i++, child += child->size)
+            if (menu_app_match_op(app, child))
+                return (op->op == RULE_OP_OR);
+        return (op->op == RULE_OP_NOT);
+    case RULE_OP_AND:
+        for (i = 0, child = op + 1; i < op->arg; i++, child += child->size)
+            if (!menu_app_match_op(app, child))
+                return FALSE;
+        return TRUE;
+    case RULE_OP_ALL:
+        return TRUE;
+    case RULE_OP_CATEGORY:
+        return (app->cat_bits[op->arg / 32] & (1U << (op->arg % 32))) != 0;
+    case RULE_OP_FILENAME:
+        return (strcmp(op->id, app->id) == 0);
+    }
+    return FALSE;
+}
+
+static gboolean menu_app_match_excludes(MenuCacheGen *gen, MenuApp *app, GList *rules);
+
+static gboolean menu_app_match(MenuCacheGen *gen, MenuApp *app, GList *rules,
+                               gboolean do_all)
 {
     MenuRule *rule;
-    GList *children, *child;
 
     for (; rules != NULL; rules = rules->next)
     {
         rule = rules->data;
-        if (rule->type != MENU_CACHE_TYPE_NONE ||
+        if (rule->type != MENU_CACHE_TYPE_NONE || rule->ops == NULL ||
             fm_xml_file_item_get_tag(rule->rule) != menuTag_Include)
             continue;
-        children = fm_xml_file_item_get_children(rule->rule);
-        for (child = children; child; child = child->next)
-            if (menu_app_match_tag(app, child->data))
-                break;
-        g_list_free(children);
-        if (child != NULL)
-            return (!do_all || !menu_app_match_excludes(app, rules->next));
+        STATS_INC(gen, rules_evaluated);
+        if (menu_app_match_op(app, rule->ops))
+            return (!do_all || !menu_app_match_excludes(gen, app, rules->next));
     }
     return FALSE;
 }
 
-static gboolean menu_app_match_excludes(MenuApp *app, GList *rules)
+static gboolean menu_app_match_excludes(MenuCacheGen *gen, MenuApp *app, GList *rules)
 {
     MenuRule *rule;
-    GList *children, *child;
 
     for (; rules != NULL; rules = rules->next)
     {
         rule = rules->data;
-        if (rule->type != MENU_CACHE_TYPE_NONE ||
+        if (rule->type != MENU_CACHE_TYPE_NONE || rule->ops == NULL ||
             fm_xml_file_item_get_tag(rule->rule) != menuTag_Exclude)
             continue;
-        children = fm_xml_file_item_get_children(rule->rule);
-        for (child = children; child; child = child->next)
-            if (menu_app_match_tag(app, child->data))
-                break;
-        g_list_free(children);
-        if (child != NULL)
+        STATS_INC(gen, rules_evaluated);
+        if (menu_app_match_op(app, rule->ops))
             /* application might be included again later so check for it */
-            return !menu_app_match(app, rules->next, TRUE);
+            return !menu_app_match(gen, app, rules->next, TRUE);
     }
     return FALSE;
 }
@@ -486,8 +1049,12 @@ static void _free_leftovers(GList *item)
     while (item)
     {
         a.menu = item->data;
-        if (a.rule->type == MENU_CACHE_TYPE_NONE)
+        if (a.rule->type == MENU_CACHE_TYPE_NONE &&
+            item->data != &_merged_begin && item->data != &_merged_end)
+        {
+            g_free(a.rule->ops);
             g_slice_free(MenuRule, a.rule);
+        }
         else if (a.rule->type == MENU_CACHE_TYPE_DIR)
             menu_menu_free(a.menu);
         /* MenuApp and MenuSep are not allocated in menu->children */
@@ -495,8 +1062,170 @@ static void _free_leftovers(GList *item)
     }
 }
 
+/* tests if @op may match apps not found by _collect_candidates() */
+static gboolean _op_needs_scan(const MenuRuleOp *op)
+{
+    const MenuRuleOp *child;
+    guint i;
+
+    switch (op->op)
+    {
+    case RULE_OP_OR:
+        for (i = 0, child = op + 1; i < op->arg; i++, child += child->size)
+            if (_op_needs_scan(child))
+                return TRUE;
+        return FALSE;
+    case RULE_OP_AND:
+        for (i = 0, child = op + 1; i < op->arg; i++, child += child->size)
+            if (!_op_needs_scan(child))
+                return FALSE;
+        return TRUE;
+    case RULE_OP_NOT:
+    case RULE_OP_ALL:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+/* adds into @set all apps which @op may match */
+static void _collect_candidates(MenuCacheGen *gen, const MenuRuleOp *op, GHashTable *set)
+{
+    const MenuRuleOp *child;
+    GPtrArray *list;
+    MenuApp *app;
+    guint i;
+
+    switch (op->op)
+    {
+    case RULE_OP_OR:
+        for (i = 0, child = op + 1; i < op->arg; i++, child += child->size)
+            _collect_candidates(gen, child, set);
+        break;
+    case RULE_OP_AND:
+        /* any operand limits the result */
+        for (i = 0, child = op + 1; i < op->arg; i++, child += child->size)
+            if (!_op_needs_scan(child))
+            {
+                _collect_candidates(gen, child, set);
+                break;
+            }
+        break;
+    case RULE_OP_CATEGORY:
+        list = gen->category_apps[op->arg];
+        for (i = 0; i < list->len; i++)
+            g_hash_table_insert(set, list->pdata[i], list->pdata[i]);
+        break;
+    case RULE_OP_FILENAME:
+        app = g_hash_table_lookup(gen->all_apps, op->id);
+        if (app != NULL)
+            g_hash_table_insert(set, app, app);
+        break;
+    default: ;
+    }
+}
+
+/* builds index of apps by categories used in rules */
+static void _make_apps_index(MenuCacheGen *gen)
+{
+    GHashTableIter iter;
+    MenuApp *app;
+    guint i;
+
+    gen->category_apps = g_new(GPtrArray *, gen->n_categories);
+    for (i = 0; i < gen->n_categories; i++)
+        gen->category_apps[i] = g_ptr_array_new();
+    g_hash_table_iter_init(&iter, gen->all_apps);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&app))
+    {
+        if (app->cat_bits == NULL)
+            _make_cat_bits(gen, app);
+        for (i = 0; i < gen->n_categories; i++)
+            if (app->cat_bits[i / 32] & (1U << (i % 32)))
+                g_ptr_array_add(gen->category_apps[i], app);
+    }
+}
+
+/* returns set of apps which may be matched by <Include> rules of @menu, or
+   NULL if all apps should be checked */
+static GHashTable *_get_candidates(MenuCacheGen *gen, MenuMenu *menu)
+{
+    GHashTable *set;
+    GList *l;
+    MenuRule *rule;
+
+    for (l = menu->children; l; l = l->next)
+    {
+        rule = l->data;
+        if (rule->type == MENU_CACHE_TYPE_NONE && rule->ops != NULL &&
+            fm_xml_file_item_get_tag(rule->rule) == menuTag_Include &&
+            _op_needs_scan(rule->ops))
+            return NULL;
+    }
+    if (gen->category_apps == NULL)
+        _make_apps_index(gen);
+    set = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (l = menu->children; l; l = l->next)
+    {
+        rule = l->data;
+        if (rule->type == MENU_CACHE_TYPE_NONE && rule->ops != NULL &&
+            fm_xml_file_item_get_tag(rule->rule) == menuTag_Include)
+            _collect_candidates(gen, rule->ops, set);
+    }
+    VDBG("%u candidates to match", g_hash_table_size(set));
+    return set;
+}
+
+/* matches @app against @menu and marks it allocated if matched */
+static gboolean _app_is_available(MenuCacheGen *gen, MenuMenu *menu, GList *apps,
+                                  MenuApp *app)
+{
+    GList *child, *l;
+
+    app->matched = FALSE;
+    /* check every dir if it is in $apps */
+    if (menu->layout.inline_limit_is_set)
+    {
+        for (child = app->dirs; child; child = child->next)
+            if (menu->dir == child->data)
+                break;
+    }
+    else for (child = app->dirs; child; child = child->next)
+    {
+        for (l = apps; l; l = l->next)
+        {
+            if (l->data == child->data)
+                break;
+        }
+        if (l != NULL) /* found one */
+            break;
+    }
+    VVDBG("check %s in %s: %d", app->id, app->dirs ? (const char *)app->dirs->data : "(nil)", child != NULL);
+    if (child == NULL) /* not matched */
+        return FALSE;
+    /* Check matching : Include And Or Not All */
+    if (menu->layout.inline_limit_is_set)
+        app->matched = (app->categories == NULL); /* see the spec */
+    else
+    {
+        if (app->cat_bits == NULL)
+            _make_cat_bits(gen, app);
+        app->matched = menu_app_match(gen, app, menu->children, FALSE);
+    }
+    if (!app->matched)
+        return FALSE;
+    if (!app->allocated)
+        STATS_INC(gen, apps_allocated);
+    app->allocated = TRUE;
+    /* Mark it by Exclude And Or Not All */
+    app->excluded = menu_app_match_excludes(gen, app, menu->children);
+    VVDBG("found match: %s excluded:%d", app->id, app->excluded);
+    return !app->excluded;
+}
+
 /* dirs are in order "first is more relevant" */
-static void _stage1(MenuMenu *menu, GList *dirs, GList *apps, GList *legacy, GList *p)
+static void _stage1(MenuCacheGen *gen, MenuMenu *menu, GList *dirs, GList *apps,
+                    GList *legacy, GList *p)
 {
     GList *child, *_dirs = NULL, *_apps = NULL, *_legs = NULL, *_lprefs = NULL;
     GList *l, *available = NULL, *result;
@@ -506,6 +1235,8 @@ static void _stage1(MenuMenu *menu, GList *dirs, GList *apps, GList *legacy, GLi
     MenuApp *app;
     FmXmlFileTag tag;
     GHashTableIter iter;
+    GHashTable *candidates, *placed, *layout_names, *avail_links = NULL;
+    guint pos;
 
     DBG("... entering %s (%d dirs %d apps)", menu->name, g_list_length(dirs), g_list_length(apps));
     /* Gather our dirs : DirectoryDir AppDir LegacyDir KDELegacyDirs */
@@ -542,35 +1273,14 @@ static void _stage1(MenuMenu *menu, GList *dirs, GList *apps, GList *legacy, GLi
     for (l = menu->id; l; l = l->next)
     {
         /* scan dirs now for availability of any of ids */
-        filename = NULL;
-        for (child = dirs; child; child = child->next)
-        {
-            filename = g_build_filename(child->data, l->data, NULL);
-            if (g_file_test(filename, G_FILE_TEST_IS_REGULAR))
-                break;
-            g_free(filename);
-            filename = NULL;
-        }
-        if (filename == NULL) for (child = _legs; child; child = child->next)
-        {
-            filename = g_build_filename(child->data, l->data, NULL);
-            if (g_file_test(filename, G_FILE_TEST_IS_REGULAR))
-                break;
-            g_free(filename);
-            filename = NULL;
-        }
-        if (filename == NULL) for (child = legacy; child; child = child->next)
+        if ((child = _find_dir_file(gen, dirs, l->data)) == NULL &&
+            (child = _find_dir_file(gen, _legs, l->data)) == NULL)
+            child = _find_dir_file(gen, legacy, l->data);
+        if (child != NULL)
         {
             filename = g_build_filename(child->data, l->data, NULL);
-            if (g_file_test(filename, G_FILE_TEST_IS_REGULAR))
-                break;
-            g_free(filename);
-            filename = NULL;
-        }
-        if (filename != NULL)
-        {
             VVDBG("found dir file %s", filename);
-            _fill_menu_from_file(menu, filename);
+            _fill_menu_from_file(gen, menu, filename);
             g_free(filename);
             if (!menu->layout.is_set)
                 continue;
@@ -586,7 +1296,7 @@ static void _stage1(MenuMenu *menu, GList *dirs, GList *apps, GList *legacy, GLi
     if (menu->layout.inline_limit_is_set && !menu->layout.is_set)
     {
         filename = g_build_filename(menu->dir, ".directory", NULL);
-        _fill_menu_from_file(menu, filename);
+        _fill_menu_from_file(gen, menu, filename);
         g_free(filename);
         filename = NULL;
     }
@@ -627,7 +1337,7 @@ static void _stage1(MenuMenu *menu, GList *dirs, GList *apps, GList *legacy, GLi
     if (!menu->layout.inline_limit_is_set) for (l = _apps; l; l = l->next)
     {
         /* scan and fill the list */
-        _fill_apps_from_dir(menu, l, prefix, FALSE);
+        _fill_apps_from_dir(gen, menu, l, prefix, FALSE);
     }
     if (_apps != NULL)
         apps = _apps = g_list_concat(g_list_copy(apps), _apps);
@@ -636,7 +1346,7 @@ static void _stage1(MenuMenu *menu, GList *dirs, GList *apps, GList *legacy, GLi
         /* use prefix from <LegacyDir> attribute */
         g_string_assign(prefix, NONULL(child->data));
         VDBG("got legacy prefix %s", (char*)child->data);
-        _fill_apps_from_dir(menu, l, prefix, TRUE);
+        _fill_apps_from_dir(gen, menu, l, prefix, TRUE);
         g_string_truncate(prefix, 0);
     }
     if (_legs != NULL)
@@ -645,48 +1355,27 @@ static void _stage1(MenuMenu *menu, GList *dirs, GList *apps, GList *legacy, GLi
         p = _lprefs = g_list_concat(g_list_copy(p), _lprefs);
     /* Gather all available files (some in $all_apps may be not in $apps) */
     VDBG("... do matching");
-    g_hash_table_iter_init(&iter, all_apps);
+    candidates = menu->layout.inline_limit_is_set ? NULL : _get_candidates(gen, menu);
+    if (candidates != NULL)
+        g_hash_table_iter_init(&iter, candidates);
+    else
+        g_hash_table_iter_init(&iter, gen->all_apps);
     while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&app))
-    {
-        app->matched = FALSE;
-        /* check every dir if it is in $apps */
-        if (menu->layout.inline_limit_is_set)
-        {
-            for (child = app->dirs; child; child = child->next)
-                if (menu->dir == child->data)
-                    break;
-        }
-        else for (child = app->dirs; child; child = child->next)
-        {
-            for (l = apps; l; l = l->next)
-            {
-                if (l->data == child->data)
-                    break;
-            }
-            if (l != NULL) /* found one */
-                break;
-        }
-        VVDBG("check %s in %s: %d", app->id, app->dirs ? (const char *)app->dirs->data : "(nil)", child != NULL);
-        if (child == NULL) /* not matched */
-            continue;
-        /* Check matching : Include And Or Not All */
-        if (menu->layout.inline_limit_is_set)
-            app->matched = (app->categories == NULL); /* see the spec */
-        else
-            app->matched = menu_app_match(app, menu->children, FALSE);
-        if (!app->matched)
-            continue;
-        app->allocated = TRUE;
-        /* Mark it by Exclude And Or Not All */
-        app->excluded = menu_app_match_excludes(app, menu->children);
-        VVDBG("found match: %s excluded:%d", app->id, app->excluded);
-        if (!app->excluded)
+        if (_app_is_available(gen, menu, apps, app))
             available = g_list_prepend(available, app);
-    }
+    if (candidates != NULL)
+        g_hash_table_destroy(candidates);
     /* Compose layout using available list and replace menu->children */
     VDBG("... compose (available=%d)", g_list_length(available));
     result = NULL;
-    for (child = menu->layout.items; child; child = child->next)
+    placed = g_hash_table_new(g_direct_hash, g_direct_equal);
+    /* last position + 1 of each Menuname in layout */
+    layout_names = g_hash_table_new(g_str_hash, g_str_equal);
+    for (child = menu->layout.items, pos = 1; child; child = child->next, pos++)
+        if (((MenuMenuname *)child->data)->layout.type == MENU_CACHE_TYPE_DIR)
+            g_hash_table_insert(layout_names, ((MenuMenuname *)child->data)->name,
+                                GUINT_TO_POINTER(pos));
+    for (child = menu->layout.items, pos = 1; child; child = child->next, pos++)
     {
         GList *next;
         app = child->data; /* either: MenuMenuname, MemuFilename, MenuSep, MenuMerge */
@@ -715,18 +1404,17 @@ static void _stage1(MenuMenu *menu, GList *dirs, GList *apps, GList *legacy, GLi
                 /* prepend to result */
                 result = g_list_concat(l, result);
                 /* ready for recursion now */
-                _stage1(l->data, dirs, apps, legacy, p);
+                _stage1(gen, l->data, dirs, apps, legacy, p);
             }
             break;
         case MENU_CACHE_TYPE_APP: /* MemuFilename */
             VDBG("composing Filename %s", ((MenuFilename *)app)->id);
-            app = g_hash_table_lookup(all_apps, ((MenuFilename *)app)->id);
+            app = g_hash_table_lookup(gen->all_apps, ((MenuFilename *)app)->id);
             if (app == NULL)
                 /* not available, ignoring it */
                 break;
-            l = g_list_find(result, app); /* this might be slow but we have
-                                             to do this because app might be
-                                             already added into result */
+            /* app might be already added into result */
+            l = g_hash_table_lookup(placed, app);
             if (l != NULL)
             {
                 /* move it out to this place */
@@ -735,15 +1423,24 @@ static void _stage1(MenuMenu *menu, GList *dirs, GList *apps, GList *legacy, GLi
             }
             else
             {
-                l = g_list_find(available, app);
+                if (avail_links == NULL)
+                {
+                    avail_links = g_hash_table_new(g_direct_hash, g_direct_equal);
+                    for (l = available; l; l = l->next)
+                        g_hash_table_insert(avail_links, l->data, l);
+                }
+                l = g_hash_table_lookup(avail_links, app);
                 VVDBG("+++ composing app %s%s", app->id, (l == NULL) ? " (add)" : "");
                 if (l != NULL)
+                {
                     available = g_list_remove_link(available, l);
+                    g_hash_table_remove(avail_links, app);
+                }
                 else
                     l = g_list_prepend(NULL, app);
+                g_hash_table_insert(placed, app, l);
             }
-            if (l != NULL)
-                app->menus = g_list_prepend(app->menus, menu);
+            app->n_menus++;
             result = g_list_concat(l, result);
             break;
         case MENU_CACHE_TYPE_SEP: /* MenuSep */
@@ -762,18 +1459,13 @@ static void _stage1(MenuMenu *menu, GList *dirs, GList *apps, GList *legacy, GLi
                 {
                     app = l->data;
                     VVDBG("+++ composing app %s", app->id);
-                    if (app->key == NULL)
-                    {
-                        if (app->title != NULL)
-                            app->key = g_utf8_collate_key(app->title, -1);
-                        else
-                            g_warning("id %s has no Name", app->id),
-                            app->key = g_utf8_collate_key(app->id, -1);
-                    }
-                    app->menus = g_list_prepend(app->menus, menu);
+                    app->n_menus++;
+                    g_hash_table_insert(placed, app, l);
                 }
                 next = available;
                 available = NULL;
+                if (avail_links != NULL)
+                    g_hash_table_remove_all(avail_links);
                 /* continue with menus */
             case MERGE_MENUS:
                 if (tag != 1) for (l = menu->children; l; )
@@ -783,25 +1475,15 @@ static void _stage1(MenuMenu *menu, GList *dirs, GList *apps, GList *legacy, GLi
                         GList *this = l;
 
                         /* find it in the rest of layout and skip if it's found */
-                        for (l = child->next; l; l = l->next)
-                            if (((MenuMenuname *)l->data)->layout.type == MENU_CACHE_TYPE_DIR &&
-                                strcmp(((MenuMenuname *)l->data)->name, ((MenuMenu *)this->data)->name) == 0)
-                                break;
-                        if (l != NULL)
+                        if (GPOINTER_TO_UINT(g_hash_table_lookup(layout_names,
+                                                                 ((MenuMenu *)this->data)->name)) > pos)
                         {
                             /* it will be added later by MenuMenuname handler */
                             l = this->next;
                             continue;
                         }
-                        _stage1(this->data, dirs, apps, legacy, p); /* it's time for recursion */
+                        _stage1(gen, this->data, dirs, apps, legacy, p); /* it's time for recursion */
                         VVDBG("+++ composing menu %s (%s)", ((MenuMenu *)this->data)->name, ((MenuMenu *)this->data)->title);
-                        if (((MenuMenu *)this->data)->key == NULL)
-                        {
-                            if (((MenuMenu *)this->data)->title != NULL)
-                                ((MenuMenu *)this->data)->key = g_utf8_collate_key(((MenuMenu *)this->data)->title, -1);
-                            else
-                                ((MenuMenu *)this->data)->key = g_utf8_collate_key(((MenuMenu *)this->data)->name, -1);
-                        }
                         l = this->next;
                         /* move out from menu->children into result */
                         menu->children = g_list_remove_link(menu->children, this);
@@ -810,7 +1492,12 @@ static void _stage1(MenuMenu *menu, GList *dirs, GList *apps, GList *legacy, GLi
                     else
                         l = l->next;
                 }
-                result = g_list_concat(g_list_sort(next, _compare_items), result);
+                if (next == NULL)
+                    break;
+                /* sorting depends on language, it's done by _localize_menu() */
+                result = g_list_prepend(result, &_merged_begin);
+                result = g_list_concat(next, result);
+                result = g_list_prepend(result, &_merged_end);
                 break;
             default: ;
             }
@@ -819,6 +1506,100 @@ static void _stage1(MenuMenu *menu, GList *dirs, GList *apps, GList *legacy, GLi
     VDBG("... cleanup");
     _free_leftovers(menu->children);
     menu->children = g_list_reverse(result);
+    /* NOTE: now only menus are allocated in menu->children */
+    DBG("... done %s", menu->name);
+    /* Do cleanup */
+    g_list_free(available);
+    g_hash_table_destroy(placed);
+    g_hash_table_destroy(layout_names);
+    if (avail_links != NULL)
+        g_hash_table_destroy(avail_links);
+    g_list_free(_dirs);
+    g_list_free(_apps);
+    g_list_free(_legs);
+    g_list_free(_lprefs);
+    g_string_free(prefix, TRUE);
+}
+
+/* sets strings of @app for language @i */
+static void _localize_app(MenuCacheGen *gen, MenuApp *app, guint i)
+{
+    if (app->l10n == NULL)
+        return;
+    g_free(app->title);
+    app->title = g_strdup(app->l10n[i].title);
+    g_free(app->comment);
+    app->comment = g_strdup(app->l10n[i].comment);
+    g_free(app->generic_name);
+    app->generic_name = g_strdup(app->l10n[i].generic_name);
+    g_free(app->keywords);
+    app->keywords = _copy_list(gen, app->l10n[i].keywords, FALSE);
+    g_free(app->key);
+    app->key = NULL;
+}
+
+static void _make_sort_key(gpointer item)
+{
+    MenuApp *app = item;
+    MenuMenu *menu = item;
+
+    if (app->type == MENU_CACHE_TYPE_APP)
+    {
+        if (app->key != NULL)
+            ;
+        else if (app->title != NULL)
+            app->key = g_utf8_collate_key(app->title, -1);
+        else
+            g_warning("id %s has no Name", app->id),
+            app->key = g_utf8_collate_key(app->id, -1);
+    }
+    else if (menu->key != NULL)
+        ;
+    else if (menu->title != NULL)
+        menu->key = g_utf8_collate_key(menu->title, -1);
+    else
+        menu->key = g_utf8_collate_key(menu->name, -1);
+}
+
+/* finishes @menu composed by _stage1() for language @i: sets its strings,
+   sorts items merged by <Merge> and inlines submenus */
+static void _localize_menu(MenuCacheGen *gen, MenuMenu *menu, guint i)
+{
+    GList *child, *l, *sorted, *next;
+    MenuApp *app;
+
+    if (menu->l10n != NULL)
+    {
+        g_free(menu->title);
+        menu->title = g_strdup(menu->l10n[i].title);
+        g_free(menu->comment);
+        menu->comment = g_strdup(menu->l10n[i].comment);
+    }
+    for (child = menu->children; child; child = child->next)
+        if (((MenuApp *)child->data)->type == MENU_CACHE_TYPE_DIR)
+            _localize_menu(gen, child->data, i);
+    for (child = menu->children; child; child = next)
+    {
+        next = child->next;
+        if (child->data != &_merged_begin)
+            continue;
+        /* collect them in order they were merged */
+        sorted = NULL;
+        for (l = next; l->data != &_merged_end; l = l->next)
+        {
+            _make_sort_key(l->data);
+            sorted = g_list_prepend(sorted, l->data);
+        }
+        sorted = g_list_reverse(g_list_sort(sorted, _compare_items));
+        for (l = next; sorted; l = l->next)
+        {
+            l->data = sorted->data;
+            sorted = g_list_delete_link(sorted, sorted);
+        }
+        next = l->next;
+        menu->children = g_list_delete_link(menu->children, l);
+        menu->children = g_list_delete_link(menu->children, child);
+    }
     for (child = menu->children; child; )
     {
         MenuMenu *submenu = child->data;
@@ -859,18 +1640,36 @@ static void _stage1(MenuMenu *menu, GList *dirs, GList *apps, GList *legacy, GLi
             menu_menu_free(submenu);
         }
     }
-    /* NOTE: now only menus are allocated in menu->children */
-    DBG("... done %s", menu->name);
-    /* Do cleanup */
-    g_list_free(available);
-    g_list_free(_dirs);
-    g_list_free(_apps);
-    g_list_free(_legs);
-    g_list_free(_lprefs);
-    g_string_free(prefix, TRUE);
 }
 
-static gint _stage2(MenuMenu *menu, gboolean with_hidden)
+/* copies @menu composed by _stage1() so it can be finished for few outputs,
+   separators are shared with @menu; it may be localized already */
+static MenuMenu *_clone_menu(MenuMenu *menu)
+{
+    MenuMenu *copy = g_slice_dup(MenuMenu, menu);
+    GList *l;
+
+    copy->layout.items = NULL; /* not used after _stage1() */
+    copy->name = g_strdup(menu->name);
+    copy->key = g_strdup(menu->key);
+    copy->id = NULL;
+    for (l = menu->id; l; l = l->next)
+        copy->id = g_list_prepend(copy->id, g_strdup(l->data));
+    copy->id = g_list_reverse(copy->id);
+    copy->children = NULL;
+    for (l = menu->children; l; l = l->next)
+        if (((MenuApp *)l->data)->type == MENU_CACHE_TYPE_DIR)
+            copy->children = g_list_prepend(copy->children, _clone_menu(l->data));
+        else
+            copy->children = g_list_prepend(copy->children, l->data);
+    copy->children = g_list_reverse(copy->children);
+    copy->title = g_strdup(menu->title);
+    copy->comment = g_strdup(menu->comment);
+    copy->icon = g_strdup(menu->icon);
+    return copy;
+}
+
+static gint _stage2(MenuCacheGen *gen, MenuMenu *menu, gboolean with_hidden)
 {
     GList *child = menu->children, *next, *to_delete = NULL;
     MenuApp *app;
@@ -883,12 +1682,12 @@ static gint _stage2(MenuMenu *menu, gboolean with_hidden)
         next = child->next;
         switch (app->type) {
         case MENU_CACHE_TYPE_APP: /* Menu App */
-            if (menu->layout.only_unallocated && app->menus->next != NULL)
+            if (menu->layout.only_unallocated && app->n_menus > 1)
             {
                 VDBG("removing from %s as only_unallocated %s",menu->name,app->id);
                 /* it is more than in one menu */
                 menu->children = g_list_delete_link(menu->children, child);
-                app->menus = g_list_remove(app->menus, menu);
+                app->n_menus--;
             }
             else if (app->hidden && !with_hidden)
                 /* should be not displayed */
@@ -898,9 +1697,9 @@ static gint _stage2(MenuMenu *menu, gboolean with_hidden)
             break;
         case MENU_CACHE_TYPE_DIR: /* MenuMenu */
             /* do recursion */
-            if (_stage2(child->data, with_hidden) > 0)
+            if (_stage2(gen, child->data, with_hidden) > 0)
                 count++;
-            else if (!with_hidden || req_version < 2)
+            else if (!with_hidden || gen->req_version < 2)
                 to_delete = g_list_prepend(to_delete, child);
             break;
         default:
@@ -932,26 +1731,43 @@ static gint _stage2(MenuMenu *menu, gboolean with_hidden)
     return count;
 }
 
-static inline int _compose_flags(const char **f)
+/* maps each dir to its position in @dirs, the same as g_slist_index() */
+static GHashTable *_make_dir_index(GSList *dirs)
+{
+    GHashTable *index = g_hash_table_new(g_direct_hash, g_direct_equal);
+    int i;
+
+    for (i = 1; dirs; dirs = dirs->next, i++)
+        if (g_hash_table_lookup(index, dirs->data) == NULL)
+            g_hash_table_insert(index, dirs->data, GINT_TO_POINTER(i));
+    return index;
+}
+
+static inline int _dir_index(GHashTable *index, const char *dir)
+{
+    return GPOINTER_TO_INT(g_hash_table_lookup(index, dir)) - 1;
+}
+
+static inline int _compose_flags(MenuCacheGen *gen, const char **f)
 {
     int x = 0, i;
 
     while (*f)
     {
-        i = g_slist_index(DEs, *f++);
+        i = g_slist_index(gen->DEs, *f++);
         if (i >= 0)
             x |= 1 << i;
     }
     return x;
 }
 
-static gboolean write_app_extra(FILE *f, MenuApp *app)
+static gboolean write_app_extra(MenuCacheGen *gen, FILE *f, MenuApp *app)
 {
     gboolean ret;
     char *cats, *keywords;
     char *null_list[] = { NULL };
 
-    if (req_version < 2)
+    if (gen->req_version < 2)
         return TRUE;
     cats = g_strjoinv(";", app->categories ? (char **)app->categories : null_list);
     keywords = g_strjoinv(",", app->keywords ? (char **)app->keywords : null_list);
@@ -962,7 +1778,7 @@ static gboolean write_app_extra(FILE *f, MenuApp *app)
     return ret;
 }
 
-static gboolean write_app(FILE *f, MenuApp *app, gboolean with_hidden)
+static gboolean write_app(MenuCacheGen *gen, FILE *f, MenuApp *app, gboolean with_hidden)
 {
     int index;
     MenuCacheItemFlag flags = 0;
@@ -970,7 +1786,7 @@ static gboolean write_app(FILE *f, MenuApp *app, gboolean with_hidden)
 
     if (app->hidden && !with_hidden)
         return TRUE;
-    index = MAX(g_slist_index(AppDirs, app->dirs->data), 0) + g_slist_length(DirDirs);
+    index = MAX(_dir_index(gen->app_dir_index, app->dirs->data), 0) + gen->n_dir_dirs;
     if (app->use_terminal)
         flags |= FLAG_USE_TERMINAL;
     if (app->hidden)
@@ -978,16 +1794,16 @@ static gboolean write_app(FILE *f, MenuApp *app, gboolean with_hidden)
     if (app->use_notification)
         flags |= FLAG_USE_SN;
     if (app->show_in)
-        show = _compose_flags(app->show_in);
+        show = _compose_flags(gen, app->show_in);
     else if (app->hide_in)
-        show = ~_compose_flags(app->hide_in);
+        show = ~_compose_flags(gen, app->hide_in);
     return fprintf(f, "-%s\n%s\n%s\n%s\n%s\n%d\n%s\n%s\n%u\n%d\n", app->id,
                    NONULL(app->title), NONULL(app->comment), NONULL(app->icon),
                    NONULL(app->filename), index, NONULL(app->generic_name),
-                   NONULL(app->exec), flags, show) > 0 && write_app_extra(f, app);
+                   NONULL(app->exec), flags, show) > 0 && write_app_extra(gen, f, app);
 }
 
-static gboolean write_menu(FILE *f, MenuMenu *menu, gboolean with_hidden)
+static gboolean write_menu(MenuCacheGen *gen, FILE *f, MenuMenu *menu, gboolean with_hidden)
 {
     int index;
     GList *child;
@@ -995,24 +1811,24 @@ static gboolean write_menu(FILE *f, MenuMenu *menu, gboolean with_hidden)
 
     if (!with_hidden && !menu->layout.show_empty && menu->children == NULL)
         return TRUE;
-    if (menu->layout.nodisplay && (!with_hidden || req_version < 2))
+    if (menu->layout.nodisplay && (!with_hidden || gen->req_version < 2))
         return TRUE;
-    index = g_slist_index(DirDirs, menu->dir);
+    index = _dir_index(gen->dir_dir_index, menu->dir);
     if (fprintf(f, "+%s\n%s\n%s\n%s\n%s\n%d\n", menu->name, NONULL(menu->title),
                 NONULL(menu->comment), NONULL(menu->icon),
                 menu->id ? (const char *)menu->id->data : "", index) < 0)
         return FALSE;
     /* pass show_empty into file if format is v.1.2 */
-    if (req_version >= 2 &&
+    if (gen->req_version >= 2 &&
         fprintf(f, "%d\n", menu->layout.nodisplay ? FLAG_IS_NODISPLAY : 0) < 0)
         return FALSE;
     for (child = menu->children; ok && child != NULL; child = child->next)
     {
         index = ((MenuApp *)child->data)->type;
         if (index == MENU_CACHE_TYPE_DIR)
-            ok = write_menu(f, child->data, with_hidden);
+            ok = write_menu(gen, f, child->data, with_hidden);
         else if (index == MENU_CACHE_TYPE_APP)
-            ok = write_app(f, child->data, with_hidden);
+            ok = write_app(gen, f, child->data, with_hidden);
         else if (child->next != NULL && child != menu->children &&
                  ((MenuApp *)child->next->data)->type != MENU_CACHE_TYPE_SEP)
             /* separator - not add duplicates nor at start nor at end */
@@ -1030,89 +1846,221 @@ static gboolean write_menu(FILE *f, MenuMenu *menu, gboolean with_hidden)
  * - menuTag_Include menuTag_Exclude menuTag_And menuTag_Or menuTag_Not menuTag_All :
  *      as matching rules
  */
-gboolean save_menu_cache(MenuMenu *layout, const char *menuname, const char *file,
-                         gboolean with_hidden)
+static void _append_stamps(GString *str, GSList *list, char type, gint64 since)
 {
-    const char *de_names[N_KNOWN_DESKTOPS] = { "LXDE",
-                                               "GNOME",
-                                               "KDE",
-                                               "XFCE",
-                                               "ROX" };
-    char *tmp;
+    for (; list; list = list->next)
+    {
+        g_string_append_c(str, 'S');
+        file_stamp_append(str, type, list->data, since);
+        g_string_append_c(str, '\n');
+    }
+}
+
+/* writes cache @file for @menu finished by _stage2() */
+static gboolean _write_cache_file(MenuCacheGen *gen, MenuMenu *menu, const char *menuname,
+                                  const char *file, GString *stamps, gboolean with_hidden)
+{
+    char *tmp = NULL, *body = NULL, *sum = NULL;
+    size_t body_len = 0;
     FILE *f = NULL;
     GSList *l;
-    int i;
+    int i, n = 0;
     gboolean ok = FALSE;
 
-    tmp = (char *)g_getenv("CACHE_GEN_VERSION");
-    if (tmp && sscanf(tmp, "%d.%u", &i, &req_version) == 2)
-    {
-        if (i != VER_MAJOR) /* unsupported format requested */
-            return FALSE;
-    }
-    if (req_version < VER_MINOR_SUPPORTED) /* unsupported format requested */
-        return FALSE;
-    if (req_version > VER_MINOR) /* fallback to maximal supported format */
-        req_version = VER_MINOR;
-    all_apps = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, menu_app_free);
-    for (i = 0; i < N_KNOWN_DESKTOPS; i++)
-        DEs = g_slist_append(DEs, (gpointer)g_intern_static_string(de_names[i]));
-    /* Recursively add files into layout, don't take OnlyUnallocated into account */
-    _stage1(layout, NULL, NULL, NULL, NULL);
-    /* Recursively remove non-matched files by OnlyUnallocated flag */
-    _stage2(layout, with_hidden);
-    /* Prepare temporary file for safe creation */
-    tmp = strrchr(menuname, G_DIR_SEPARATOR);
-    if (tmp)
-        menuname = &tmp[1];
-    tmp = g_path_get_dirname(file);
-    if (tmp != NULL && !g_file_test(tmp, G_FILE_TEST_EXISTS))
-        g_mkdir_with_parents(tmp, 0700);
-    g_free(tmp);
-    tmp = g_strdup_printf("%sXXXXXX", file);
-    i = g_mkstemp(tmp);
-    if (i < 0)
-        goto failed;
-    /* Compose created layout into output file */
-    f = fdopen(i, "w");
+    /* Compose created layout in memory first to get hash of its content */
+    f = open_memstream(&body, &body_len);
     if (f == NULL)
         goto failed;
     /* Write common data */
-    fprintf(f, "1.%d\n%s%s\n%d\n", req_version, /* use CACHE_GEN_VERSION */
-            menuname, with_hidden ? "+hidden" : "",
-            g_slist_length(DirDirs) + g_slist_length(AppDirs)
-            + g_slist_length(MenuDirs) + g_slist_length(MenuFiles));
-    VDBG("%d %d %d %d",g_slist_length(DirDirs),g_slist_length(AppDirs),g_slist_length(MenuDirs),g_slist_length(MenuFiles));
-    for (l = DirDirs; l; l = l->next)
+    fprintf(f, "%s%s\n%d\n", menuname, with_hidden ? "+hidden" : "",
+            g_slist_length(gen->DirDirs) + g_slist_length(gen->AppDirs)
+            + g_slist_length(gen->MenuDirs) + g_slist_length(gen->MenuFiles));
+    VDBG("%d %d %d %d",g_slist_length(gen->DirDirs),g_slist_length(gen->AppDirs),g_slist_length(gen->MenuDirs),g_slist_length(gen->MenuFiles));
+    for (l = gen->DirDirs; l; l = l->next)
         if (fprintf(f, "D%s\n", (const char *)l->data) < 0)
             goto failed;
-    for (l = AppDirs; l; l = l->next)
+    for (l = gen->AppDirs; l; l = l->next)
         if (fprintf(f, "D%s\n", (const char *)l->data) < 0)
             goto failed;
-    for (l = MenuDirs; l; l = l->next)
+    for (l = gen->MenuDirs; l; l = l->next)
         if (fprintf(f, "D%s\n", (const char *)l->data) < 0)
             goto failed;
-    for (l = MenuFiles; l; l = l->next)
+    for (l = gen->MenuFiles; l; l = l->next)
         if (fprintf(f, "F%s\n", (const char *)l->data) < 0)
             goto failed;
-    for (l = g_slist_nth(DEs, 5); l; l = l->next)
+    for (l = g_slist_nth(gen->DEs, 5); l; l = l->next)
         if (fprintf(f, "%s;", (const char *)l->data) < 0)
             goto failed;
     fputc('\n', f);
     /* Write the menu tree */
-    ok = write_menu(f, layout, with_hidden);
+    ok = write_menu(gen, f, menu, with_hidden);
+    if (fclose(f) != 0)
+        ok = FALSE;
+    f = NULL;
+    if (!ok)
+        goto failed;
+    ok = FALSE;
+    /* the daemon compares this hash to skip notifying clients if the menu
+       wasn't changed by regeneration, therefore it should not depend on
+       anything but the content */
+    sum = g_compute_checksum_for_data(G_CHECKSUM_MD5, (guchar *)body, body_len);
+    /* Prepare temporary file for safe creation */
+    tmp = g_path_get_dirname(file);
+    if (tmp != NULL && !g_file_test(tmp, G_FILE_TEST_EXISTS))
+        g_mkdir_with_parents(tmp, 0700);
+    g_free(tmp);
+    tmp = g_strdup_printf("%sXXXXXX", file);
+    i = g_mkstemp(tmp);
+    if (i < 0)
+        goto failed;
+    f = fdopen(i, "w");
+    if (f == NULL)
+        goto failed;
+    /* the version line carries the content hash, old readers ignore it */
+    ok = ((n = fprintf(f, "1.%d\t%s\n", gen->req_version, /* use CACHE_GEN_VERSION */
+                       sum)) > 0 &&
+          fwrite(body, 1, body_len, f) == body_len);
+    /* Write signatures of used files after the menu, the daemon uses them to
+       check if cache is still valid; they aren't menu content so aren't hashed */
+    if (ok)
+        ok = fwrite(stamps->str, 1, stamps->len, f) == stamps->len;
 failed:
-    if (f != NULL)
-        fclose(f);
+    if (f != NULL && fclose(f) != 0)
+        ok = FALSE;
     if (ok)
         ok = g_rename(tmp, file) == 0;
     else if (tmp)
         g_unlink(tmp);
-    /* Free all the data */
-    menu_menu_free(layout);
+    if (ok && gen->stats != NULL)
+        gen->stats->bytes_written += n + body_len + stamps->len;
+    free(body);
+    g_free(sum);
     g_free(tmp);
-    g_hash_table_destroy(all_apps);
-    g_slist_free(DEs);
-    g_slist_free(loaded_dirs);
+    return ok;
+}
+
+gboolean save_menu_cache(MenuCacheGen *gen, MenuMenu *layout, const char *menuname,
+                         GError **error)
+{
+    const char *de_names[N_KNOWN_DESKTOPS] = { "LXDE",
+                                               "GNOME",
+                                               "KDE",
+                                               "XFCE",
+                                               "ROX" };
+    char *tmp, *msg;
+    GString *stamps;
+    GHashTableIter iter;
+    MenuApp *app;
+    MenuMenu *menu, *tree;
+    MenuCacheGenOutput *output;
+    guint n, j;
+    int i;
+    MenuCacheGenTime start;
+    gboolean with_hidden, ok = TRUE;
+
+    STATS_START(gen, start);
+    gen->all_apps = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, menu_app_free);
+    gen->dir_listings = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                              (GDestroyNotify)g_hash_table_destroy);
+    gen->dir_files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, _dir_file_free);
+    for (i = 0; i < N_KNOWN_DESKTOPS; i++)
+        gen->DEs = g_slist_append(gen->DEs, (gpointer)g_intern_static_string(de_names[i]));
+    /* Compile matching rules, categories in them get dense ids */
+    gen->category_ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+    _compile_rules(gen, layout);
+    /* Recursively add files into layout, don't take OnlyUnallocated into account */
+    _stage1(gen, layout, NULL, NULL, NULL, NULL);
+    STATS_STOP(gen, start, stage1);
+    g_hash_table_iter_init(&iter, gen->all_apps);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&app))
+        app->n_composed = app->n_menus;
+    tmp = strrchr(menuname, G_DIR_SEPARATOR);
+    if (tmp)
+        menuname = &tmp[1];
+    /* Signatures of used files are the same for all outputs. File timestamps
+       are coarse so don't trust anything changed about one second before
+       we started */
+    stamps = g_string_sized_new(1024);
+    _append_stamps(stamps, gen->DirDirs, 'D', gen->started - G_USEC_PER_SEC);
+    _append_stamps(stamps, gen->AppDirs, 'D', gen->started - G_USEC_PER_SEC);
+    _append_stamps(stamps, gen->MenuDirs, 'D', gen->started - G_USEC_PER_SEC);
+    _append_stamps(stamps, gen->MenuFiles, 'F', gen->started - G_USEC_PER_SEC);
+    gen->app_dir_index = _make_dir_index(gen->AppDirs);
+    gen->dir_dir_index = _make_dir_index(gen->DirDirs);
+    gen->n_dir_dirs = g_slist_length(gen->DirDirs);
+    /* The rest depends on language and on hidden entries so is done for each
+       output, composed layout is copied if it's needed for another one */
+    for (n = 0; n < gen->n_langs; n++)
+    {
+        STATS_START(gen, start);
+        menu = (gen->n_outputs > 1) ? _clone_menu(layout) : layout;
+        g_hash_table_iter_init(&iter, gen->all_apps);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&app))
+            _localize_app(gen, app, n);
+        _localize_menu(gen, menu, n);
+        STATS_STOP(gen, start, localize);
+        for (j = 0; j < gen->n_outputs; j++)
+        {
+            if (gen->output_lang[j] != n)
+                continue;
+            output = &gen->outputs[j];
+            with_hidden = (gen->with_hidden || output->with_hidden);
+            /* the last one for this language may use the tree itself */
+            for (i = j + 1; i < (int)gen->n_outputs; i++)
+                if (gen->output_lang[i] == n)
+                    break;
+            STATS_START(gen, start);
+            tree = (i < (int)gen->n_outputs) ? _clone_menu(menu) : menu;
+            g_hash_table_iter_init(&iter, gen->all_apps);
+            while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&app))
+                app->n_menus = app->n_composed;
+            /* Recursively remove non-matched files by OnlyUnallocated flag */
+            _stage2(gen, tree, with_hidden);
+            STATS_STOP(gen, start, stage2);
+            STATS_START(gen, start);
+            output->written = _write_cache_file(gen, tree, menuname, output->file,
+                                                stamps, with_hidden);
+            STATS_STOP(gen, start, write);
+            /* a failed file should not prevent writing the rest of them,
+               the caller checks each output */
+            if (!output->written)
+            {
+                if (ok)
+                    g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                                "cannot write cache file '%s'", output->file);
+                else if (error != NULL && *error != NULL)
+                {
+                    msg = (*error)->message;
+                    (*error)->message = g_strdup_printf("%s, '%s'", msg, output->file);
+                    g_free(msg);
+                }
+                ok = FALSE;
+            }
+            if (tree != menu)
+                menu_menu_free(tree);
+        }
+        if (menu != layout)
+            menu_menu_free(menu);
+    }
+    menu_menu_free(layout);
+    g_hash_table_destroy(gen->app_dir_index);
+    g_hash_table_destroy(gen->dir_dir_index);
+    gen->app_dir_index = gen->dir_dir_index = NULL;
+    g_string_free(stamps, TRUE);
+    /* Free all the data */
+    g_hash_table_destroy(gen->all_apps);
+    gen->all_apps = NULL;
+    _free_apps_index(gen);
+    g_hash_table_destroy(gen->dir_listings);
+    gen->dir_listings = NULL;
+    g_hash_table_destroy(gen->dir_files);
+    gen->dir_files = NULL;
+    g_hash_table_destroy(gen->category_ids);
+    gen->category_ids = NULL;
+    gen->n_categories = 0;
+    g_slist_free(gen->DEs);
+    gen->DEs = NULL;
+    g_slist_free(gen->loaded_dirs);
+    gen->loaded_dirs = NULL;
     return ok;
 }
@@ -0,0 +1,315 @@
+/*
+ *      menu-gen.c : creates cache file for a menu in given environment.
+ *
+ *      This file is a part of libmenu-cache package and created program
+ *      should be not used without the library.
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "menu-tags.h"
+#include "version.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+gint verbose = 0;
+
+static inline gboolean _env_is_set(const char *value)
+{
+    return (value != NULL && value[0] != '\0');
+}
+
+/* $XDG_*_HOME or its default in home dir */
+static char *_env_home(const char *value, const char *def)
+{
+    if (_env_is_set(value))
+        return g_strdup(value);
+    return g_build_filename(g_get_home_dir(), def, NULL);
+}
+
+/* $XDG_*_DIRS or its default */
+static char **_env_dirs(const char *value, const char *def)
+{
+    return g_strsplit(_env_is_set(value) ? value : def, G_SEARCHPATH_SEPARATOR_S, 0);
+}
+
+static void _add_locale(GPtrArray *locales, const char *locale)
+{
+    guint i;
+
+    for (i = 0; i < locales->len; i++)
+        if (strcmp(locales->pdata[i], locale) == 0)
+            return;
+    g_ptr_array_add(locales, g_strdup(locale));
+}
+
+/* languages to look for translations: requested ones and then variants of
+   the first one, as g_key_file_get_locale_string() does */
+static char **_make_locales(char **languages)
+{
+    GPtrArray *locales = g_ptr_array_new();
+    char **lang;
+#if GLIB_CHECK_VERSION(2, 28, 0)
+    char **variants;
+#endif
+
+    for (lang = languages; lang[0] != NULL; lang++)
+        g_ptr_array_add(locales, g_strdup(lang[0]));
+#if GLIB_CHECK_VERSION(2, 28, 0)
+    variants = g_get_locale_variants(languages[0]);
+    for (lang = variants; lang[0] != NULL; lang++)
+        _add_locale(locales, lang[0]);
+    g_strfreev(variants);
+#endif
+    g_ptr_array_add(locales, NULL);
+    return (char **)g_ptr_array_free(locales, FALSE);
+}
+
+/* sets locales for each of languages of outputs, returns description of
+   them for store */
+static char *_set_locales(MenuCacheGen *gen)
+{
+    GString *str = g_string_new("");
+    GPtrArray *all = NULL;
+    const char **langs = g_new(const char *, gen->n_outputs);
+    char **languages, **locale;
+    guint i, j;
+
+    /* outputs for the same language share translations */
+    gen->output_lang = g_new(guint, gen->n_outputs);
+    for (i = 0; i < gen->n_outputs; i++)
+    {
+        for (j = 0; j < gen->n_langs; j++)
+            if (g_strcmp0(langs[j], gen->outputs[i].lang) == 0)
+                break;
+        if (j == gen->n_langs)
+            langs[gen->n_langs++] = gen->outputs[i].lang;
+        gen->output_lang[i] = j;
+    }
+    if (gen->n_langs > 1)
+    {
+        gen->lang_locales = g_new0(char **, gen->n_langs);
+        all = g_ptr_array_new();
+    }
+    for (i = 0; i < gen->n_langs; i++)
+    {
+        /* if language is not set then query it from locale */
+        if (_env_is_set(langs[i]))
+            languages = g_strsplit(langs[i], ":", 0);
+        else
+            languages = g_strdupv((char **)g_get_language_names());
+        if (i > 0)
+            g_string_append_c(str, ';');
+        for (locale = languages; locale[0] != NULL; locale++)
+        {
+            if (locale != languages)
+                g_string_append_c(str, ':');
+            g_string_append(str, locale[0]);
+        }
+        if (all == NULL)
+            gen->locales = _make_locales(languages);
+        else
+        {
+            /* the parser keeps strings for all of them */
+            gen->lang_locales[i] = _make_locales(languages);
+            for (locale = gen->lang_locales[i]; locale[0] != NULL; locale++)
+                _add_locale(all, locale[0]);
+        }
+        g_strfreev(languages);
+    }
+    if (all != NULL)
+    {
+        g_ptr_array_add(all, NULL);
+        gen->locales = (char **)g_ptr_array_free(all, FALSE);
+    }
+    g_free(langs);
+    return g_string_free(str, FALSE);
+}
+
+void gen_stats_now(MenuCacheGenTime *now)
+{
+    struct timespec ts;
+
+    now->wall = g_get_monotonic_time();
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) == 0)
+        now->cpu = (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+    else
+        now->cpu = 0;
+}
+
+void gen_stats_add(MenuCacheGenTime *stage, const MenuCacheGenTime *start)
+{
+    MenuCacheGenTime now;
+
+    gen_stats_now(&now);
+    stage->wall += now.wall - start->wall;
+    stage->cpu += now.cpu - start->cpu;
+}
+
+static void _gen_free(MenuCacheGen *gen)
+{
+    guint i;
+
+    if (gen->lang_locales)
+        for (i = 0; i < gen->n_langs; i++)
+            g_strfreev(gen->lang_locales[i]);
+    g_free(gen->lang_locales);
+    g_free(gen->output_lang);
+    g_strfreev(gen->locales);
+    g_free(gen->user_config_dir);
+    g_strfreev(gen->system_config_dirs);
+    g_free(gen->user_data_dir);
+    g_strfreev(gen->system_data_dirs);
+    g_free(gen->merged_file);
+    g_slist_free(gen->MenuFiles);
+    g_slist_free(gen->MenuDirs);
+    g_slist_free(gen->AppDirs);
+    g_slist_free(gen->DirDirs);
+}
+
+gboolean menu_cache_gen_run(const char *menu, const char *file,
+                            const MenuCacheGenEnv *env, MenuCacheGenStore *store,
+                            GError **error)
+{
+    MenuCacheGenOutput output;
+
+    output.file = file;
+    output.lang = env->lang;
+    output.with_hidden = FALSE; /* it's defined by menu name */
+    return menu_cache_gen_run_multi(menu, &output, 1, env, store, NULL, error);
+}
+
+gboolean menu_cache_gen_run_multi(const char *menu, MenuCacheGenOutput *outputs,
+                                  guint n_outputs, const MenuCacheGenEnv *env,
+                                  MenuCacheGenStore *store, MenuCacheGenStats *stats,
+                                  GError **error)
+{
+    MenuCacheGen gen;
+    FmXmlFile *xmlfile = NULL;
+    MenuMenu *layout;
+    MenuCacheGenStore *own_store = NULL;
+    /* the first output may change between runs so caller may give stable name */
+    const char *file = _env_is_set(env->data_file) ? env->data_file : outputs[0].file;
+    char *ifile, *entries_file, *lang;
+    int major;
+    guint i;
+    gboolean ok = FALSE, written = FALSE;
+
+    for (i = 0; i < n_outputs; i++)
+        outputs[i].written = FALSE;
+    memset(&gen, 0, sizeof(gen));
+    gen.started = g_get_real_time(); /* for stat signatures */
+    gen.req_version = 1; /* old compatibility default */
+    if (_env_is_set(env->gen_version) &&
+        sscanf(env->gen_version, "%d.%u", &major, &gen.req_version) == 2 &&
+        major != VER_MAJOR)
+        gen.req_version = 0; /* unsupported format requested */
+    if (gen.req_version < VER_MINOR_SUPPORTED)
+    {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                    "unsupported cache format '%s' requested", env->gen_version);
+        return FALSE;
+    }
+    if (gen.req_version > VER_MINOR) /* fallback to maximal supported format */
+        gen.req_version = VER_MINOR;
+    gen.stats = stats;
+    gen.outputs = outputs;
+    gen.n_outputs = n_outputs;
+    lang = _set_locales(&gen);
+    gen.user_config_dir = _env_home(env->config_home, ".config");
+    gen.system_config_dirs = _env_dirs(env->config_dirs, "/etc/xdg");
+    gen.user_data_dir = _env_home(env->data_home, ".local/share");
+    gen.system_data_dirs = _env_dirs(env->data_dirs, "/usr/local/share/:/usr/share/");
+    /* parsed entries are saved next to the cache file */
+    if (store == NULL)
+        store = own_store = menu_cache_gen_store_new();
+    gen.store = store;
+    if (g_file_test(file, G_FILE_TEST_EXISTS) &&
+        !g_file_test(file, G_FILE_TEST_IS_REGULAR))
+        entries_file = NULL; /* such as /dev/null */
+    else
+    {
+        entries_file = g_strconcat(file, ".entries", NULL);
+        gen.merged_file = g_strconcat(file, ".merged", NULL);
+    }
+    menu_cache_gen_store_begin(store, lang, entries_file);
+    g_free(lang);
+
+    ifile = g_strdup(menu);
+    gen.with_hidden = g_str_has_suffix(ifile, "+hidden");
+    if (gen.with_hidden)
+        ifile[strlen(ifile)-7] = '\0';
+    if (G_LIKELY(!g_path_is_absolute(ifile)))
+    {
+        /* resolv the path */
+        char *path;
+        gboolean found;
+        char **dirs = gen.system_config_dirs;
+
+        if (_env_is_set(env->menu_prefix))
+        {
+            path = g_strconcat(env->menu_prefix, ifile, NULL);
+            g_free(ifile);
+            ifile = path;
+        }
+        path = g_build_filename(gen.user_config_dir, "menus", ifile, NULL);
+        found = g_file_test(path, G_FILE_TEST_IS_REGULAR);
+        while (!found && dirs[0] != NULL)
+        {
+            gen.MenuFiles = g_slist_append(gen.MenuFiles, (gpointer)g_intern_string(path));
+            g_free(path);
+            path = g_build_filename(dirs[0], "menus", ifile, NULL);
+            found = g_file_test(path, G_FILE_TEST_IS_REGULAR);
+            dirs++;
+        }
+        if (!found)
+        {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOENT,
+                        "cannot find file '%s'", ifile);
+            g_free(path);
+            goto _return;
+        }
+        g_free(ifile);
+        ifile = path;
+    }
+    gen.MenuFiles = g_slist_append(gen.MenuFiles, (gpointer)g_intern_string(ifile));
+
+    /* load, merge menu file, and create menu */
+    layout = get_merged_menu(&gen, ifile, &xmlfile, error);
+    if (layout == NULL)
+        goto _return;
+
+    /* save the layout */
+    ok = save_menu_cache(&gen, layout, ifile, error);
+    if (xmlfile != NULL)
+        g_object_unref(xmlfile);
+    /* entries are good if at least one cache was made from them */
+    for (i = 0; i < n_outputs; i++)
+        written |= outputs[i].written;
+_return:
+    menu_cache_gen_store_end(store, written ? entries_file : NULL);
+    if (own_store)
+        menu_cache_gen_store_free(own_store);
+    g_free(entries_file);
+    g_free(ifile);
+    _gen_free(&gen);
+    return ok;
+}
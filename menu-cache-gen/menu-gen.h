@@ -0,0 +1,109 @@
+/*
+ *      menu-gen.h : interface of the menu cache generator.
+ *
+ *      This file is a part of libmenu-cache package and is used by both
+ *      menu-cache-gen and menu-cached to create cache files.
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __MENU_CACHE_GEN_H__
+#define __MENU_CACHE_GEN_H__
+
+#include <glib.h>
+
+/* Environment of a single cache generation. The generator never looks into
+   the process environment so each generation may use its own one. NULL or
+   empty value means the default from XDG Base Directory specification. */
+typedef struct {
+    const char *lang; /* colon separated list, NULL to use current locale */
+    const char *menu_prefix; /* XDG_MENU_PREFIX */
+    const char *config_home; /* XDG_CONFIG_HOME */
+    const char *config_dirs; /* XDG_CONFIG_DIRS */
+    const char *data_home; /* XDG_DATA_HOME */
+    const char *data_dirs; /* XDG_DATA_DIRS */
+    const char *gen_version; /* CACHE_GEN_VERSION, requested format "1.x" */
+    const char *data_file; /* base of .entries and .merged file names, NULL
+                              to keep them next to the first cache file */
+} MenuCacheGenEnv;
+
+/* Parsed desktop entries which may be reused by the next generation.
+   Entries are matched by stat signature of the file and also saved into
+   the file with ".entries" suffix next to the cache file. The owner may
+   invalidate each file or dir reported changed, that may be done from
+   another thread while generation is running. */
+typedef struct _MenuCacheGenStore MenuCacheGenStore;
+
+MenuCacheGenStore *menu_cache_gen_store_new(void);
+void menu_cache_gen_store_free(MenuCacheGenStore *store);
+void menu_cache_gen_store_invalidate(MenuCacheGenStore *store, const char *path);
+
+/* creates cache file @file for menu @menu which is either an absolute path
+   or a file name to find in config dirs, optionally with "+hidden" suffix;
+   @store may be NULL to use saved entries only; it can be called from any
+   thread, and calls may run concurrently as long as each one uses its own
+   @store and output file; the merged menu tree is saved into the file with
+   ".merged" suffix next to the cache file and reused while no menu file is
+   changed */
+gboolean menu_cache_gen_run(const char *menu, const char *file,
+                            const MenuCacheGenEnv *env, MenuCacheGenStore *store,
+                            GError **error);
+
+/* one of caches created by menu_cache_gen_run_multi() */
+typedef struct {
+    const char *file;
+    const char *lang; /* instead of MenuCacheGenEnv::lang */
+    gboolean with_hidden; /* the same as "+hidden" suffix of menu */
+    gboolean written; /* set by the generator if the file was written */
+} MenuCacheGenOutput;
+
+/* time spent in a stage of generation, in microseconds */
+typedef struct {
+    gint64 wall;
+    gint64 cpu; /* of the whole process, including parser threads */
+} MenuCacheGenTime;
+
+/* report about a generation, times and counters are added to ones which
+   are already in it */
+typedef struct {
+    MenuCacheGenTime load; /* reading and parsing of the menu file */
+    MenuCacheGenTime merge; /* merging other menu files into it */
+    MenuCacheGenTime stage1; /* scanning dirs, parsing and matching entries */
+    MenuCacheGenTime localize; /* translating entries and menus for each language */
+    MenuCacheGenTime stage2; /* applying layout for each of outputs */
+    MenuCacheGenTime write; /* writing cache files */
+    guint dirs_scanned;
+    guint files_stated; /* desktop entry files checked for changes */
+    guint files_parsed; /* desktop entry and menu files */
+    guint rules_evaluated; /* matches of an entry to <Include> or <Exclude> */
+    guint apps_allocated; /* entries which were put into some menu */
+    guint64 bytes_written;
+} MenuCacheGenStats;
+
+/* does the same as menu_cache_gen_run() for each of @outputs; all the work
+   which doesn't depend on language or hidden entries is done only once,
+   entries are saved by @env->data_file or next to the first file; @stats
+   may be NULL; if some file cannot be written then others are still
+   written, FALSE is returned and MenuCacheGenOutput::written tells which
+   ones succeeded */
+gboolean menu_cache_gen_run_multi(const char *menu, MenuCacheGenOutput *outputs,
+                                  guint n_outputs, const MenuCacheGenEnv *env,
+                                  MenuCacheGenStore *store, MenuCacheGenStats *stats,
+                                  GError **error);
+
+/* verbosity level */
+extern gint verbose;
+
+#endif /* __MENU_CACHE_GEN_H__ */
@@ -26,6 +26,7 @@
 #endif
 
 #include "menu-tags.h"
+#include "file-stamp.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -38,6 +39,7 @@ typedef struct _MenuTreeData MenuTreeData;
 
 struct _MenuTreeData
 {
+    MenuCacheGen *gen; /* generation context */
     FmXmlFile *menu; /* composite tree to analyze */
     const char *file_path; /* current file */
     gint line, pos; /* we remember position in deepest file */
@@ -75,19 +77,6 @@ FmXmlFileTag menuTag_DefaultLayout = 0;
 FmXmlFileTag menuTag_Menuname = 0;
 FmXmlFileTag menuTag_Separator = 0;
 FmXmlFileTag menuTag_Merge = 0;
-
-/* list of available app dirs */
-GSList *AppDirs = NULL;
-
-/* list of available dir dirs */
-GSList *DirDirs = NULL;
-
-/* list of menu dirs to monitor */
-GSList *MenuDirs = NULL;
-
-/* we keep all the unfinished items in the hash */
-static GHashTable *layout_hash = NULL;
-
 #define RETURN_TRUE_AND_DESTROY_IF_QUIET(a) do { \
     if (verbose == 0) { \
         fm_xml_file_item_destroy(a); \
@@ -180,27 +169,28 @@ static gboolean _menu_xml_handler_Not(FmXmlFileItem *item, GList *children,
     return TRUE;
 }
 
-static void _add_app_dir(const char *app_dir)
+static void _add_app_dir(MenuCacheGen *gen, const char *app_dir)
 {
     const char *str = g_intern_string(app_dir);
     GSList *l;
     GDir *dir;
     char *path;
 
-    for (l = AppDirs; l; l = l->next)
+    for (l = gen->AppDirs; l; l = l->next)
         if (l->data == str)
             break;
     if (l == NULL)
-        AppDirs = g_slist_append(AppDirs, (gpointer)str);
+        gen->AppDirs = g_slist_append(gen->AppDirs, (gpointer)str);
     /* recursively scan the directory now */
     dir = g_dir_open(app_dir, 0, NULL);
     if (dir)
     {
+        STATS_INC(gen, dirs_scanned);
         while ((str = g_dir_read_name(dir)) != NULL) /* reuse pointer */
         {
             path = g_build_filename(app_dir, str, NULL);
             if (g_file_test(path, G_FILE_TEST_IS_DIR))
-                _add_app_dir(path);
+                _add_app_dir(gen, path);
             g_free(path);
         }
         g_dir_close(dir);
@@ -246,7 +236,7 @@ static gboolean _menu_xml_handler_AppDir(FmXmlFileItem *item, GList *children,
         fm_xml_file_item_destroy(name);
         fm_xml_file_item_append_text(item, _path, -1, FALSE);
     }
-    _add_app_dir(path);
+    _add_app_dir(data->gen, path);
     g_free(_path);
     /* contents of the directory will be parsed later */
     return TRUE;
@@ -258,8 +248,8 @@ static gboolean _menu_xml_handler_DefaultAppDirs(FmXmlFileItem *item, GList *chi
                                                  guint n_attributes, gint line, gint pos,
                                                  GError **error, gpointer user_data)
 {
+    MenuTreeData *data = user_data;
     FmXmlFileItem *parent;
-    static gboolean added = FALSE;
 
     parent = fm_xml_file_item_get_parent(item);
     if (parent == NULL || fm_xml_file_item_get_tag(parent) != menuTag_Menu)
@@ -269,33 +259,33 @@ static gboolean _menu_xml_handler_DefaultAppDirs(FmXmlFileItem *item, GList *chi
                             _("Tag <DefaultAppDirs> can appear only below <Menu>"));
         return FALSE;
     }
-    if (!added)
+    if (!data->gen->default_app_dirs_added)
     {
-        const gchar* const * dirs = g_get_system_data_dirs();
-        char *dir = g_build_filename(g_get_user_data_dir(), "applications", NULL);
-        _add_app_dir(dir);
+        char **dirs = data->gen->system_data_dirs;
+        char *dir = g_build_filename(data->gen->user_data_dir, "applications", NULL);
+        _add_app_dir(data->gen, dir);
         g_free(dir);
         if (dirs) while (dirs[0] != NULL)
         {
             dir = g_build_filename(*dirs++, "applications", NULL);
-            _add_app_dir(dir);
+            _add_app_dir(data->gen, dir);
             g_free(dir);
         }
-        added = TRUE;
+        data->gen->default_app_dirs_added = TRUE;
     }
     /* contents of the directories will be parsed later */
     return TRUE;
 }
 
-static void _add_dir_dir(const char *dir_dir)
+static void _add_dir_dir(MenuCacheGen *gen, const char *dir_dir)
 {
     const char *str = g_intern_string(dir_dir);
     GSList *l;
 
-    for (l = DirDirs; l; l = l->next)
+    for (l = gen->DirDirs; l; l = l->next)
         if (l->data == str)
             return;
-    DirDirs = g_slist_append(DirDirs, (gpointer)str);
+    gen->DirDirs = g_slist_append(gen->DirDirs, (gpointer)str);
 }
 
 static gboolean _menu_xml_handler_DirectoryDir(FmXmlFileItem *item, GList *children,
@@ -326,7 +316,7 @@ static gboolean _menu_xml_handler_DirectoryDir(FmXmlFileItem *item, GList *child
         return FALSE;
     }
     if (g_path_is_absolute(path))
-        _add_dir_dir(path);
+        _add_dir_dir(data->gen, path);
     else
     {
         char *_dir = g_path_get_dirname(data->file_path);
@@ -335,7 +325,7 @@ static gboolean _menu_xml_handler_DirectoryDir(FmXmlFileItem *item, GList *child
         g_free(_dir);
         fm_xml_file_item_destroy(name);
         fm_xml_file_item_append_text(item, _path, -1, FALSE);
-        _add_dir_dir(_path);
+        _add_dir_dir(data->gen, _path);
         g_free(_path);
     }
     /* contents of the directory will be parsed later */
@@ -348,8 +338,8 @@ static gboolean _menu_xml_handler_DefaultDirectoryDirs(FmXmlFileItem *item, GLis
                                                        guint n_attributes, gint line, gint pos,
                                                        GError **error, gpointer user_data)
 {
+    MenuTreeData *data = user_data;
     FmXmlFileItem *parent;
-    static gboolean added = FALSE;
 
     parent = fm_xml_file_item_get_parent(item);
     if (parent == NULL || fm_xml_file_item_get_tag(parent) != menuTag_Menu)
@@ -359,19 +349,19 @@ static gboolean _menu_xml_handler_DefaultDirectoryDirs(FmXmlFileItem *item, GLis
                             _("Tag <DefaultDirectoryDirs> can appear only below <Menu>"));
         return FALSE;
     }
-    if (!added)
+    if (!data->gen->default_dir_dirs_added)
     {
-        const gchar* const * dirs = g_get_system_data_dirs();
-        char *dir = g_build_filename(g_get_user_data_dir(), "desktop-directories", NULL);
-        _add_dir_dir(dir);
+        char **dirs = data->gen->system_data_dirs;
+        char *dir = g_build_filename(data->gen->user_data_dir, "desktop-directories", NULL);
+        _add_dir_dir(data->gen, dir);
         g_free(dir);
         if (dirs) while (dirs[0] != NULL)
         {
             dir = g_build_filename(*dirs++, "desktop-directories", NULL);
-            _add_dir_dir(dir);
+            _add_dir_dir(data->gen, dir);
             g_free(dir);
         }
-        added = TRUE;
+        data->gen->default_dir_dirs_added = TRUE;
     }
     /* contents of the directories will be parsed later */
     return TRUE;
@@ -411,8 +401,8 @@ static gboolean _menu_xml_handler_MergeFile(FmXmlFileItem *item, GList *children
         {
             if (strcmp(attribute_values[0], "parent") == 0)
             {
-                const gchar* const *dirs = g_get_system_config_dirs();
-                const gchar* const *dir;
+                char **dirs = data->gen->system_config_dirs;
+                char **dir;
                 const char *rel_path;
                 char *file;
 
@@ -424,9 +414,9 @@ static gboolean _menu_xml_handler_MergeFile(FmXmlFileItem *item, GList *children
                         goto replace_from_system_config_dirs;
                     }
                 /* not found in XDG_CONFIG_DIRS, test for XDG_CONFIG_HOME */
-                if (g_str_has_prefix(data->file_path, g_get_user_config_dir()))
+                if (g_str_has_prefix(data->file_path, data->gen->user_config_dir))
                 {
-                    rel_path = data->file_path + strlen(g_get_user_config_dir());
+                    rel_path = data->file_path + strlen(data->gen->user_config_dir);
 replace_from_system_config_dirs:
                     fm_xml_file_item_destroy(name);
                     while (*rel_path == G_DIR_SEPARATOR) rel_path++;
@@ -585,9 +575,9 @@ static gboolean _menu_xml_handler_LegacyDir(FmXmlFileItem *item, GList *children
     return TRUE;
 }
 
-static MenuLayout *_find_layout(FmXmlFileItem *item, gboolean create)
+static MenuLayout *_find_layout(MenuCacheGen *gen, FmXmlFileItem *item, gboolean create)
 {
-    MenuLayout *layout = g_hash_table_lookup(layout_hash, item);
+    MenuLayout *layout = g_hash_table_lookup(gen->layout_hash, item);
 
     if (layout == NULL && create)
     {
@@ -595,7 +585,7 @@ static MenuLayout *_find_layout(FmXmlFileItem *item, gboolean create)
         /* set defaults */
         layout->inline_header = TRUE;
         layout->inline_limit = 4;
-        g_hash_table_insert(layout_hash, item, layout);
+        g_hash_table_insert(gen->layout_hash, item, layout);
     }
     return layout;
 }
@@ -606,6 +596,7 @@ static gboolean _menu_xml_handler_Filename(FmXmlFileItem *item, GList *children,
                                            guint n_attributes, gint line, gint pos,
                                            GError **error, gpointer user_data)
 {
+    MenuTreeData *data = user_data;
     FmXmlFileItem *parent;
     const char *id;
     MenuLayout *layout;
@@ -626,7 +617,7 @@ static gboolean _menu_xml_handler_Filename(FmXmlFileItem *item, GList *children,
         tag = fm_xml_file_item_get_tag(parent);
     if (tag == menuTag_Layout || tag == menuTag_DefaultLayout)
     {
-        layout = _find_layout(parent, TRUE);
+        layout = _find_layout(data->gen, parent, TRUE);
         app = g_slice_new0(MenuFilename);
         app->type = MENU_CACHE_TYPE_APP;
         app->id = g_strdup(id);
@@ -641,6 +632,7 @@ static gboolean _menu_xml_handler_Menuname(FmXmlFileItem *item, GList *children,
                                            guint n_attributes, gint line, gint pos,
                                            GError **error, gpointer user_data)
 {
+    MenuTreeData *data = user_data;
     FmXmlFileItem *parent;
     const char *name;
     MenuLayout *layout;
@@ -667,7 +659,7 @@ static gboolean _menu_xml_handler_Menuname(FmXmlFileItem *item, GList *children,
                               " <DefaultLayout>"));
         return FALSE;
     }
-    layout = _find_layout(parent, TRUE);
+    layout = _find_layout(data->gen, parent, TRUE);
     menu = g_slice_new0(MenuMenuname);
     menu->layout.type = MENU_CACHE_TYPE_DIR;
     menu->name = g_strdup(name);
@@ -715,6 +707,7 @@ static gboolean _menu_xml_handler_Separator(FmXmlFileItem *item, GList *children
                                             guint n_attributes, gint line, gint pos,
                                             GError **error, gpointer user_data)
 {
+    MenuTreeData *data = user_data;
     FmXmlFileItem *parent;
     MenuLayout *layout;
     MenuSep *sep;
@@ -731,7 +724,7 @@ static gboolean _menu_xml_handler_Separator(FmXmlFileItem *item, GList *children
                               " <DefaultLayout>"));
         return FALSE;
     }
-    layout = _find_layout(parent, TRUE);
+    layout = _find_layout(data->gen, parent, TRUE);
     sep = g_slice_new0(MenuSep);
     sep->type = MENU_CACHE_TYPE_SEP;
     layout->items = g_list_append(layout->items, sep);
@@ -744,6 +737,7 @@ static gboolean _menu_xml_handler_Merge(FmXmlFileItem *item, GList *children,
                                         guint n_attributes, gint line, gint pos,
                                         GError **error, gpointer user_data)
 {
+    MenuTreeData *data = user_data;
     FmXmlFileItem *parent;
     MenuLayout *layout;
     MenuMerge *mm;
@@ -784,7 +778,7 @@ static gboolean _menu_xml_handler_Merge(FmXmlFileItem *item, GList *children,
                               " \"menus\", \"files\", or \"all\""));
         return FALSE;
     }
-    layout = _find_layout(parent, TRUE);
+    layout = _find_layout(data->gen, parent, TRUE);
     mm = g_slice_new0(MenuMerge);
     mm->type = MENU_CACHE_TYPE_NONE;
     mm->merge_type = type;
@@ -808,9 +802,10 @@ static gboolean _menu_xml_handler_DefaultLayout(FmXmlFileItem *item, GList *chil
                                                 guint n_attributes, gint line, gint pos,
                                                 GError **error, gpointer user_data)
 {
+    MenuTreeData *data = user_data;
     MenuLayout *layout;
 
-    layout = _find_layout(item, TRUE);
+    layout = _find_layout(data->gen, item, TRUE);
     if (attribute_names) while (attribute_names[0])
     {
         if (strcmp(attribute_names[0], "show_empty") == 0)
@@ -855,8 +850,8 @@ static gboolean _merge_xml_file(MenuTreeData *data, FmXmlFileItem *item,
         return TRUE;
     }
     *m = g_list_prepend(it, (gpointer)path);
-    if (add_to_list && g_slist_find(MenuFiles, path) == NULL)
-        MenuFiles = g_slist_append(MenuFiles, (gpointer)path);
+    if (add_to_list && g_slist_find(data->gen->MenuFiles, path) == NULL)
+        data->gen->MenuFiles = g_slist_append(data->gen->MenuFiles, (gpointer)path);
     save_path = data->file_path;
     data->file_path = path;
     DBG("merging the XML file '%s'", data->file_path);
@@ -869,6 +864,7 @@ static gboolean _merge_xml_file(MenuTreeData *data, FmXmlFileItem *item,
         return FALSE;
     }
     menu = fm_xml_file_new(data->menu);
+    STATS_INC(data->gen, files_parsed);
     /* g_debug("merging FmXmlFile %p into %p", menu, data->menu); */
     ok = fm_xml_file_parse_data(menu, contents, len, error, data);
     g_free(contents);
@@ -954,11 +950,12 @@ static gboolean _merge_menu_directory(MenuTreeData *data, FmXmlFileItem *item,
 
     DBG("merging the XML directory '%s'", path);
     path = g_intern_string(path);
-    if (g_slist_find(MenuDirs, path) == NULL)
-        MenuDirs = g_slist_append(MenuDirs, (gpointer)path);
+    if (g_slist_find(data->gen->MenuDirs, path) == NULL)
+        data->gen->MenuDirs = g_slist_append(data->gen->MenuDirs, (gpointer)path);
     dir = g_dir_open(path, 0, &err);
     if (dir)
     {
+        STATS_INC(data->gen, dirs_scanned);
         while ((name = g_dir_read_name(dir)))
         {
             if (strlen(name) <= 5 || !g_str_has_suffix(name, ".menu"))
@@ -1026,49 +1023,112 @@ static inline const char *_get_menu_name(FmXmlFileItem *item)
 /* NOTE: it will not delete duplicate elements other than Menu or Name */
 static void _merge_level(GList *first)
 {
-    while (first)
+    /* name -> first Menu with it, name is owned by that Menu */
+    GHashTable *menus = g_hash_table_new(g_str_hash, g_str_equal);
+    FmXmlFileItem *item;
+    const char *name;
+
+    for (; first; first = g_list_delete_link(first, first))
     {
-        if (first->data) /* we might merge this one already */
+        name = _get_menu_name(first->data);
+        if (name == NULL) /* not a menu tag */
+            continue;
+        item = g_hash_table_lookup(menus, name);
+        if (item == NULL)
+            g_hash_table_insert(menus, (gpointer)name, first->data);
+        else
         {
-            GList *next;
-
-            if (first->next)
-            {
-                /* merge this item with identical ones */
-                const char *name = _get_menu_name(first->data);
-
-                if (name) /* not a menu tag */
-                {
-                    for (next = first->next; next; next = next->next)
-                    {
-                        if (next->data == NULL) /* already merged */
-                            continue;
-                        if (g_strcmp0(name, _get_menu_name(next->data)) == 0)
-                        {
-                            GList *children = fm_xml_file_item_get_children(next->data);
-                            GList *l;
-
-                            DBG("found two identical Menu '%s', merge them", name);
-                            for (l = children; l; l = l->next) /* merge all but Name */
-                                if (fm_xml_file_item_get_tag(l->data) != menuTag_Name)
-                                    fm_xml_file_item_append_child(first->data, l->data);
-                            g_list_free(children);
-                            fm_xml_file_item_destroy(next->data);
-                            next->data = NULL; /* we merged it so no data */
-                        }
-                    }
-                }
-            }
+            /* merge this item into the first identical one */
+            GList *children = fm_xml_file_item_get_children(first->data);
+            GList *l;
+
+            DBG("found two identical Menu '%s', merge them", name);
+            for (l = children; l; l = l->next) /* merge all but Name */
+                if (fm_xml_file_item_get_tag(l->data) != menuTag_Name)
+                    fm_xml_file_item_append_child(item, l->data);
+            g_list_free(children);
+            fm_xml_file_item_destroy(first->data);
         }
-        /* go to next item */
-        first = g_list_delete_link(first, first);
     }
+    g_hash_table_destroy(menus);
 }
 
-static FmXmlFileItem *_walk_path(GList *child, const char *path,
+/* Menu children of an item indexed by name for path walks, only first one
+   of the same name can be found */
+typedef struct {
+    GHashTable *names; /* name -> Menu item */
+    gboolean has_dups; /* there are few children with the same name */
+} MenuLevel;
+
+static void _free_menu_level(gpointer data)
+{
+    MenuLevel *level = data;
+
+    g_hash_table_destroy(level->names);
+    g_slice_free(MenuLevel, level);
+}
+
+static void _menu_level_insert(MenuLevel *level, FmXmlFileItem *item)
+{
+    const char *name = _get_menu_name(item);
+
+    if (name == NULL)
+        return;
+    if (g_hash_table_lookup(level->names, name) != NULL)
+        level->has_dups = TRUE;
+    else
+        g_hash_table_insert(level->names, (gpointer)name, item);
+}
+
+/* returns index of children of @parent, creates it if it's not in @levels */
+static MenuLevel *_get_menu_level(GHashTable *levels, FmXmlFileItem *parent)
+{
+    MenuLevel *level = g_hash_table_lookup(levels, parent);
+    GList *children, *l;
+
+    if (level != NULL)
+        return level;
+    level = g_slice_new(MenuLevel);
+    level->names = g_hash_table_new(g_str_hash, g_str_equal);
+    level->has_dups = FALSE;
+    children = fm_xml_file_item_get_children(parent);
+    for (l = children; l; l = l->next)
+        _menu_level_insert(level, l->data);
+    g_list_free(children);
+    g_hash_table_insert(levels, parent, level);
+    return level;
+}
+
+/* updates index after @item was appended to @parent */
+static void _menu_level_add(GHashTable *levels, FmXmlFileItem *parent,
+                            FmXmlFileItem *item)
+{
+    MenuLevel *level = g_hash_table_lookup(levels, parent);
+
+    if (level != NULL)
+        _menu_level_insert(level, item);
+}
+
+/* updates index before @item is destroyed */
+static void _menu_level_remove(GHashTable *levels, FmXmlFileItem *item)
+{
+    FmXmlFileItem *parent = fm_xml_file_item_get_parent(item);
+    MenuLevel *level;
+    const char *name;
+
+    g_hash_table_remove(levels, item);
+    if (parent == NULL || (level = g_hash_table_lookup(levels, parent)) == NULL)
+        return;
+    if (level->has_dups) /* next one of the same name should be found now */
+        g_hash_table_remove(levels, parent);
+    else if ((name = _get_menu_name(item)) != NULL)
+        g_hash_table_remove(level->names, name);
+}
+
+static FmXmlFileItem *_walk_path(GHashTable *levels, const char *path,
                                  FmXmlFileItem *parent, gboolean create)
 {
-    FmXmlFileItem *item = NULL;
+    FmXmlFileItem *item;
     char *subpath = strchr(path, '/');
 
     if (subpath)
@@ -1077,22 +1137,11 @@ static FmXmlFileItem *_walk_path(GList *child, const char *path,
         subpath = g_strndup(path, subpath - path);
         path = next;
     }
-    for (; child != NULL; child = child->next)
-    {
-        item = child->data;
-        if (item == NULL)
-            continue;
-        if (g_strcmp0(subpath ? subpath : path, _get_menu_name(item)) == 0)
-            break;
-        item = NULL;
-    }
+    item = g_hash_table_lookup(_get_menu_level(levels, parent)->names,
+                               subpath ? subpath : path);
     g_free(subpath); /* free but still use as marker */
     if (subpath != NULL && item != NULL)
-    {
-        child = fm_xml_file_item_get_children(item);
-        item = _walk_path(child, path, item, create);
-        g_list_free(child);
-    }
+        item = _walk_path(levels, path, item, create);
     else if (subpath == NULL && item == NULL && create)
     {
         /* create new <Menu><Name>path</Name></Menu> and append it to parent */
@@ -1101,15 +1150,17 @@ static FmXmlFileItem *_walk_path(GList *child, const char *path,
             fm_xml_file_item_destroy(item); /* FIXME: is it possible? */
         else
         {
-            parent = fm_xml_file_item_new(menuTag_Name); /* reuse pointer */
-            fm_xml_file_item_append_text(parent, path, -1, FALSE);
-            fm_xml_file_item_append_child(item, parent);
+            FmXmlFileItem *name = fm_xml_file_item_new(menuTag_Name);
+
+            fm_xml_file_item_append_text(name, path, -1, FALSE);
+            fm_xml_file_item_append_child(item, name);
+            _menu_level_add(levels, parent, item);
         }
     }
     return item;
 }
 
-static FmXmlFileItem *_walk_children(GList *children, FmXmlFileItem *list,
+static FmXmlFileItem *_walk_children(GHashTable *levels, FmXmlFileItem *list,
                                      FmXmlFileTag tag, gboolean create)
 {
     GList *sub, *l;
@@ -1128,13 +1179,14 @@ static FmXmlFileItem *_walk_children(GList *children, FmXmlFileItem *list,
     list = fm_xml_file_item_get_parent(list); /* it contains parent of <Move> now */
     if (item == NULL) /* empty tag, assume we are here */
         return list;
-    return _walk_path(children, fm_xml_file_item_get_data(item, NULL), list, create);
+    return _walk_path(levels, fm_xml_file_item_get_data(item, NULL), list, create);
 }
 
 static gboolean _activate_merges(MenuTreeData *data, FmXmlFileItem *item,
                                  GError **error)
 {
     GList *children, *l, *l2, *merged = NULL;
+    GHashTable *levels;
     const char *path, *path2;
     FmXmlFileItem *sub;
     FmXmlFileTag tag;
@@ -1150,10 +1202,10 @@ restart:
     }
     if (sub != NULL)
     {
-        const gchar * const *dirs = g_get_system_config_dirs();
+        char **dirs = data->gen->system_config_dirs;
         char *merged;
         FmXmlFileItem *it_sub;
-        int i = g_strv_length((char **)dirs);
+        int i = g_strv_length(dirs);
 
         /* insert in reverse order - see XDG menu specification */
         while (i > 0)
@@ -1171,7 +1223,7 @@ restart:
             }
             g_free(merged);
         }
-        merged = g_build_filename(g_get_user_config_dir(), "menus", "applications-merged", NULL);
+        merged = g_build_filename(data->gen->user_config_dir, "menus", "applications-merged", NULL);
         it_sub = fm_xml_file_item_new(menuTag_MergeDir);
         fm_xml_file_item_append_text(it_sub, merged, -1, FALSE);
         if (!fm_xml_file_insert_before(sub, it_sub) && verbose > 0)
@@ -1258,10 +1310,10 @@ restart:
     }
     if (sub != NULL)
     {
-        const gchar * const *dirs = g_get_system_data_dirs();
+        char **dirs = data->gen->system_data_dirs;
         char *merged;
         FmXmlFileItem *it_sub;
-        int i = g_strv_length((char **)dirs);
+        int i = g_strv_length(dirs);
 
         /* insert in reverse order - see XDG menu specification */
         while (i > 0)
@@ -1279,7 +1331,7 @@ restart:
             }
             g_free(merged);
         }
-        merged = g_build_filename(g_get_user_data_dir(), "applications", NULL);
+        merged = g_build_filename(data->gen->user_data_dir, "applications", NULL);
         it_sub = fm_xml_file_item_new(menuTag_AppDir);
         fm_xml_file_item_append_text(it_sub, merged, -1, FALSE);
         if (!fm_xml_file_insert_before(sub, it_sub) && verbose > 0)
@@ -1324,10 +1376,10 @@ restart:
     }
     if (sub != NULL)
     {
-        const gchar * const *dirs = g_get_system_data_dirs();
+        char **dirs = data->gen->system_data_dirs;
         char *merged;
         FmXmlFileItem *it_sub;
-        int i = g_strv_length((char **)dirs);
+        int i = g_strv_length(dirs);
 
         /* insert in reverse order - see XDG menu specification */
         while (i > 0)
@@ -1335,6 +1387,7 @@ restart:
             merged = g_build_filename(dirs[--i], "applnk", NULL);
             it_sub = fm_xml_file_item_new(menuTag_LegacyDir);
             fm_xml_file_item_set_comment(it_sub, "kde-");
+            fm_xml_file_item_set_attribute(it_sub, "prefix", "kde-");
             fm_xml_file_item_append_text(it_sub, merged, -1, FALSE);
             if (!fm_xml_file_insert_before(sub, it_sub) && verbose > 0)
             {
@@ -1346,9 +1399,10 @@ restart:
             }
             g_free(merged);
         }
-        merged = g_build_filename(g_get_user_data_dir(), "applnk", NULL);
+        merged = g_build_filename(data->gen->user_data_dir, "applnk", NULL);
         it_sub = fm_xml_file_item_new(menuTag_LegacyDir);
         fm_xml_file_item_set_comment(it_sub, "kde-");
+        fm_xml_file_item_set_attribute(it_sub, "prefix", "kde-");
         fm_xml_file_item_append_text(it_sub, merged, -1, FALSE);
         if (!fm_xml_file_insert_before(sub, it_sub) && verbose > 0)
         {
@@ -1393,10 +1447,10 @@ restart:
     }
     if (sub != NULL)
     {
-        const gchar * const *dirs = g_get_system_data_dirs();
+        char **dirs = data->gen->system_data_dirs;
         char *merged;
         FmXmlFileItem *it_sub;
-        int i = g_strv_length((char **)dirs);
+        int i = g_strv_length(dirs);
 
         /* insert in reverse order - see XDG menu specification */
         while (i > 0)
@@ -1414,7 +1468,7 @@ restart:
             }
             g_free(merged);
         }
-        merged = g_build_filename(g_get_user_data_dir(), "desktop-directories", NULL);
+        merged = g_build_filename(data->gen->user_data_dir, "desktop-directories", NULL);
         it_sub = fm_xml_file_item_new(menuTag_DirectoryDir);
         fm_xml_file_item_append_text(it_sub, merged, -1, FALSE);
         if (!fm_xml_file_insert_before(sub, it_sub) && verbose > 0)
@@ -1450,14 +1504,16 @@ restart:
         l->data = NULL;
     }
     /* support <Move><New>...</New><Old>...</Old></Move> for menus */
+    levels = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                   _free_menu_level);
     for (l = children; l; l = l2)
     {
         l2 = l->next;
         sub = l->data;
         if (sub && fm_xml_file_item_get_tag(sub) == menuTag_Move)
         {
-            FmXmlFileItem *old = _walk_children(children, sub, menuTag_Old, FALSE);
-            sub = _walk_children(children, sub, menuTag_New, TRUE);
+            FmXmlFileItem *old = _walk_children(levels, sub, menuTag_Old, FALSE);
+            sub = _walk_children(levels, sub, menuTag_New, TRUE);
             if (old != NULL && sub != NULL)
             {
                 GList *child = fm_xml_file_item_get_children(old);
@@ -1465,15 +1521,20 @@ restart:
                 while (child != NULL)
                 {
                     if (fm_xml_file_item_get_tag(child->data) != menuTag_Name)
+                    {
                         fm_xml_file_item_append_child(sub, child->data);
+                        _menu_level_add(levels, sub, child->data);
+                    }
                     child = g_list_delete_link(child, child);
                 }
+                _menu_level_remove(levels, old);
                 fm_xml_file_item_destroy(old);
             }
             else
                 DBG("invalid <Move> tag ignored");
         }
     }
+    g_hash_table_destroy(levels);
     /* reload children, they might be changed after movements */
     g_list_free(children);
     children = fm_xml_file_item_get_children(item);
@@ -1531,7 +1592,7 @@ static GList *_layout_items_copy(GList *orig)
     return g_list_reverse(copy);
 }
 
-static MenuMenu *_make_menu_node(FmXmlFileItem *node, MenuLayout *def)
+static MenuMenu *_make_menu_node(MenuCacheGen *gen, FmXmlFileItem *node, MenuLayout *def)
 {
     FmXmlFileItem *item = NULL;
     MenuLayout *layout = NULL;
@@ -1553,7 +1614,7 @@ static MenuMenu *_make_menu_node(FmXmlFileItem *node, MenuLayout *def)
         if (tag == menuTag_Layout)
             item = l->data;
         else if (tag == menuTag_DefaultLayout)
-            layout = _find_layout(l->data, FALSE);
+            layout = _find_layout(gen, l->data, FALSE);
         else if (tag == menuTag_Deleted)
             ok = FALSE;
         else if (tag == menuTag_NotDeleted)
@@ -1576,7 +1637,7 @@ static MenuMenu *_make_menu_node(FmXmlFileItem *node, MenuLayout *def)
     }
     /* find layout, if not found then fill from default */
     if (item != NULL)
-        layout = _find_layout(item, FALSE);
+        layout = _find_layout(gen, item, FALSE);
     if (layout == NULL)
         layout = def;
     menu = g_slice_new0(MenuMenu);
@@ -1598,7 +1659,7 @@ static MenuMenu *_make_menu_node(FmXmlFileItem *node, MenuLayout *def)
            * AppDir LegacyDir KDELegacyDirs */
         if (tag == menuTag_Menu)
         {
-            MenuMenu *child = _make_menu_node(l->data, def);
+            MenuMenu *child = _make_menu_node(gen, l->data, def);
             if (child != NULL)
             {
                 VDBG("*** added submenu %s", child->name);
@@ -1693,7 +1754,230 @@ static void _free_layout(gpointer data)
     g_slice_free(MenuLayout, data);
 }
 
-MenuMenu *get_merged_menu(const char *file, FmXmlFile **xmlfile, GError **error)
+/* tag ids are given by FmXmlFile in order of setting handlers so they are
+   the same for every file; they are saved once and only read after that, so
+   menus can be generated in few threads at once */
+static const struct
+{
+    const char *name;
+    FmXmlFileHandler handler;
+    FmXmlFileTag *tag;
+} menu_tags[] = {
+    { "Menu", &_menu_xml_handler_pass, &menuTag_Menu },
+    { "Include", &_menu_xml_handler_pass, &menuTag_Include },
+    { "Exclude", &_menu_xml_handler_pass, &menuTag_Exclude },
+    { "Filename", &_menu_xml_handler_Filename, &menuTag_Filename },
+    { "Or", &_menu_xml_handler_pass, &menuTag_Or },
+    { "And", &_menu_xml_handler_pass, &menuTag_And },
+    { "Not", &_menu_xml_handler_Not, &menuTag_Not },
+    { "Category", &_menu_xml_handler_pass, &menuTag_Category },
+    { "MergeFile", &_menu_xml_handler_MergeFile, &menuTag_MergeFile },
+    { "MergeDir", &_menu_xml_handler_MergeDir, &menuTag_MergeDir },
+    { "DefaultMergeDirs", &_menu_xml_handler_DefaultMergeDirs, &menuTag_DefaultMergeDirs },
+    { "KDELegacyDirs", &_menu_xml_handler_DefaultMergeDirs, &menuTag_KDELegacyDirs },
+    { "Name", &_menu_xml_handler_Name, &menuTag_Name },
+    { "Deleted", &_menu_xml_handler_pass, &menuTag_Deleted },
+    { "NotDeleted", &_menu_xml_handler_pass, &menuTag_NotDeleted },
+    { "Directory", &_menu_xml_handler_pass, &menuTag_Directory },
+    { "AppDir", &_menu_xml_handler_AppDir, &menuTag_AppDir },
+    { "DefaultAppDirs", &_menu_xml_handler_DefaultAppDirs, &menuTag_DefaultAppDirs },
+    { "DirectoryDir", &_menu_xml_handler_DirectoryDir, &menuTag_DirectoryDir },
+    { "DefaultDirectoryDirs", &_menu_xml_handler_DefaultDirectoryDirs, &menuTag_DefaultDirectoryDirs },
+    { "OnlyUnallocated", &_menu_xml_handler_pass, &menuTag_OnlyUnallocated },
+    { "NotOnlyUnallocated", &_menu_xml_handler_pass, &menuTag_NotOnlyUnallocated },
+    { "All", &_menu_xml_handler_pass, &menuTag_All },
+    { "LegacyDir", &_menu_xml_handler_LegacyDir, &menuTag_LegacyDir },
+    { "Move", &_menu_xml_handler_pass, &menuTag_Move },
+    { "Old", &_menu_xml_handler_pass, &menuTag_Old },
+    { "New", &_menu_xml_handler_pass, &menuTag_New },
+    { "Layout", &_menu_xml_handler_Layout, &menuTag_Layout },
+    { "DefaultLayout", &_menu_xml_handler_DefaultLayout, &menuTag_DefaultLayout },
+    { "Menuname", &_menu_xml_handler_Menuname, &menuTag_Menuname },
+    { "Separator", &_menu_xml_handler_Separator, &menuTag_Separator },
+    { "Merge", &_menu_xml_handler_Merge, &menuTag_Merge },
+};
+
+static FmXmlFile *_new_menu_file(void)
+{
+    static gsize tags_saved = 0;
+    FmXmlFile *menu = fm_xml_file_new(NULL);
+    FmXmlFileTag tag;
+    gboolean save = g_once_init_enter(&tags_saved);
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(menu_tags); i++)
+    {
+        tag = fm_xml_file_set_handler(menu, menu_tags[i].name,
+                                      menu_tags[i].handler, FALSE, NULL);
+        if (save)
+            *menu_tags[i].tag = tag;
+        else if (tag != *menu_tags[i].tag)
+            g_critical("menu-cache-gen: id of tag <%s> was changed", menu_tags[i].name);
+    }
+    if (save)
+        g_once_init_leave(&tags_saved, 1);
+    return menu;
+}
+
+/* The result of merge is saved into gen->merged_file with signatures of all
+   menu files and dirs it was made from. While none of them is changed the
+   saved tree is parsed instead of parsing and merging all the files. */
+#define MERGED_HEADER "MENU-CACHE-MERGED 2\n"
+
+static void _append_merged_key(GString *str, MenuCacheGen *gen, const char *file)
+{
+    char *dirs;
+
+    g_string_append(str, MERGED_HEADER);
+    g_string_append_printf(str, "I%s\n", file);
+    dirs = g_strjoinv(G_SEARCHPATH_SEPARATOR_S, gen->system_config_dirs);
+    g_string_append_printf(str, "C%s\t%s\n", gen->user_config_dir, dirs);
+    g_free(dirs);
+    dirs = g_strjoinv(G_SEARCHPATH_SEPARATOR_S, gen->system_data_dirs);
+    g_string_append_printf(str, "A%s\t%s\n", gen->user_data_dir, dirs);
+    g_free(dirs);
+}
+
+/* returns FALSE if state of some file cannot be trusted */
+static gboolean _append_merged_stamps(GString *str, GSList *list, char type,
+                                      gint64 since)
+{
+    gsize start;
+
+    for (; list; list = list->next)
+    {
+        g_string_append_c(str, type);
+        start = str->len;
+        file_stamp_append(str, type, list->data, since);
+        if (str->str[start] == '?')
+            return FALSE;
+        g_string_append_printf(str, "\t%s\n", (const char *)list->data);
+    }
+    return TRUE;
+}
+
+/* parsing saved tree finds dirs in order of the document, not in order they
+   were found while merging, so that order is saved as well */
+static void _append_merged_order(GString *str, GSList *list, char type)
+{
+    for (; list; list = list->next)
+        g_string_append_printf(str, "%c\t%s\n", type, (const char *)list->data);
+}
+
+static void _save_merged(MenuCacheGen *gen, const char *file, FmXmlFile *menu)
+{
+    GString *str = g_string_sized_new(4096);
+    GError *err = NULL;
+    char *data;
+    gsize len;
+
+    _append_merged_key(str, gen, file);
+    if (!_append_merged_stamps(str, gen->MenuFiles, 'F', gen->started - G_USEC_PER_SEC) ||
+        !_append_merged_stamps(str, gen->MenuDirs, 'D', gen->started - G_USEC_PER_SEC))
+    {
+        DBG("menu files were changed just now, merged menu is not saved");
+        g_string_free(str, TRUE);
+        return;
+    }
+    _append_merged_order(str, gen->AppDirs, 'a');
+    _append_merged_order(str, gen->DirDirs, 'd');
+    g_string_append_c(str, '\n');
+    data = fm_xml_file_to_data(menu, &len, NULL);
+    if (data != NULL)
+    {
+        g_string_append_len(str, data, len);
+        g_free(data);
+        if (!g_file_set_contents(gen->merged_file, str->str, str->len, &err))
+        {
+            DBG("cannot save merged menu: %s", err->message);
+            g_error_free(err);
+        }
+    }
+    g_string_free(str, TRUE);
+}
+
+/* returns XML data of saved merge if it's still valid for @file, lists of
+   files and dirs it was made from are returned in @files and @dirs, and
+   positions of AppDirs and DirDirs after merge in @order */
+static char *_load_merged(MenuCacheGen *gen, const char *file, gsize *len,
+                          GSList **files, GSList **dirs, GHashTable **order)
+{
+    GString *str;
+    char *contents, *line, *end = NULL, *path;
+    int i;
+    gboolean ok;
+
+    *files = *dirs = NULL;
+    if (!g_file_get_contents(gen->merged_file, &contents, len, NULL))
+        return NULL;
+    str = g_string_sized_new(256);
+    _append_merged_key(str, gen, file);
+    ok = (*len > str->len && memcmp(contents, str->str, str->len) == 0);
+    for (line = contents + str->len; ok; line = end + 1)
+    {
+        end = strchr(line, '\n');
+        if (end == NULL || end == line) /* no data or end of list */
+        {
+            ok = (end != NULL);
+            break;
+        }
+        *end = '\0';
+        if ((line[0] == 'a' || line[0] == 'd') && line[1] == '\t')
+        {
+            i = (line[0] == 'd');
+            g_hash_table_insert(order[i], (gpointer)g_intern_string(&line[2]),
+                                GUINT_TO_POINTER(g_hash_table_size(order[i]) + 1));
+            continue;
+        }
+        path = strchr(line, '\t');
+        if (path == NULL || (line[0] != 'F' && line[0] != 'D'))
+        {
+            ok = FALSE;
+            break;
+        }
+        *path++ = '\0';
+        g_string_truncate(str, 0);
+        file_stamp_append(str, line[0], path, gen->started - G_USEC_PER_SEC);
+        if (strcmp(str->str, &line[1]) != 0)
+        {
+            DBG("'%s' was changed, menu should be merged again", path);
+            ok = FALSE;
+        }
+        else if (line[0] == 'F')
+            *files = g_slist_prepend(*files, (gpointer)g_intern_string(path));
+        else
+            *dirs = g_slist_prepend(*dirs, (gpointer)g_intern_string(path));
+    }
+    g_string_free(str, TRUE);
+    if (!ok)
+    {
+        g_slist_free(*files);
+        g_slist_free(*dirs);
+        *files = *dirs = NULL;
+        g_hash_table_remove_all(order[0]);
+        g_hash_table_remove_all(order[1]);
+        g_free(contents);
+        return NULL;
+    }
+    *files = g_slist_reverse(*files);
+    *dirs = g_slist_reverse(*dirs);
+    /* leave only XML data */
+    *len -= end + 1 - contents;
+    memmove(contents, end + 1, *len + 1);
+    return contents;
+}
+
+static gint _merged_order_cmp(gconstpointer a, gconstpointer b, gpointer order)
+{
+    guint i = GPOINTER_TO_UINT(g_hash_table_lookup(order, a)) - 1;
+    guint j = GPOINTER_TO_UINT(g_hash_table_lookup(order, b)) - 1;
+
+    /* dirs which were not there while merging go last */
+    return (i < j) ? -1 : (i > j);
+}
+
+MenuMenu *get_merged_menu(MenuCacheGen *gen, const char *file, FmXmlFile **xmlfile,
+                          GError **error)
 {
     GFile *gf;
     char *contents;
@@ -1705,87 +1989,76 @@ MenuMenu *get_merged_menu(const char *file, FmXmlFile **xmlfile, GError **error)
     MenuLayout default_layout;
     MenuMerge def_files = { .type = MENU_CACHE_TYPE_NONE, .merge_type = MERGE_FILES };
     MenuMerge def_menus = { .type = MENU_CACHE_TYPE_NONE, .merge_type = MERGE_MENUS };
+    GSList *menu_files, *menu_dirs;
+    GHashTable *order[2]; /* AppDirs and DirDirs */
+    MenuCacheGenTime start;
     gboolean ok;
 
-    /* Load the file */
+    STATS_START(gen, start);
+    data.gen = gen;
     data.file_path = file;
+    /* Init layouts hash and all the data */
+    gen->layout_hash = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                             _free_layout);
+    /* Use saved merge if none of menu files was changed since */
+    order[0] = g_hash_table_new(g_direct_hash, g_direct_equal);
+    order[1] = g_hash_table_new(g_direct_hash, g_direct_equal);
+    if (gen->merged_file != NULL &&
+        (contents = _load_merged(gen, file, &len, &menu_files, &menu_dirs, order)) != NULL)
+    {
+        DBG("using merged menu from '%s'", gen->merged_file);
+        STATS_INC(gen, files_parsed);
+        data.menu = _new_menu_file();
+        data.line = data.pos = -1;
+        ok = fm_xml_file_parse_data(data.menu, contents, len, NULL, &data);
+        g_free(contents);
+        if (ok)
+            xml = fm_xml_file_finish_parse(data.menu, NULL);
+        apps = _find_in_children(xml, "Applications");
+        g_list_free(xml);
+        xml = NULL;
+        if (apps != NULL)
+        {
+            g_slist_free(gen->MenuFiles);
+            gen->MenuFiles = menu_files;
+            gen->MenuDirs = menu_dirs;
+            /* the same order as after merge, it affects the cache */
+            gen->AppDirs = g_slist_sort_with_data(gen->AppDirs, _merged_order_cmp, order[0]);
+            gen->DirDirs = g_slist_sort_with_data(gen->DirDirs, _merged_order_cmp, order[1]);
+            g_hash_table_destroy(order[0]);
+            g_hash_table_destroy(order[1]);
+            STATS_STOP(gen, start, load);
+            goto _make_menu;
+        }
+        /* the file is broken, drop all we got from it */
+        g_warning("saved merged menu '%s' is invalid", gen->merged_file);
+        g_object_unref(data.menu);
+        g_slist_free(menu_files);
+        g_slist_free(menu_dirs);
+        g_slist_free(gen->AppDirs);
+        g_slist_free(gen->DirDirs);
+        gen->AppDirs = gen->DirDirs = NULL;
+        gen->default_app_dirs_added = gen->default_dir_dirs_added = FALSE;
+        g_hash_table_remove_all(gen->layout_hash);
+    }
+    g_hash_table_destroy(order[0]);
+    g_hash_table_destroy(order[1]);
+    /* Load the file */
     gf = g_file_new_for_path(file);
     contents = NULL;
     ok = g_file_load_contents(gf, NULL, &contents, &len, NULL, error);
     g_object_unref(gf);
     if (!ok)
+    {
+        g_hash_table_destroy(gen->layout_hash);
+        gen->layout_hash = NULL;
         return NULL;
-    /* Init layouts hash and all the data */
-    layout_hash = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
-                                        _free_layout);
-    data.menu = fm_xml_file_new(NULL);
+    }
+    data.menu = _new_menu_file();
     data.line = data.pos = -1;
     /* g_debug("new FmXmlFile %p", data.menu); */
-    menuTag_Menu = fm_xml_file_set_handler(data.menu, "Menu",
-                                           &_menu_xml_handler_pass, FALSE, NULL);
-    menuTag_Include = fm_xml_file_set_handler(data.menu, "Include",
-                                              &_menu_xml_handler_pass, FALSE, NULL);
-    menuTag_Exclude = fm_xml_file_set_handler(data.menu, "Exclude",
-                                              &_menu_xml_handler_pass, FALSE, NULL);
-    menuTag_Filename = fm_xml_file_set_handler(data.menu, "Filename",
-                                               &_menu_xml_handler_Filename, FALSE, NULL);
-    menuTag_Or = fm_xml_file_set_handler(data.menu, "Or",
-                                         &_menu_xml_handler_pass, FALSE, NULL);
-    menuTag_And = fm_xml_file_set_handler(data.menu, "And",
-                                          &_menu_xml_handler_pass, FALSE, NULL);
-    menuTag_Not = fm_xml_file_set_handler(data.menu, "Not",
-                                          &_menu_xml_handler_Not, FALSE, NULL);
-    menuTag_Category = fm_xml_file_set_handler(data.menu, "Category",
-                                               &_menu_xml_handler_pass, FALSE, NULL);
-    menuTag_MergeFile = fm_xml_file_set_handler(data.menu, "MergeFile",
-                                                &_menu_xml_handler_MergeFile, FALSE, NULL);
-    menuTag_MergeDir = fm_xml_file_set_handler(data.menu, "MergeDir",
-                                               &_menu_xml_handler_MergeDir, FALSE, NULL);
-    menuTag_DefaultMergeDirs = fm_xml_file_set_handler(data.menu, "DefaultMergeDirs",
-                                                       &_menu_xml_handler_DefaultMergeDirs, FALSE, NULL);
-    menuTag_KDELegacyDirs = fm_xml_file_set_handler(data.menu, "KDELegacyDirs",
-                                                    &_menu_xml_handler_DefaultMergeDirs, FALSE, NULL);
-    menuTag_Name = fm_xml_file_set_handler(data.menu, "Name",
-                                           &_menu_xml_handler_Name, FALSE, NULL);
-    menuTag_Deleted = fm_xml_file_set_handler(data.menu, "Deleted",
-                                              &_menu_xml_handler_pass, FALSE, NULL);
-    menuTag_NotDeleted = fm_xml_file_set_handler(data.menu, "NotDeleted",
-                                                 &_menu_xml_handler_pass, FALSE, NULL);
-    menuTag_Directory = fm_xml_file_set_handler(data.menu, "Directory",
-                                                &_menu_xml_handler_pass, FALSE, NULL);
-    menuTag_AppDir = fm_xml_file_set_handler(data.menu, "AppDir",
-                                             &_menu_xml_handler_AppDir, FALSE, NULL);
-    menuTag_DefaultAppDirs = fm_xml_file_set_handler(data.menu, "DefaultAppDirs",
-                                                     &_menu_xml_handler_DefaultAppDirs, FALSE, NULL);
-    menuTag_DirectoryDir = fm_xml_file_set_handler(data.menu, "DirectoryDir",
-                                                   &_menu_xml_handler_DirectoryDir, FALSE, NULL);
-    menuTag_DefaultDirectoryDirs = fm_xml_file_set_handler(data.menu, "DefaultDirectoryDirs",
-                                                           &_menu_xml_handler_DefaultDirectoryDirs, FALSE, NULL);
-    menuTag_OnlyUnallocated = fm_xml_file_set_handler(data.menu, "OnlyUnallocated",
-                                                      &_menu_xml_handler_pass, FALSE, NULL);
-    menuTag_NotOnlyUnallocated = fm_xml_file_set_handler(data.menu, "NotOnlyUnallocated",
-                                                         &_menu_xml_handler_pass, FALSE, NULL);
-    menuTag_All = fm_xml_file_set_handler(data.menu, "All",
-                                          &_menu_xml_handler_pass, FALSE, NULL);
-    menuTag_LegacyDir = fm_xml_file_set_handler(data.menu, "LegacyDir",
-                                                &_menu_xml_handler_LegacyDir, FALSE, NULL);
-    menuTag_Move = fm_xml_file_set_handler(data.menu, "Move",
-                                           &_menu_xml_handler_pass, FALSE, NULL);
-    menuTag_Old = fm_xml_file_set_handler(data.menu, "Old",
-                                          &_menu_xml_handler_pass, FALSE, NULL);
-    menuTag_New = fm_xml_file_set_handler(data.menu, "New",
-                                          &_menu_xml_handler_pass, FALSE, NULL);
-    menuTag_Layout = fm_xml_file_set_handler(data.menu, "Layout",
-                                             &_menu_xml_handler_Layout, FALSE, NULL);
-    menuTag_DefaultLayout = fm_xml_file_set_handler(data.menu, "DefaultLayout",
-                                                    &_menu_xml_handler_DefaultLayout, FALSE, NULL);
-    menuTag_Menuname = fm_xml_file_set_handler(data.menu, "Menuname",
-                                               &_menu_xml_handler_Menuname, FALSE, NULL);
-    menuTag_Separator = fm_xml_file_set_handler(data.menu, "Separator",
-                                                &_menu_xml_handler_Separator, FALSE, NULL);
-    menuTag_Merge = fm_xml_file_set_handler(data.menu, "Merge",
-                                            &_menu_xml_handler_Merge, FALSE, NULL);
     /* Do parsing */
+    STATS_INC(gen, files_parsed);
     ok = fm_xml_file_parse_data(data.menu, contents, len, error, &data);
     g_free(contents);
     if (ok)
@@ -1807,15 +2080,21 @@ MenuMenu *get_merged_menu(const char *file, FmXmlFile **xmlfile, GError **error)
                             _("XML file doesn't contain Applications root"));
         goto _return_error;
     }
+    STATS_STOP(gen, start, load);
+    STATS_START(gen, start);
     if (!_activate_merges(&data, apps, error))
         goto _return_error;
+    if (gen->merged_file != NULL)
+        _save_merged(gen, file, data.menu);
+    STATS_STOP(gen, start, merge);
+_make_menu:
     /* FIXME: validate <Merge> tags */
     /* Create our menu tree -- no failures anymore! */
     memset(&default_layout, 0, sizeof(default_layout));
     default_layout.inline_header = TRUE;
     default_layout.inline_limit = 4;
     default_layout.items = g_list_prepend(g_list_prepend(NULL, &def_files), &def_menus);
-    menu = _make_menu_node(apps, &default_layout);
+    menu = _make_menu_node(gen, apps, &default_layout);
     g_list_free(default_layout.items);
     if (verbose > 2)
     {
@@ -1830,6 +2109,7 @@ _return_error:
     else
         /* keep XML file still since MenuRule elements use items in it */
         *xmlfile = data.menu;
-    g_hash_table_destroy(layout_hash);
+    g_hash_table_destroy(gen->layout_hash);
+    gen->layout_hash = NULL;
     return menu;
 }
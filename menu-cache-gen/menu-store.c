@@ -0,0 +1,512 @@
+/*
+ *      menu-store.c : keeps parsed desktop entries between generations.
+ *
+ *      This file is a part of libmenu-cache package and created program
+ *      should be not used without the library.
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "menu-tags.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+/* Entries are saved next to the cache file so the next run, either in the
+   same process or not, may reuse them. The file is memory-mapped and entry
+   is read from it only when the stat signature of its path still matches.
+   The format is:
+     "MENU-CACHE-APPS 2\t<languages>\n"
+   then for each entry:
+     "<path>\t<signature>\t<length of data>\n<data>"
+   where data is "N\n" for not an application, otherwise "A<flags>\n" and
+   lines for strings and lists as written by _put_string() and _put_list(),
+   the last list is of localized strings for each output if there are few */
+#define STORE_HEADER "MENU-CACHE-APPS 2\t"
+
+#define STORE_FLAG_TERMINAL     1
+#define STORE_FLAG_NOTIFICATION 2
+#define STORE_FLAG_NODISPLAY    4
+#define STORE_FLAG_DELETED      8
+
+typedef struct {
+    MenuApp *app;
+    char *stamp; /* signature of the file when it was parsed */
+    gboolean used : 1; /* the file is used by current generation */
+} StoreEntry;
+
+/* Entries and saved data are used only by the generator. Invalidation may
+   come from another thread while it runs so it only marks paths, those are
+   dropped from entries when the next generation begins. */
+struct _MenuCacheGenStore
+{
+    GHashTable *entries; /* path -> StoreEntry */
+    GHashTable *invalid; /* paths changed since last generation began */
+    char *lang; /* languages the entries were parsed for */
+    GMappedFile *map; /* entries saved by previous run */
+    GHashTable *index; /* path -> its record in map, past the path */
+    gboolean loaded : 1; /* saved entries were read already */
+    gboolean dirty : 1; /* entries differ from saved ones */
+};
+
+G_LOCK_DEFINE_STATIC(store);
+
+static void _store_entry_free(gpointer data)
+{
+    StoreEntry *entry = data;
+
+    menu_app_free(entry->app);
+    g_free(entry->stamp);
+    g_slice_free(StoreEntry, entry);
+}
+
+static void _store_unmap(MenuCacheGenStore *store)
+{
+    if (store->index)
+        g_hash_table_destroy(store->index);
+    store->index = NULL;
+    if (store->map)
+#if GLIB_CHECK_VERSION(2, 22, 0)
+        g_mapped_file_unref(store->map);
+#else
+        g_mapped_file_free(store->map);
+#endif
+    store->map = NULL;
+}
+
+MenuCacheGenStore *menu_cache_gen_store_new(void)
+{
+    MenuCacheGenStore *store = g_slice_new0(MenuCacheGenStore);
+
+    store->entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                           _store_entry_free);
+    store->invalid = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    return store;
+}
+
+void menu_cache_gen_store_free(MenuCacheGenStore *store)
+{
+    _store_unmap(store);
+    g_hash_table_destroy(store->entries);
+    g_hash_table_destroy(store->invalid);
+    g_free(store->lang);
+    g_slice_free(MenuCacheGenStore, store);
+}
+
+void menu_cache_gen_store_invalidate(MenuCacheGenStore *store, const char *path)
+{
+    if (path == NULL)
+        return;
+    G_LOCK(store);
+    g_hash_table_replace(store->invalid, g_strdup(path), NULL);
+    G_UNLOCK(store);
+}
+
+/* tests if @path or any its parent dir was invalidated, should be locked */
+static gboolean _is_invalid(MenuCacheGenStore *store, const char *path)
+{
+    char *dir, *sep;
+    gboolean found;
+
+    if (g_hash_table_size(store->invalid) == 0)
+        return FALSE;
+    if (g_hash_table_lookup_extended(store->invalid, path, NULL, NULL))
+        return TRUE;
+    /* a dir might be removed or replaced */
+    dir = g_strdup(path);
+    found = FALSE;
+    while (!found && (sep = strrchr(dir, G_DIR_SEPARATOR)) != NULL && sep != dir)
+    {
+        *sep = '\0';
+        found = g_hash_table_lookup_extended(store->invalid, dir, NULL, NULL);
+    }
+    g_free(dir);
+    return found;
+}
+
+static gboolean _drop_invalid(gpointer key, gpointer value, gpointer store)
+{
+    return _is_invalid(store, key);
+}
+
+/* reads index of entries saved in @file */
+static void _store_load(MenuCacheGenStore *store, const char *file)
+{
+    const char *p, *end, *sep, *nl;
+    gsize len;
+
+    store->loaded = TRUE;
+    store->map = g_mapped_file_new(file, FALSE, NULL);
+    if (store->map == NULL)
+        return;
+    p = g_mapped_file_get_contents(store->map);
+    end = p + g_mapped_file_get_length(store->map);
+    len = strlen(store->lang);
+    if ((gsize)(end - p) < sizeof(STORE_HEADER) + len ||
+        memcmp(p, STORE_HEADER, sizeof(STORE_HEADER) - 1) != 0 ||
+        memcmp(p + sizeof(STORE_HEADER) - 1, store->lang, len) != 0 ||
+        p[sizeof(STORE_HEADER) - 1 + len] != '\n')
+    {
+        /* it is for another languages or broken */
+        _store_unmap(store);
+        return;
+    }
+    p += sizeof(STORE_HEADER) + len;
+    store->index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    while (p < end && (nl = memchr(p, '\n', end - p)) != NULL)
+    {
+        const char *len_str;
+
+        sep = memchr(p, '\t', nl - p);
+        if (sep == NULL ||
+            (len_str = memchr(sep + 1, '\t', nl - sep - 1)) == NULL)
+            break;
+        len = strtoul(len_str + 1, NULL, 10);
+        if (len > (gsize)(end - nl - 1))
+            break; /* truncated file */
+        g_hash_table_replace(store->index, g_strndup(p, sep - p), (gpointer)(sep + 1));
+        p = nl + 1 + len;
+    }
+    VDBG("loaded %u saved entries", g_hash_table_size(store->index));
+}
+
+static gboolean _get_string(const char **p, const char *end, char **value)
+{
+    const char *nl = memchr(*p, '\n', end - *p);
+
+    if (nl == NULL || nl == *p)
+        return FALSE;
+    if (**p == '=')
+        *value = g_strndup(*p + 1, nl - *p - 1);
+    else if (**p == '-')
+        *value = NULL;
+    else
+        return FALSE;
+    *p = nl + 1;
+    return TRUE;
+}
+
+static gboolean _get_list(const char **p, const char *end, const char ***list)
+{
+    char *str;
+    const char **res;
+    guint i, n;
+
+    if (!_get_string(p, end, &str))
+        return FALSE;
+    if (str == NULL)
+    {
+        *list = NULL;
+        return TRUE;
+    }
+    n = strtoul(str, NULL, 10);
+    g_free(str);
+    *list = res = (const char **)g_new0(char *, n + 1);
+    for (i = 0; i < n; i++)
+    {
+        /* values are interned as parser does */
+        if (!_get_string(p, end, &str) || str == NULL)
+            return FALSE;
+        res[i] = g_intern_string(str);
+        g_free(str);
+    }
+    return TRUE;
+}
+
+static gboolean _get_l10n(const char **p, const char *end, MenuApp *app)
+{
+    char *str;
+    guint i;
+
+    if (!_get_string(p, end, &str))
+        return FALSE;
+    if (str == NULL)
+        return TRUE;
+    app->n_l10n = strtoul(str, NULL, 10);
+    g_free(str);
+    app->l10n = g_new0(MenuL10n, app->n_l10n);
+    for (i = 0; i < app->n_l10n; i++)
+        if (!_get_string(p, end, &app->l10n[i].title) ||
+            !_get_string(p, end, &app->l10n[i].comment) ||
+            !_get_string(p, end, &app->l10n[i].generic_name) ||
+            !_get_list(p, end, &app->l10n[i].keywords))
+            return FALSE;
+    return TRUE;
+}
+
+/* reads entry from @rec if its signature is @stamp */
+static MenuApp *_store_read(const char *rec, const char *stamp)
+{
+    gsize len = strlen(stamp);
+    const char *p, *end;
+    MenuApp *app;
+    guint flags;
+    gboolean ok;
+
+    if (strncmp(rec, stamp, len) != 0 || rec[len] != '\t')
+        return NULL;
+    rec += len + 1;
+    len = strtoul(rec, (char **)&p, 10);
+    if (len < 2)
+        return NULL;
+    p++; /* skip '\n' */
+    end = p + len;
+    app = g_slice_new0(MenuApp);
+    if (*p == 'N')
+    {
+        app->type = MENU_CACHE_TYPE_NONE;
+        return app;
+    }
+    app->type = MENU_CACHE_TYPE_APP;
+    flags = strtoul(p + 1, (char **)&p, 10);
+    p++;
+    app->use_terminal = (flags & STORE_FLAG_TERMINAL) != 0;
+    app->use_notification = (flags & STORE_FLAG_NOTIFICATION) != 0;
+    app->hidden = (flags & STORE_FLAG_NODISPLAY) != 0;
+    app->deleted = (flags & STORE_FLAG_DELETED) != 0;
+    ok = (_get_string(&p, end, &app->title) &&
+          _get_string(&p, end, &app->comment) &&
+          _get_string(&p, end, &app->icon) &&
+          _get_string(&p, end, &app->generic_name) &&
+          _get_string(&p, end, &app->exec) &&
+          _get_string(&p, end, &app->try_exec) &&
+          _get_string(&p, end, &app->wd) &&
+          _get_list(&p, end, &app->categories) &&
+          _get_list(&p, end, &app->keywords) &&
+          _get_list(&p, end, &app->show_in) &&
+          _get_list(&p, end, &app->hide_in) &&
+          _get_l10n(&p, end, app));
+    if (!ok)
+    {
+        menu_app_free(app);
+        return NULL;
+    }
+    return app;
+}
+
+static void _put_string(GString *str, const char *value)
+{
+    if (value == NULL)
+        g_string_append(str, "-\n");
+    else
+    {
+        g_string_append_c(str, '=');
+        g_string_append(str, value);
+        g_string_append_c(str, '\n');
+    }
+}
+
+static void _put_list(GString *str, const char **list)
+{
+    if (list == NULL)
+    {
+        g_string_append(str, "-\n");
+        return;
+    }
+    g_string_append_printf(str, "=%u\n", g_strv_length((char **)list));
+    while (*list)
+        _put_string(str, *list++);
+}
+
+static void _put_l10n(GString *str, const MenuApp *app)
+{
+    guint i;
+
+    if (app->l10n == NULL)
+    {
+        g_string_append(str, "-\n");
+        return;
+    }
+    g_string_append_printf(str, "=%u\n", app->n_l10n);
+    for (i = 0; i < app->n_l10n; i++)
+    {
+        _put_string(str, app->l10n[i].title);
+        _put_string(str, app->l10n[i].comment);
+        _put_string(str, app->l10n[i].generic_name);
+        _put_list(str, app->l10n[i].keywords);
+    }
+}
+
+static void _store_write(GString *str, const char *path, StoreEntry *entry)
+{
+    MenuApp *app = entry->app;
+    gsize start;
+    guint flags = 0;
+    char *len_str;
+
+    g_string_append_printf(str, "%s\t%s\t", path, entry->stamp);
+    start = str->len;
+    if (app->type != MENU_CACHE_TYPE_APP)
+        g_string_append(str, "N\n");
+    else
+    {
+        if (app->use_terminal)
+            flags |= STORE_FLAG_TERMINAL;
+        if (app->use_notification)
+            flags |= STORE_FLAG_NOTIFICATION;
+        if (app->hidden)
+            flags |= STORE_FLAG_NODISPLAY;
+        if (app->deleted)
+            flags |= STORE_FLAG_DELETED;
+        g_string_append_printf(str, "A%u\n", flags);
+        _put_string(str, app->title);
+        _put_string(str, app->comment);
+        _put_string(str, app->icon);
+        _put_string(str, app->generic_name);
+        _put_string(str, app->exec);
+        _put_string(str, app->try_exec);
+        _put_string(str, app->wd);
+        _put_list(str, app->categories);
+        _put_list(str, app->keywords);
+        _put_list(str, app->show_in);
+        _put_list(str, app->hide_in);
+        _put_l10n(str, app);
+    }
+    /* length goes before the data */
+    len_str = g_strdup_printf("%lu\n", (gulong)(str->len - start));
+    g_string_insert(str, start, len_str);
+    g_free(len_str);
+}
+
+void menu_cache_gen_store_begin(MenuCacheGenStore *store, const char *lang,
+                                const char *file)
+{
+    G_LOCK(store);
+    if (g_strcmp0(lang, store->lang) != 0)
+    {
+        /* localized strings were parsed for another language */
+        g_hash_table_remove_all(store->entries);
+        g_free(store->lang);
+        store->lang = g_strdup(lang);
+        store->loaded = FALSE;
+    }
+    else
+        g_hash_table_foreach_remove(store->entries, _drop_invalid, store);
+    g_hash_table_remove_all(store->invalid);
+    G_UNLOCK(store);
+    if (!store->loaded && file != NULL)
+    {
+        _store_unmap(store);
+        _store_load(store, file);
+    }
+}
+
+static gboolean _drop_unused(gpointer key, gpointer value, gpointer user_data)
+{
+    StoreEntry *entry = value;
+
+    if (entry->used)
+    {
+        entry->used = FALSE;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void _reset_used(gpointer key, gpointer value, gpointer user_data)
+{
+    ((StoreEntry *)value)->used = FALSE;
+}
+
+/* finishes generation, @file is NULL if it failed */
+void menu_cache_gen_store_end(MenuCacheGenStore *store, const char *file)
+{
+    GHashTableIter iter;
+    gpointer path, entry;
+    GString *str;
+
+    if (file == NULL)
+    {
+        /* keep everything for the next attempt */
+        g_hash_table_foreach(store->entries, _reset_used, NULL);
+        return;
+    }
+    /* forget files which aren't used anymore */
+    if (g_hash_table_foreach_remove(store->entries, _drop_unused, NULL) > 0 ||
+        (store->index && g_hash_table_size(store->index) != g_hash_table_size(store->entries)))
+        store->dirty = TRUE;
+    /* all used entries are read already */
+    _store_unmap(store);
+    if (!store->dirty)
+        return;
+    str = g_string_sized_new(65536);
+    g_string_append(str, STORE_HEADER);
+    g_string_append(str, store->lang);
+    g_string_append_c(str, '\n');
+    g_hash_table_iter_init(&iter, store->entries);
+    while (g_hash_table_iter_next(&iter, &path, &entry))
+        if (strpbrk(path, "\t\n") == NULL)
+            _store_write(str, path, entry);
+    if (g_file_set_contents(file, str->str, str->len, NULL))
+        store->dirty = FALSE;
+    DBG("saved %u parsed entries", g_hash_table_size(store->entries));
+    g_string_free(str, TRUE);
+}
+
+MenuApp *menu_cache_gen_store_lookup(MenuCacheGenStore *store, const char *path,
+                                     const char *stamp)
+{
+    StoreEntry *entry;
+    const char *rec;
+    MenuApp *app;
+
+    G_LOCK(store);
+    if (_is_invalid(store, path))
+        entry = NULL;
+    else if ((entry = g_hash_table_lookup(store->entries, path)) != NULL)
+    {
+        if (strcmp(entry->stamp, stamp) != 0)
+            entry = NULL; /* file was changed */
+    }
+    else if (store->index != NULL &&
+             (rec = g_hash_table_lookup(store->index, path)) != NULL &&
+             (app = _store_read(rec, stamp)) != NULL)
+    {
+        entry = g_slice_new0(StoreEntry);
+        entry->app = app;
+        entry->stamp = g_strdup(stamp);
+        g_hash_table_replace(store->entries, g_strdup(path), entry);
+    }
+    if (entry)
+        entry->used = TRUE;
+    G_UNLOCK(store);
+    return entry ? entry->app : NULL;
+}
+
+gboolean menu_cache_gen_store_add(MenuCacheGenStore *store, const char *path,
+                                  const char *stamp, MenuApp *app)
+{
+    StoreEntry *entry;
+    gboolean ok;
+
+    G_LOCK(store);
+    /* file was changed while we parsed it, don't keep the result */
+    ok = !_is_invalid(store, path);
+    if (ok)
+    {
+        entry = g_slice_new0(StoreEntry);
+        entry->app = app;
+        entry->stamp = g_strdup(stamp);
+        entry->used = TRUE;
+        g_hash_table_replace(store->entries, g_strdup(path), entry);
+        store->dirty = TRUE;
+    }
+    G_UNLOCK(store);
+    return ok;
+}
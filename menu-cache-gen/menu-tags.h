@@ -22,6 +22,8 @@
 #include <libfm/fm-extra.h>
 #include <menu-cache.h>
 
+#include "menu-gen.h"
+
 extern FmXmlFileTag menuTag_AppDir;
 extern FmXmlFileTag menuTag_DirectoryDir;
 extern FmXmlFileTag menuTag_Include;
@@ -82,6 +84,14 @@ typedef struct {
     MenuMergeType merge_type;
 } MenuMerge;
 
+/* localized strings for one of languages, see MenuCacheGen::n_langs */
+typedef struct {
+    char *title;
+    char *comment;
+    char *generic_name; /* only for MenuApp */
+    const char **keywords; /* only for MenuApp, values are interned */
+} MenuL10n;
+
 /* Menu item */
 typedef struct {
     MenuLayout layout; /* copied from hash on </Menu> */
@@ -95,6 +105,7 @@ typedef struct {
     char *comment;
     char *icon;
     const char *dir;
+    const MenuL10n *l10n; /* from .directory file if there are few languages */
 } MenuMenu;
 
 /* File item in menu */
@@ -106,8 +117,10 @@ typedef struct {
     gboolean use_terminal : 1;
     gboolean use_notification : 1;
     gboolean hidden : 1;
+    gboolean deleted : 1; /* for parsed entry: Hidden=true */
     GList *dirs; /* can be reordered until allocated */
-    GList *menus;
+    guint n_menus; /* how many times it was added into menus */
+    guint n_composed; /* n_menus after _stage1() */
     char *filename; /* if NULL then is equal to id */
     char *key; /* for sorting */
     char *id;
@@ -122,42 +135,163 @@ typedef struct {
     const char **keywords;
     const char **show_in;
     const char **hide_in;
+    guint32 *cat_bits; /* categories as bits by MenuCacheGen::category_ids */
+    MenuL10n *l10n; /* for each language if there are few, see MenuCacheGen */
+    guint n_l10n;
 } MenuApp;
 
+/* compiled matching rule, operands follow the operation */
+typedef enum {
+    RULE_OP_OR, /* arg is number of operands */
+    RULE_OP_AND,
+    RULE_OP_NOT,
+    RULE_OP_ALL,
+    RULE_OP_CATEGORY, /* arg is category id */
+    RULE_OP_FILENAME /* id is the file id */
+} MenuRuleOpType;
+
+typedef struct {
+    MenuRuleOpType op;
+    guint arg;
+    guint size; /* number of operations including operands */
+    const char *id;
+} MenuRuleOp;
+
 /* a placeholder for matching */
 typedef struct {
     MenuCacheType type : 2; /* MENU_CACHE_TYPE_NONE */
     FmXmlFileItem *rule;
+    MenuRuleOp *ops; /* compiled <Include> or <Exclude> */
 } MenuRule;
 
-/* requested language(s) */
-extern char **languages;
+/* context of single cache generation */
+typedef struct {
+    /* environment */
+    char **locales; /* languages to look for translations */
+    MenuCacheGenOutput *outputs; /* caches to write */
+    guint n_outputs;
+    guint *output_lang; /* index of language for each of outputs */
+    guint n_langs; /* number of different languages of outputs */
+    char ***lang_locales; /* locales for each language if there are few */
+    char *user_config_dir;
+    char **system_config_dirs;
+    char *user_data_dir;
+    char **system_data_dirs;
+    guint req_version; /* requested minor version of format */
+    gboolean with_hidden; /* "+hidden" menu, for all outputs */
+    /* list of menu files to monitor */
+    GSList *MenuFiles;
+    /* list of menu dirs to monitor */
+    GSList *MenuDirs;
+    /* list of available app dirs */
+    GSList *AppDirs;
+    /* list of available dir dirs */
+    GSList *DirDirs;
+    /* merge data */
+    char *merged_file; /* where result of merge is saved, may be NULL */
+    GHashTable *layout_hash; /* we keep all the unfinished items in the hash */
+    gboolean default_app_dirs_added : 1;
+    gboolean default_dir_dirs_added : 1;
+    /* compose data */
+    GHashTable *all_apps;
+    GHashTable *category_ids; /* interned name -> id + 1 */
+    guint n_categories;
+    GPtrArray **category_apps; /* by category id, built when needed */
+    GHashTable *dir_listings; /* dir -> set of .directory files in it */
+    GHashTable *dir_files; /* path -> parsed .directory file */
+    GHashTable *app_dir_index; /* dir -> position + 1 in AppDirs */
+    GHashTable *dir_dir_index; /* dir -> position + 1 in DirDirs */
+    int n_dir_dirs;
+    GSList *DEs;
+    GSList *loaded_dirs;
+    MenuCacheGenStore *store; /* may be NULL */
+    gint64 started; /* real time when generation started */
+    MenuCacheGenStats *stats; /* may be NULL */
+} MenuCacheGen;
 
-/* list of menu files to monitor */
-extern GSList *MenuFiles;
+/* stats are collected only if requested; counters may be updated from
+   parser threads */
+void gen_stats_now(MenuCacheGenTime *now);
+void gen_stats_add(MenuCacheGenTime *stage, const MenuCacheGenTime *start);
+#define STATS_START(gen,start) do { if ((gen)->stats) gen_stats_now(&(start)); } while (0)
+#define STATS_STOP(gen,start,stage) do { \
+    if ((gen)->stats) gen_stats_add(&(gen)->stats->stage, &(start)); } while (0)
+#define STATS_INC(gen,counter) do { \
+    if ((gen)->stats) g_atomic_int_inc(&(gen)->stats->counter); } while (0)
 
-/* list of menu dirs to monitor */
-extern GSList *MenuDirs;
+/* parse and merge menu files */
+MenuMenu *get_merged_menu(MenuCacheGen *gen, const char *file, FmXmlFile **xmlfile,
+                          GError **error);
 
-/* list of available app dirs */
-extern GSList *AppDirs;
+/* parse all files into layout and save cache files, one for each output */
+gboolean save_menu_cache(MenuCacheGen *gen, MenuMenu *layout, const char *menuname,
+                         GError **error);
 
-/* list of available dir dirs */
-extern GSList *DirDirs;
+/* free MenuApp data */
+void menu_app_free(gpointer data);
 
-/* parse and merge menu files */
-MenuMenu *get_merged_menu(const char *file, FmXmlFile **xmlfile, GError **error);
+/* store of parsed entries, each MenuApp in it is MENU_CACHE_TYPE_APP if the
+   file is an application and MENU_CACHE_TYPE_NONE otherwise; entries are
+   matched by stat signature and saved into @file between runs; @lang
+   describes languages the entries are localized for */
+void menu_cache_gen_store_begin(MenuCacheGenStore *store, const char *lang,
+                                const char *file);
+void menu_cache_gen_store_end(MenuCacheGenStore *store, const char *file);
+MenuApp *menu_cache_gen_store_lookup(MenuCacheGenStore *store, const char *path,
+                                     const char *stamp);
+gboolean menu_cache_gen_store_add(MenuCacheGenStore *store, const char *path,
+                                  const char *stamp, MenuApp *entry);
+
+/* parser of desktop entry files which keeps only @keys for @locales */
+typedef struct _DesktopEntry DesktopEntry;
+
+DesktopEntry *desktop_entry_load(const char *path, const char * const *keys,
+                                 const char * const *locales);
+/* loads @path relative to @dir_fd, @size is its expected size or 0 */
+DesktopEntry *desktop_entry_load_at(int dir_fd, const char *path, gsize size,
+                                    const char * const *keys,
+                                    const char * const *locales);
+/* the same for file open as @fd, it's read from current position and left open */
+DesktopEntry *desktop_entry_load_fd(int fd, gsize size, const char * const *keys,
+                                    const char * const *locales);
+void desktop_entry_free(DesktopEntry *de);
+char *desktop_entry_get_string(DesktopEntry *de, const char *key, gboolean localized);
+char **desktop_entry_get_string_list(DesktopEntry *de, const char *key,
+                                     gboolean localized, gsize *len);
+/* the same but for @locales which are subset of ones used for loading */
+char *desktop_entry_get_locale_string(DesktopEntry *de, const char *key,
+                                      const char * const *locales);
+char **desktop_entry_get_locale_string_list(DesktopEntry *de, const char *key,
+                                            const char * const *locales, gsize *len);
+gboolean desktop_entry_get_boolean(DesktopEntry *de, const char *key);
+
+/* parse data of desktop entry file, @contents is changed by parser */
+DesktopEntry *desktop_entry_parse(char *contents, gsize len, const char * const *keys,
+                                  const char * const *locales);
 
-/* parse all files into layout and save cache file */
-gboolean save_menu_cache(MenuMenu *layout, const char *menuname, const char *file,
-                         gboolean with_hidden);
+#ifdef HAVE_LIBURING
+#include <sys/stat.h>
+
+/* file for batched requests to io_uring, results are -EAGAIN for those
+   which were not done, caller should handle them synchronously */
+typedef struct {
+    int dir_fd;
+    const char *name;
+    struct statx stx; /* set by uring_stat_files() */
+    gsize size; /* expected size for uring_read_files() */
+    int fd;
+    char *contents; /* set by uring_read_files(), nul-terminated */
+    gsize len;
+    int result; /* 0 or -errno */
+} UringFile;
+
+gboolean uring_stat_files(UringFile *files, guint n);
+gboolean uring_read_files(UringFile *files, guint n);
+#endif
 
 /* free MenuLayout data */
 void _free_layout_items(GList *data);
 
-/* verbosity level */
-extern gint verbose;
-
 #define DBG if (verbose) g_debug
 #define VDBG if (verbose > 1) g_debug
 #define VVDBG if (verbose > 2) g_debug
@@ -0,0 +1,196 @@
+/*
+ *      uring-read.c : batched stat and read of files with io_uring.
+ *
+ *      This file is a part of libmenu-cache package and created program
+ *      should be not used without the library.
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2.1 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "menu-tags.h"
+
+#ifdef HAVE_LIBURING
+
+#include <liburing.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* On a cold page cache reading files one by one waits for the disk each
+   time. Here requests for all files are queued at once so the device
+   queue is kept full. Any file which fails here is left for the caller
+   to handle synchronously, so a kernel without support for some of the
+   operations only makes it slower. */
+
+#define URING_DEPTH 64
+
+/* user data: index of file, shifted to make room for the operation */
+#define OP_STATX 0
+#define OP_OPEN 1
+#define OP_READ 2
+#define OP_SHIFT 2
+
+static int _submit_and_wait(struct io_uring *ring)
+{
+    int res;
+
+    while ((res = io_uring_submit_and_wait(ring, 1)) == -EINTR);
+    return res;
+}
+
+gboolean uring_stat_files(UringFile *files, guint n)
+{
+    struct io_uring ring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    guint i, submitted = 0, done = 0;
+
+    for (i = 0; i < n; i++)
+        files[i].result = -EAGAIN;
+    if (io_uring_queue_init(URING_DEPTH, &ring, 0) < 0)
+        return FALSE;
+    while (done < n)
+    {
+        while (submitted < n && submitted - done < URING_DEPTH &&
+               (sqe = io_uring_get_sqe(&ring)) != NULL)
+        {
+            io_uring_prep_statx(sqe, files[submitted].dir_fd, files[submitted].name,
+                                AT_STATX_SYNC_AS_STAT,
+                                STATX_INO | STATX_SIZE | STATX_MTIME,
+                                &files[submitted].stx);
+            io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(submitted << OP_SHIFT | OP_STATX));
+            submitted++;
+        }
+        if (_submit_and_wait(&ring) < 0)
+            break;
+        while (io_uring_peek_cqe(&ring, &cqe) == 0)
+        {
+            i = GPOINTER_TO_UINT(io_uring_cqe_get_data(cqe)) >> OP_SHIFT;
+            files[i].result = cqe->res;
+            io_uring_cqe_seen(&ring, cqe);
+            done++;
+        }
+    }
+    io_uring_queue_exit(&ring);
+    return (done == n);
+}
+
+static void _submit_read(struct io_uring *ring, UringFile *file, guint i)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+
+    /* the ring has room since each file has at most one request in it */
+    io_uring_prep_read(sqe, file->fd, file->contents + file->len,
+                       file->size + 1 - file->len, file->len);
+    io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(i << OP_SHIFT | OP_READ));
+}
+
+static void _read_failed(UringFile *file, int result)
+{
+    if (file->fd >= 0)
+        close(file->fd);
+    file->fd = -1;
+    g_free(file->contents);
+    file->contents = NULL;
+    file->result = result;
+}
+
+gboolean uring_read_files(UringFile *files, guint n)
+{
+    struct io_uring ring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    UringFile *file;
+    guint i, op, submitted = 0, done = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        files[i].fd = -1;
+        files[i].contents = NULL;
+        files[i].len = 0;
+        files[i].result = -EAGAIN;
+    }
+    if (io_uring_queue_init(URING_DEPTH, &ring, 0) < 0)
+        return FALSE;
+    while (done < n)
+    {
+        while (submitted < n && submitted - done < URING_DEPTH &&
+               (sqe = io_uring_get_sqe(&ring)) != NULL)
+        {
+            io_uring_prep_openat(sqe, files[submitted].dir_fd, files[submitted].name,
+                                 O_RDONLY | O_CLOEXEC, 0);
+            io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(submitted << OP_SHIFT | OP_OPEN));
+            submitted++;
+        }
+        if (_submit_and_wait(&ring) < 0)
+            break;
+        while (io_uring_peek_cqe(&ring, &cqe) == 0)
+        {
+            i = GPOINTER_TO_UINT(io_uring_cqe_get_data(cqe));
+            op = i & ((1 << OP_SHIFT) - 1);
+            file = &files[i >> OP_SHIFT];
+            if (cqe->res < 0)
+            {
+                _read_failed(file, cqe->res);
+                done++;
+            }
+            else if (op == OP_OPEN)
+            {
+                file->fd = cqe->res;
+                file->contents = g_malloc(file->size + 1);
+                _submit_read(&ring, file, i >> OP_SHIFT);
+            }
+            else if (cqe->res > 0 && file->len + cqe->res < file->size)
+            {
+                /* short read, continue */
+                file->len += cqe->res;
+                _submit_read(&ring, file, i >> OP_SHIFT);
+            }
+            else
+            {
+                file->len += cqe->res;
+                if (file->len > file->size)
+                    /* file grew since stat, let caller read it again */
+                    _read_failed(file, -EAGAIN);
+                else
+                {
+                    close(file->fd);
+                    file->fd = -1;
+                    file->contents[file->len] = '\0';
+                    file->result = 0;
+                }
+                done++;
+            }
+            io_uring_cqe_seen(&ring, cqe);
+        }
+    }
+    /* drop what was not completed, buffers of reads still in progress are
+       leaked since the kernel may yet write into them */
+    if (done < n)
+        for (i = 0; i < n; i++)
+            if (files[i].result == -EAGAIN && files[i].fd >= 0)
+            {
+                files[i].contents = NULL;
+                _read_failed(&files[i], -EAGAIN);
+            }
+    io_uring_queue_exit(&ring);
+    return (done == n);
+}
+
+#endif /* HAVE_LIBURING */
@@ -0,0 +1,85 @@
+#!/bin/sh
+#
+# merge-bench.sh : times menu-cache-gen on a menu with many fragments in
+# applications-merged dir.
+#
+# Usage: tools/merge-bench.sh [-n "N1 N2..."] MENU_CACHE_GEN [MENU_CACHE_GEN...]
+#
+# For each count of fragments (100 200 400 800 by default) a fixture is made
+# where every fragment adds own submenu into one of 50 shared groups, so
+# merging has to match many sibling menus by name. Each given binary is run
+# on it and wall time is printed in milliseconds; if the time grows about
+# twice for twice as many fragments then merging is linear. Saved merged
+# tree is removed before each run so it's not reused.
+
+counts="100 200 400 800"
+if [ "$1" = "-n" ]; then
+    counts=$2
+    shift 2
+fi
+if [ $# -eq 0 ]; then
+    echo "usage: $0 [-n \"N1 N2...\"] MENU_CACHE_GEN [MENU_CACHE_GEN...]" >&2
+    exit 1
+fi
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+export XDG_CONFIG_DIRS="$tmp/config"
+export XDG_DATA_DIRS="$tmp/data"
+export XDG_CONFIG_HOME="$tmp/home/config"
+export XDG_DATA_HOME="$tmp/home/data"
+unset XDG_MENU_PREFIX
+
+now_ms()
+{
+    echo $(($(date +%s%N) / 1000000))
+}
+
+for n in $counts; do
+    rm -rf "$tmp/config" "$tmp/home" "$tmp/apps"
+    merged="$tmp/home/config/menus/applications-merged"
+    mkdir -p "$tmp/apps" "$tmp/config/menus" "$merged" "$tmp/home/data" "$tmp/data"
+    cat > "$tmp/config/menus/applications.menu" <<EOF
+<!DOCTYPE Menu PUBLIC "-//freedesktop//DTD Menu 1.0//EN"
+ "http://www.freedesktop.org/standards/menu-spec/menu-1.0.dtd">
+<Menu>
+  <Name>Applications</Name>
+  <AppDir>$tmp/apps</AppDir>
+  <DefaultMergeDirs/>
+</Menu>
+EOF
+    i=0
+    while [ $i -lt "$n" ]; do
+        cat > "$tmp/apps/app$i.desktop" <<EOF
+[Desktop Entry]
+Type=Application
+Name=Application $i
+Exec=true
+EOF
+        cat > "$merged/fragment$i.menu" <<EOF
+<!DOCTYPE Menu PUBLIC "-//freedesktop//DTD Menu 1.0//EN"
+ "http://www.freedesktop.org/standards/menu-spec/menu-1.0.dtd">
+<Menu>
+  <Name>Applications</Name>
+  <Menu>
+    <Name>Group$((i % 50))</Name>
+    <Menu>
+      <Name>Fragment$i</Name>
+      <Include><Filename>app$i.desktop</Filename></Include>
+    </Menu>
+  </Menu>
+</Menu>
+EOF
+        i=$((i + 1))
+    done
+    for gen in "$@"; do
+        rm -f "$tmp/out" "$tmp/out.entries" "$tmp/out.merged"
+        start=$(now_ms)
+        if "$gen" -i applications.menu -o "$tmp/out" -l en_US; then
+            echo "$gen: $n fragments: $(($(now_ms) - start)) ms"
+        else
+            echo "$gen: $n fragments: failed"
+        fi
+    done
+done
@@ -0,0 +1,87 @@
+#!/bin/sh
+#
+# syscall-count.sh : counts syscalls made by menu-cache-gen on a fixture
+# apps dir, with strace -c -f.
+#
+# Usage: tools/syscall-count.sh [-n N_APPS] MENU_CACHE_GEN [MENU_CACHE_GEN...]
+#
+# Each given binary (for example one built before a change and one after)
+# is run twice on the same fixture: first without saved entries, then again
+# when entries are reused from the store. Summary of strace is printed for
+# each run, so numbers before and after can be compared.
+
+n_apps=500
+if [ "$1" = "-n" ]; then
+    n_apps=$2
+    shift 2
+fi
+if [ $# -eq 0 ]; then
+    echo "usage: $0 [-n N_APPS] MENU_CACHE_GEN [MENU_CACHE_GEN...]" >&2
+    exit 1
+fi
+if ! command -v strace >/dev/null 2>&1; then
+    echo "$0: strace is required" >&2
+    exit 1
+fi
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+# fixture: N apps in few categories, with a subdir, and a simple menu
+mkdir -p "$tmp/apps/sub" "$tmp/config/menus" "$tmp/home/config" "$tmp/home/data" \
+    "$tmp/data"
+i=0
+while [ $i -lt "$n_apps" ]; do
+    case $((i % 10)) in
+        0) dir="$tmp/apps/sub" ;;
+        *) dir="$tmp/apps" ;;
+    esac
+    cat > "$dir/app$i.desktop" <<EOF
+[Desktop Entry]
+Type=Application
+Name=Application $i
+Name[de]=Anwendung $i
+Comment=Fixture application number $i
+Exec=true %U
+Icon=app$i
+Categories=Cat$((i % 7));
+EOF
+    i=$((i + 1))
+done
+cat > "$tmp/config/menus/applications.menu" <<EOF
+<!DOCTYPE Menu PUBLIC "-//freedesktop//DTD Menu 1.0//EN"
+ "http://www.freedesktop.org/standards/menu-spec/menu-1.0.dtd">
+<Menu>
+  <Name>Applications</Name>
+  <AppDir>$tmp/apps</AppDir>
+  <Include><All/></Include>
+EOF
+i=0
+while [ $i -lt 7 ]; do
+    cat >> "$tmp/config/menus/applications.menu" <<EOF
+  <Menu>
+    <Name>Cat$i</Name>
+    <Include><Category>Cat$i</Category></Include>
+  </Menu>
+EOF
+    i=$((i + 1))
+done
+echo "</Menu>" >> "$tmp/config/menus/applications.menu"
+# entries of files changed within last second aren't saved
+sleep 2
+
+export XDG_CONFIG_DIRS="$tmp/config"
+export XDG_DATA_DIRS="$tmp/data"
+export XDG_CONFIG_HOME="$tmp/home/config"
+export XDG_DATA_HOME="$tmp/home/data"
+unset XDG_MENU_PREFIX
+
+for gen in "$@"; do
+    rm -f "$tmp/out" "$tmp/out.entries" "$tmp/out.merged"
+    for run in first again; do
+        echo "=== $gen, $n_apps apps, $run run"
+        strace -c -f -o "$tmp/strace.txt" "$gen" -i applications.menu \
+            -o "$tmp/out" -l en_US || echo "(menu-cache-gen failed)"
+        cat "$tmp/strace.txt"
+    done
+done